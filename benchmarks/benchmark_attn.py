@@ -10,14 +10,13 @@ except ImportError:
 from einops import rearrange
 
 from flash_attn.cute.bench_utils import (
-    flops,
-    bandwidth_fwd_bytes,
-    bandwidth_bwd_bytes,
     attention_ref,
     cudnn_fwd_setup,
     cudnn_bwd_setup,
 )
 
+from flash_attn.utils.attention_flops import attention_bytes, attention_flops
+
 try:
     from flash_attn.flash_attn_interface import flash_attn_func, flash_attn_varlen_func
 except ImportError:
@@ -541,15 +540,20 @@ def main():
             has_qv = (headdim == 64 and headdim_v == 512)
             seqlen_k_eff = gather_kv_eff if gather_kv_eff is not None else seqlen
             causal_eff = False if gather_kv_eff is not None else causal
-            nFLOPS = flops(batch_size, nheads, seqlen_q, seqlen_k_eff, headdim, headdim_v, causal=causal_eff, has_qv=has_qv)
+            cu_seqlens_q = list(range(0, (batch_size + 1) * seqlen_q, seqlen_q))
+            cu_seqlens_k = list(range(0, (batch_size + 1) * seqlen, seqlen))
+            cu_seqlens_k_eff = list(range(0, (batch_size + 1) * seqlen_k_eff, seqlen_k_eff))
+            # With qv, the scores are q @ k^T + qv @ v^T
+            nFLOPS = attention_flops(cu_seqlens_q, cu_seqlens_k_eff, nheads,
+                                     headdim + headdim_v if has_qv else headdim, headdim_v,
+                                     causal=causal_eff, window_size=window_size)
             dtype_bytes = 1 if dtype == torch.float8_e4m3fn else 2
-            if direction == "FWD":
-                nbytes = bandwidth_fwd_bytes(batch_size, nheads, nheads_kv, seqlen_q, seqlen,
-                                             headdim, headdim_v, dtype_bytes=dtype_bytes,
-                                             has_qv=has_qv, shared_kv=shared_kv)
-            else:
-                nbytes = bandwidth_bwd_bytes(batch_size, nheads, nheads_kv, seqlen_q, seqlen,
-                                             headdim, headdim_v, dtype_bytes=dtype_bytes)
+            nbytes = attention_bytes(cu_seqlens_q, cu_seqlens_k, nheads, nheads_kv, headdim,
+                                     headdim_v, dtype_bytes=dtype_bytes, mode=direction.lower())
+            if direction == "FWD" and has_qv:
+                nbytes += batch_size * seqlen_q * nheads * headdim_v * dtype_bytes
+            if direction == "FWD" and shared_kv:
+                nbytes -= batch_size * seqlen * nheads_kv * headdim_v * dtype_bytes
             hdim_str = str(headdim) if headdim == headdim_v else f"{headdim}-{headdim_v}"
             row = f"{hdim_str:>9} {str(causal):>6} {batch_size:>5}"
             if show_seqlen_q_col:
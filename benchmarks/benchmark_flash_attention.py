@@ -10,6 +10,7 @@ from einops import rearrange, repeat
 
 from flash_attn.utils.benchmark import benchmark_all, benchmark_forward, benchmark_backward
 from flash_attn.utils.benchmark import benchmark_fwd_bwd, benchmark_combined
+from flash_attn.utils.attention_flops import attention_flops
 
 from flash_attn import flash_attn_qkvpacked_func
 
@@ -26,8 +27,8 @@ except ImportError:
 
 def flops(batch, seqlen, headdim, nheads, causal, mode="fwd"):
     assert mode in ["fwd", "bwd", "fwd_bwd"]
-    f = 4 * batch * seqlen**2 * nheads * headdim // (2 if causal else 1)
-    return f if mode == "fwd" else (2.5 * f if mode == "bwd" else 3.5 * f)
+    cu_seqlens = list(range(0, (batch + 1) * seqlen, seqlen))
+    return attention_flops(cu_seqlens, cu_seqlens, nheads, headdim, causal=causal, mode=mode)
 
 def efficiency(flop, time):
     return (flop / time / 10**12) if not math.isnan(time) else 0.0
@@ -174,20 +174,39 @@ def unpad_input_for_concatenated_sequences(hidden_states, attention_mask_in_leng
     Arguments:
         hidden_states: (batch, seqlen, ...)
         attention_mask_in_length: (batch, seqlen), int, a nonzero number (e.g., 1, 2, 3, etc.) means length of concatenated sequence in b-th batch, and 0 means none.
+            Zeros may also appear between nonzero entries (e.g. [2, 0, 3, 0, 0, 0]), which happens when
+            the packer emits empty documents; they are skipped.
     Return:
         hidden_states: (total_nnz, ...), where total_nnz = number of tokens in selected in attention_mask.
         indices: (total_nnz), the indices of non-masked tokens from the flattened input sequence.
         cu_seqlens: (batch + 1), the cumulative sequence lengths, used to index into hidden_states.
         max_seqlen_in_batch: int
     """
-    length = attention_mask_in_length.sum(dim=-1)
-    seqlen = attention_mask_in_length.size(-1)
-    attention_mask_2d = torch.arange(seqlen, device=length.device, dtype=length.dtype).expand(len(length), seqlen) < length.unsqueeze(1)
-    real_indices_idx = torch.nonzero(attention_mask_in_length.flatten(), as_tuple=False).flatten()
-    seqlens_in_batch = attention_mask_in_length.flatten()[real_indices_idx]
-    indices = torch.nonzero(attention_mask_2d.flatten(), as_tuple=False).flatten()
-    max_seqlen_in_batch = seqlens_in_batch.max().item()
+    batch, seqlen = attention_mask_in_length.shape
+    device = attention_mask_in_length.device
+    lengths_flat = attention_mask_in_length.flatten()
+    # Zero entries are either padding or empty documents emitted by the packer. Neither owns any
+    # token, so they are dropped and don't show up as (empty) sequences in cu_seqlens.
+    real_indices_idx = torch.nonzero(lengths_flat, as_tuple=False).flatten()
+    seqlens_in_batch = lengths_flat[real_indices_idx].to(torch.int32)
     cu_seqlens = F.pad(torch.cumsum(seqlens_in_batch, dim=0, dtype=torch.int32), (1, 0))
+    if seqlens_in_batch.numel() > 0:
+        # Grab both scalars with a single device -> host copy.
+        max_seqlen_in_batch, total_nnz = torch.stack(
+            [seqlens_in_batch.max(), cu_seqlens[-1]]
+        ).tolist()
+    else:  # Every row is empty
+        max_seqlen_in_batch, total_nnz = 0, 0
+    # The documents of a row are packed from the start of the row, so the t-th valid token of the
+    # batch that lives in row b sits at b * seqlen + (t - number of valid tokens before row b).
+    # Building indices this way is O(total_nnz) instead of materializing a (batch, seqlen) mask.
+    row_lengths = attention_mask_in_length.sum(dim=-1)
+    row_offsets = torch.arange(batch, device=device, dtype=torch.long) * seqlen - F.pad(
+        torch.cumsum(row_lengths, dim=0, dtype=torch.long)[:-1], (1, 0)
+    )
+    indices = torch.arange(total_nnz, device=device, dtype=torch.long) + torch.repeat_interleave(
+        row_offsets, row_lengths, output_size=total_nnz
+    )
     # TD [2022-03-04] We don't want to index with a bool mask, because Pytorch will expand the
     # bool mask, then call nonzero to get the indices, then index with those. The indices is @dim
     # times larger than it needs to be, wasting memory. It's faster and more memory-efficient to
@@ -216,3 +235,17 @@ def pad_input(hidden_states, indices, batch, seqlen):
     # output[indices] = hidden_states
     output = index_put_first_axis(hidden_states, indices, batch * seqlen)
     return rearrange(output, "(b s) ... -> b s ...", b=batch)
+
+
+def position_ids_from_cu_seqlens(cu_seqlens):
+    """
+    Arguments:
+        cu_seqlens: (batch + 1), the cumulative sequence lengths of sequences packed one after the
+            other.
+    Return:
+        position_ids: (total), the position of each token within its own sequence.
+    """
+    total = cu_seqlens[-1]
+    positions = torch.arange(total, device=cu_seqlens.device)
+    seq_idx = torch.searchsorted(cu_seqlens[1:], positions, right=True)
+    return positions - cu_seqlens[seq_idx].long()
@@ -22,27 +22,31 @@ def flops(
     causal=False,
     window_size=(None, None),
     has_qv=False,
+    attention_chunk=0,
 ):
+    """Forward FLOPs, counting only the (query, key) pairs that aren't masked. The masks are
+    aligned to the bottom right, so with seqlen_q > seqlen_k the first causal rows are empty.
+    This is the same count as flash_attn.utils.attention_flops.attended_pairs (this package
+    doesn't depend on flash_attn), which handles varlen batches.
+    """
     if causal:
-        avg_seqlen = (max(0, seqlen_k - seqlen_q) + seqlen_k) / 2
-    else:
-        if window_size == (None, None):
-            avg_seqlen = seqlen_k
-        else:
-            row_idx = torch.arange(seqlen_q, device="cuda")
-            col_left = (
-                torch.maximum(row_idx + seqlen_k - seqlen_q - window_size[0], torch.tensor(0))
-                if window_size[0] is not None
-                else torch.zeros_like(row_idx)
-            )
-            col_right = (
-                torch.minimum(
-                    row_idx + seqlen_k - seqlen_q + window_size[1], torch.tensor(seqlen_k - 1)
-                )
-                if window_size[1] is not None
-                else torch.full_like(row_idx, seqlen_k - 1)
-            )
-            avg_seqlen = (col_right - col_left + 1).float().mean().item()
+        window_size = (window_size[0], 0)
+    row_idx = torch.arange(seqlen_q, device="cpu") + seqlen_k - seqlen_q
+    col_left = (
+        (row_idx - window_size[0]).clamp(min=0)
+        if window_size[0] is not None and window_size[0] >= 0
+        else torch.zeros_like(row_idx)
+    )
+    col_right = (
+        (row_idx + window_size[1]).clamp(max=seqlen_k - 1)
+        if window_size[1] is not None and window_size[1] >= 0
+        else torch.full_like(row_idx, seqlen_k - 1)
+    )
+    if attention_chunk > 0:
+        chunk_start = row_idx - row_idx % attention_chunk
+        col_left = torch.maximum(col_left, chunk_start)
+        col_right = torch.minimum(col_right, chunk_start + attention_chunk - 1)
+    avg_seqlen = (col_right - col_left + 1).clamp(min=0).sum().item() / max(seqlen_q, 1)
     eff_headdim = headdim + headdim_v if has_qv else headdim
     return batch * nheads * 2 * seqlen_q * avg_seqlen * (eff_headdim + headdim_v)
 
@@ -1,6 +1,7 @@
 # Copyright (c) 2025, Tri Dao
 
 import math
+import weakref
 from functools import partial
 from typing import Optional, Tuple, Union
 
@@ -328,6 +329,80 @@ def apply_rotary_emb_kv_(
     return ApplyRotaryEmbKV_.apply(kv, cos, sin, interleaved, seqlen_offsets)
 
 
+class CosSinCache:
+    """The cos / sin tables of the positions 0, 1, ..., seqlen - 1 for the frequencies inv_freq,
+    which only grow: when a longer seqlen is needed, only the new positions are computed. The
+    tables are never written after they are returned (they may be saved for backward, and an
+    in-place write would bump their version counter), so growing allocates new tables, copies the
+    existing positions and computes the new ones. The length at least doubles each time, so this
+    happens O(log seqlen) times.
+    The tables are shared by all the RotaryEmbedding with the same frequencies, see get(). Each of
+    them holds a reference to its cache, which is freed with the last of them.
+    """
+
+    _caches = weakref.WeakValueDictionary()
+
+    def __init__(self, inv_freq, mscale=1.0, device=None, dtype=None):
+        self.inv_freq = inv_freq.to(device=device, dtype=torch.float32)
+        self.mscale = mscale
+        self.dtype = dtype
+        self.seqlen = 0
+        self._cos = None  # (seqlen, rotary_dim / 2)
+        self._sin = None
+
+    @classmethod
+    def get(cls, key, inv_freq, mscale=1.0, device=None, dtype=None):
+        """The cache of key (which should identify inv_freq and mscale) on device, for dtype."""
+        key = (key, torch.device(device) if device is not None else None, dtype)
+        cache = cls._caches.get(key)
+        if cache is None:
+            cache = cls(inv_freq, mscale=mscale, device=device, dtype=dtype)
+            cls._caches[key] = cache
+        return cache
+
+    def __call__(self, seqlen):
+        """Return cos, sin of shape (>= seqlen, rotary_dim / 2)."""
+        # Tables created under inference mode can't be used for training
+        if self._cos is not None and self._cos.is_inference():
+            if not torch.is_inference_mode_enabled():
+                self._cos, self._sin, self.seqlen = None, None, 0
+        if seqlen > self.seqlen:
+            self._extend(max(seqlen, 2 * self.seqlen))
+        return self._cos, self._sin
+
+    def _extend(self, seqlen):
+        # fp32, as in RotaryEmbedding._update_cos_sin_cache
+        t = torch.arange(self.seqlen, seqlen, device=self.inv_freq.device, dtype=torch.float32)
+        freqs = torch.outer(t, self.inv_freq)
+        cos = (torch.cos(freqs) * self.mscale).to(self.dtype)
+        sin = (torch.sin(freqs) * self.mscale).to(self.dtype)
+        if self.seqlen > 0:
+            cos = torch.cat([self._cos, cos])
+            sin = torch.cat([self._sin, sin])
+        self._cos, self._sin, self.seqlen = cos, sin, seqlen
+
+
+def _yarn_find_correction_dim(num_rotations, dim, base, max_position_embeddings):
+    # The dimension whose wavelength does num_rotations rotations over max_position_embeddings
+    return (dim * math.log(max_position_embeddings / (num_rotations * 2 * math.pi))) / (
+        2 * math.log(base)
+    )
+
+
+def _yarn_inv_freq(dim, base, factor, original_max_seqlen, beta_fast, beta_slow, device=None):
+    """YaRN (https://arxiv.org/abs/2309.00071): interpolate the low frequencies by factor (as in
+    position interpolation), keep the high frequencies, and ramp linearly in between."""
+    pos_freqs = base ** (torch.arange(0, dim, 2, device=device, dtype=torch.float32) / dim)
+    low = math.floor(_yarn_find_correction_dim(beta_fast, dim, base, original_max_seqlen))
+    high = math.ceil(_yarn_find_correction_dim(beta_slow, dim, base, original_max_seqlen))
+    low, high = max(low, 0), min(high, dim - 1)
+    if low == high:
+        high += 0.001  # Prevent singularity
+    ramp = (torch.arange(dim // 2, device=device, dtype=torch.float32) - low) / (high - low)
+    extrapolation = 1.0 - ramp.clamp(0, 1)
+    return (1.0 / (factor * pos_freqs)) * (1 - extrapolation) + (1.0 / pos_freqs) * extrapolation
+
+
 class RotaryEmbedding(torch.nn.Module):
     """
     The rotary position embeddings from RoFormer_ (Su et. al).
@@ -344,6 +419,10 @@ class RotaryEmbedding(torch.nn.Module):
     If scale_base is not None, this implements XPos (Sun et al., https://arxiv.org/abs/2212.10554).
     A recommended value for scale_base is 512: https://github.com/HazyResearch/flash-attention/issues/96
     Reference: https://github.com/sunyt32/torchscale/blob/main/torchscale/component/xpos_relative_position.py
+
+    Without XPos, the cos / sin tables are a CosSinCache shared by all the RotaryEmbedding with
+    the same dim, base and scaling (e.g. all the layers of a model), which is replaced by longer
+    tables as the sequence length grows.
     """
 
     def __init__(
@@ -352,15 +431,40 @@ class RotaryEmbedding(torch.nn.Module):
         base=10000.0,
         interleaved=False,
         scale_base=None,
+        scaling_type=None,
+        scaling_factor=1.0,
+        original_max_seqlen=None,
+        yarn_beta_fast=32.0,
+        yarn_beta_slow=1.0,
         device=None,
     ):
         """
         interleaved: if True, rotate pairs of even and odd dimensions (GPT-J style) instead
             of 1st half and 2nd half (GPT-NeoX style).
+        scaling_type: None, "ntk" or "yarn", to extend the context of a model trained on
+            original_max_seqlen tokens by scaling_factor.
+            "ntk": NTK-aware scaling, base is multiplied by scaling_factor ** (dim / (dim - 2)).
+            "yarn": YaRN (https://arxiv.org/abs/2309.00071), the frequencies are interpolated
+                between the dimensions that rotate yarn_beta_fast and yarn_beta_slow times over
+                original_max_seqlen, and cos / sin are scaled by 0.1 * ln(scaling_factor) + 1.
         """
         super().__init__()
+        if scaling_type not in [None, "ntk", "yarn"]:
+            raise NotImplementedError(f"Unsupported rotary scaling_type {scaling_type}")
+        if scaling_type == "yarn":
+            assert original_max_seqlen is not None, "YaRN requires original_max_seqlen"
         self.dim = dim
         self.base = float(base)
+        self.scaling_type = scaling_type
+        self.scaling_factor = float(scaling_factor)
+        self.original_max_seqlen = original_max_seqlen
+        self.yarn_beta_fast = yarn_beta_fast
+        self.yarn_beta_slow = yarn_beta_slow
+        self.mscale = (
+            0.1 * math.log(self.scaling_factor) + 1.0
+            if scaling_type == "yarn" and self.scaling_factor > 1.0
+            else 1.0
+        )
         # Generate and save the inverse frequency buffer (non trainable)
         inv_freq = self._compute_inv_freq(device)
         self.register_buffer("inv_freq", inv_freq, persistent=False)
@@ -374,17 +478,45 @@ class RotaryEmbedding(torch.nn.Module):
         self.register_buffer("scale", scale, persistent=False)
 
         self._seq_len_cached = 0
+        self._cos_sin_cache = None  # Keeps the shared CosSinCache alive
         self._cos_cached = None
         self._sin_cached = None
         self._cos_k_cached = None
         self._sin_k_cached = None
 
     def _compute_inv_freq(self, device=None):
+        if self.scaling_type == "yarn":
+            return _yarn_inv_freq(
+                self.dim,
+                self.base,
+                self.scaling_factor,
+                self.original_max_seqlen,
+                self.yarn_beta_fast,
+                self.yarn_beta_slow,
+                device=device,
+            )
+        base = self.base
+        if self.scaling_type == "ntk":
+            base *= self.scaling_factor ** (self.dim / (self.dim - 2))
         return 1.0 / (
-            self.base
-            ** (torch.arange(0, self.dim, 2, device=device, dtype=torch.float32) / self.dim)
+            base ** (torch.arange(0, self.dim, 2, device=device, dtype=torch.float32) / self.dim)
         )
 
+    def cos_sin(self, seqlen, device=None, dtype=None):
+        """Return the cos / sin tables, of shape (>= seqlen, rotary_dim / 2), e.g. to pass as
+        rotary_cos / rotary_sin to flash_attn_with_kvcache."""
+        self._update_cos_sin_cache(seqlen, device=device, dtype=dtype)
+        return self._cos_cached, self._sin_cached
+
+    @staticmethod
+    def rotary_seqlens(seqlen_offset, batch_size, device=None):
+        """The position of the first token of each sequence, as the (batch_size,) int32 tensor
+        that the rotary kernels take (seqlen_offsets of apply_rotary_emb, rotary_seqlens of the
+        kvcache kernels). seqlen_offset: int, or (batch_size,) tensor, as in forward."""
+        if isinstance(seqlen_offset, int):
+            return torch.full((batch_size,), seqlen_offset, dtype=torch.int32, device=device)
+        return seqlen_offset[:batch_size].to(device=device, dtype=torch.int32)
+
     def _update_cos_sin_cache(self, seqlen, device=None, dtype=None):
         # Reset the tables if the sequence length has changed,
         # if we're on a new device (possibly due to tracing for instance),
@@ -396,6 +528,22 @@ class RotaryEmbedding(torch.nn.Module):
             or self._cos_cached.dtype != dtype
             or (self.training and self._cos_cached.is_inference())
         ):
+            if self.scale is None:
+                key = (
+                    self.dim,
+                    self.base,
+                    self.scaling_type,
+                    self.scaling_factor,
+                    self.original_max_seqlen,
+                    self.yarn_beta_fast,
+                    self.yarn_beta_slow,
+                )
+                self._cos_sin_cache = CosSinCache.get(
+                    key, self._compute_inv_freq(device), self.mscale, device=device, dtype=dtype
+                )
+                self._cos_cached, self._sin_cached = self._cos_sin_cache(seqlen)
+                self._seq_len_cached = self._cos_cached.shape[0]
+                return
             self._seq_len_cached = seqlen
             # We want fp32 here, not self.inv_freq.dtype, since the model could be loaded in bf16
             # And the output of arange can be quite large, so bf16 would lose a lot of precision.
@@ -433,6 +581,7 @@ class RotaryEmbedding(torch.nn.Module):
         seqlen_offset: Union[int, torch.Tensor] = 0,
         max_seqlen: Optional[int] = None,
         num_heads_q: Optional[int] = None,
+        cu_seqlens: Optional[torch.Tensor] = None,
     ) -> Union[torch.Tensor, Tuple[torch.Tensor, torch.Tensor]]:
         """
         qkv: (batch, seqlen, 3, nheads, headdim) or (batch, seqlen, num_heads_q + 2 * num_heads_k, headdim)
@@ -444,8 +593,13 @@ class RotaryEmbedding(torch.nn.Module):
             Most commonly used in inference when we have KV cache.
             If it's a tensor of shape (batch_size,), then to update the cos / sin cache, one
             should pass in max_seqlen, which will update the cos / sin cache up to that length.
+        cu_seqlens: (batch + 1,) or None. If not None, the sequences are packed: qkv and kv have
+            shape (total, ...) instead of (batch, seqlen, ...), positions restart at 0 at the start
+            of each sequence, and max_seqlen must be passed.
         Apply rotary embedding *inplace* to qkv and / or kv.
         """
+        if cu_seqlens is not None:
+            return self._forward_varlen(qkv, kv, seqlen_offset, max_seqlen, num_heads_q, cu_seqlens)
         seqlen = qkv.shape[1]
         if max_seqlen is not None:
             self._update_cos_sin_cache(max_seqlen, device=qkv.device, dtype=qkv.dtype)
@@ -480,3 +634,30 @@ class RotaryEmbedding(torch.nn.Module):
                 seqlen_offsets=seqlen_offset,
             )
             return q, kv
+
+    def _forward_varlen(self, qkv, kv, seqlen_offset, max_seqlen, num_heads_q, cu_seqlens):
+        assert max_seqlen is not None, "If cu_seqlens is passed in, then max_seqlen must be passed"
+        assert self.scale is None, "XPos is not supported with packed sequences"
+        self._update_cos_sin_cache(max_seqlen, device=qkv.device, dtype=qkv.dtype)
+        # Not in-place: q and k are slices of qkv / kv, so the outputs are put back together
+        rotary = partial(
+            apply_rotary_emb,
+            cos=self._cos_cached,
+            sin=self._sin_cached,
+            interleaved=self.interleaved,
+            seqlen_offsets=seqlen_offset,
+            cu_seqlens=cu_seqlens,
+            max_seqlen=max_seqlen,
+        )
+        if kv is None:
+            if qkv.dim() == 4:  # (total, 3, nheads, headdim)
+                q, k, v = qkv.unbind(dim=1)
+                return torch.stack([rotary(q), rotary(k), v], dim=1)
+            else:  # (total, num_heads_q + 2 * num_heads_k, headdim)
+                assert num_heads_q is not None
+                num_heads_k = (qkv.shape[1] - num_heads_q) // 2
+                q, k, v = qkv.split([num_heads_q, num_heads_k, num_heads_k], dim=1)
+                return torch.cat([rotary(q), rotary(k), v], dim=1)
+        else:
+            k, v = kv.unbind(dim=1)
+            return rotary(qkv), torch.stack([rotary(k), v], dim=1)
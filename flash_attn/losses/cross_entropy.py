@@ -2,8 +2,14 @@
 
 import torch
 import torch.nn as nn
+import torch.nn.functional as F
 
-from flash_attn.ops.triton.cross_entropy import cross_entropy_loss
+from flash_attn.utils.torch import custom_bwd, custom_fwd
+
+try:
+    from flash_attn.ops.triton.cross_entropy import cross_entropy_loss
+except ImportError:
+    cross_entropy_loss = None
 
 
 class CrossEntropyLoss(nn.Module):
@@ -83,3 +89,208 @@ class CrossEntropyLoss(nn.Module):
             z_loss = z_loss
 
         return loss, z_loss
+
+
+def _chunks(n, chunk_size):
+    return [(start, min(start + chunk_size, n)) for start in range(0, n, chunk_size)]
+
+
+class LinearCrossEntropyFunc(torch.autograd.Function):
+    """Cross entropy of the logits logit_scale * (x @ weight.T + bias), without materializing
+    them: the logits are computed in chunks of tokens and of the vocab, and the log-sum-exp of
+    each token is accumulated online over the vocab chunks. The backward recomputes the logits
+    of each chunk from x and the LSE, and accumulates the gradients of x and of the weight chunk
+    by chunk. The peak memory is one (chunk_size_tokens, chunk_size_vocab) block of logits,
+    instead of (tokens, vocab_size).
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(
+        ctx,
+        x,
+        weight,
+        bias,
+        target,
+        label_smoothing,
+        logit_scale,
+        lse_square_scale,
+        ignore_index,
+        chunk_size_tokens,
+        chunk_size_vocab,
+    ):
+        n_tokens, vocab_size = x.shape[0], weight.shape[0]
+        lse = torch.full((n_tokens,), float("-inf"), dtype=torch.float32, device=x.device)
+        target_logits = torch.zeros(n_tokens, dtype=torch.float32, device=x.device)
+        sum_logits = torch.zeros(n_tokens, dtype=torch.float32, device=x.device)
+        for start_t, end_t in _chunks(n_tokens, chunk_size_tokens):
+            x_chunk, target_chunk = x[start_t:end_t], target[start_t:end_t]
+            for start_v, end_v in _chunks(vocab_size, chunk_size_vocab):
+                b_chunk = bias[start_v:end_v] if bias is not None else None
+                logits = F.linear(x_chunk, weight[start_v:end_v], b_chunk).float()
+                logits *= logit_scale
+                tokens = slice(start_t, end_t)
+                lse[tokens] = torch.logaddexp(lse[tokens], torch.logsumexp(logits, dim=-1))
+                in_chunk = (target_chunk >= start_v) & (target_chunk < end_v)
+                label = (target_chunk - start_v).clamp(0, end_v - start_v - 1)
+                label_logits = logits.gather(1, label.unsqueeze(1)).squeeze(1)
+                target_logits[tokens] += torch.where(in_chunk, label_logits, 0.0)
+                if label_smoothing > 0.0:
+                    sum_logits[tokens] += logits.sum(dim=-1)
+        losses = lse - (1.0 - label_smoothing) * target_logits
+        if label_smoothing > 0.0:
+            losses -= label_smoothing * sum_logits / vocab_size
+        z_loss = lse_square_scale * lse.square()
+        losses += z_loss
+        ignored = target == ignore_index
+        losses.masked_fill_(ignored, 0.0)
+        z_loss.masked_fill_(ignored, 0.0)
+        ctx.save_for_backward(x, weight, bias, target, lse)
+        ctx.label_smoothing, ctx.logit_scale = label_smoothing, logit_scale
+        ctx.lse_square_scale, ctx.ignore_index = lse_square_scale, ignore_index
+        ctx.chunk_size_tokens, ctx.chunk_size_vocab = chunk_size_tokens, chunk_size_vocab
+        ctx.mark_non_differentiable(z_loss)
+        return losses, z_loss
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_losses, grad_z_loss):
+        x, weight, bias, target, lse = ctx.saved_tensors
+        n_tokens, vocab_size = x.shape[0], weight.shape[0]
+        grad_losses = grad_losses.float().masked_fill(target == ctx.ignore_index, 0.0)
+        # dloss / dlogits = softmax * (1 + 2 * lse_square_scale * lse) - target distribution
+        softmax_scale = 1.0 + 2.0 * ctx.lse_square_scale * lse
+        grad_x = torch.zeros(x.shape, dtype=torch.float32, device=x.device)
+        grad_weight = torch.empty_like(weight) if ctx.needs_input_grad[1] else None
+        grad_bias = (
+            torch.empty_like(bias) if bias is not None and ctx.needs_input_grad[2] else None
+        )
+        for start_v, end_v in _chunks(vocab_size, ctx.chunk_size_vocab):
+            w_chunk = weight[start_v:end_v]
+            b_chunk = bias[start_v:end_v] if bias is not None else None
+            grad_w_chunk = torch.zeros(w_chunk.shape, dtype=torch.float32, device=x.device)
+            grad_b_chunk = torch.zeros(end_v - start_v, dtype=torch.float32, device=x.device)
+            for start_t, end_t in _chunks(n_tokens, ctx.chunk_size_tokens):
+                tokens = slice(start_t, end_t)
+                x_chunk, target_chunk = x[tokens], target[tokens]
+                logits = F.linear(x_chunk, w_chunk, b_chunk).float()
+                logits *= ctx.logit_scale
+                grad_logits = torch.exp(logits - lse[tokens, None]) * softmax_scale[tokens, None]
+                if ctx.label_smoothing > 0.0:
+                    grad_logits -= ctx.label_smoothing / vocab_size
+                in_chunk = (target_chunk >= start_v) & (target_chunk < end_v)
+                rows = in_chunk.nonzero(as_tuple=True)[0]
+                grad_logits[rows, target_chunk[rows] - start_v] -= 1.0 - ctx.label_smoothing
+                grad_logits *= (grad_losses[tokens] * ctx.logit_scale).unsqueeze(1)
+                grad_b_chunk += grad_logits.sum(dim=0)
+                grad_logits = grad_logits.to(x.dtype)
+                grad_x[tokens] += grad_logits @ w_chunk.to(x.dtype)
+                if grad_weight is not None:
+                    grad_w_chunk += grad_logits.t() @ x_chunk
+            if grad_weight is not None:
+                grad_weight[start_v:end_v] = grad_w_chunk
+            if grad_bias is not None:
+                grad_bias[start_v:end_v] = grad_b_chunk
+        return grad_x.to(x.dtype), grad_weight, grad_bias, None, None, None, None, None, None, None
+
+
+def linear_cross_entropy(
+    x,
+    weight,
+    bias,
+    target,
+    label_smoothing=0.0,
+    logit_scale=1.0,
+    lse_square_scale=0.0,
+    ignore_index=-100,
+    chunk_size_tokens=4096,
+    chunk_size_vocab=16384,
+):
+    """
+    Arguments:
+        x: (..., hidden_dim), the inputs of the LM head
+        weight: (vocab_size, hidden_dim)
+        bias: (vocab_size,) or None
+        target: (...)
+    Returns:
+        losses: (...), float. 0.0 where target == ignore_index.
+        z_loss: (...), float, the part of the losses from lse_square_scale. No backprop.
+    """
+    losses, z_loss = LinearCrossEntropyFunc.apply(
+        x.reshape(-1, x.shape[-1]),
+        weight,
+        bias,
+        target.reshape(-1),
+        label_smoothing,
+        logit_scale,
+        lse_square_scale,
+        ignore_index,
+        chunk_size_tokens,
+        chunk_size_vocab,
+    )
+    return losses.reshape(target.shape), z_loss.reshape(target.shape)
+
+
+class FusedLinearCrossEntropyLoss(nn.Module):
+    def __init__(
+        self,
+        ignore_index=-100,
+        reduction="mean",
+        label_smoothing=0.0,
+        logit_scale=1.0,
+        lse_square_scale=0.0,
+        return_z_loss=False,
+        chunk_size_tokens=4096,
+        chunk_size_vocab=16384,
+        inplace_backward=False,
+    ):
+        """The LM head (a linear layer) and CrossEntropyLoss, without materializing the logits,
+        see LinearCrossEntropyFunc. Works on CPU and GPU.
+        Arguments: as in CrossEntropyLoss, plus
+            chunk_size_tokens, chunk_size_vocab: the size of the blocks of logits that are
+                computed at a time.
+        inplace_backward is ignored (there are no logits to overwrite). It is accepted so that a
+        config for CrossEntropyLoss can switch to this loss by only changing its _target_.
+        """
+        super().__init__()
+        if reduction not in ["mean", "none", "sum"]:
+            raise NotImplementedError("Only support reduction = 'mean' or 'none' or 'sum'")
+        self.ignore_index = ignore_index
+        self.reduction = reduction
+        self.label_smoothing = label_smoothing
+        self.logit_scale = logit_scale
+        self.lse_square_scale = lse_square_scale
+        self.return_z_loss = return_z_loss
+        self.chunk_size_tokens = chunk_size_tokens
+        self.chunk_size_vocab = chunk_size_vocab
+
+    def forward(self, input, weight, bias, target):
+        """
+        Arguments:
+            input: (batch, hidden_dim)
+            weight: (vocab_size, hidden_dim)
+            bias: (vocab_size,) or None
+            target: (batch,)
+        Returns:
+            losses: (batch,) if reduction is 'none', else (1,), dtype float
+            z_loss: (batch,) if reduction is 'none', else (1,), dtype float (if self.return_z_loss)
+        """
+        loss, z_loss = linear_cross_entropy(
+            input,
+            weight,
+            bias,
+            target,
+            label_smoothing=self.label_smoothing,
+            logit_scale=self.logit_scale,
+            lse_square_scale=self.lse_square_scale,
+            ignore_index=self.ignore_index,
+            chunk_size_tokens=self.chunk_size_tokens,
+            chunk_size_vocab=self.chunk_size_vocab,
+        )
+        if self.reduction == "mean":
+            loss = loss.sum() / (target != self.ignore_index).sum()
+            z_loss = z_loss.sum() / (target != self.ignore_index).sum()
+        elif self.reduction == "sum":
+            loss = loss.sum()
+            z_loss = z_loss.sum()
+        return loss if not self.return_z_loss else (loss, z_loss)
@@ -5,6 +5,7 @@ import math
 import re
 from collections import OrderedDict, namedtuple
 from collections.abc import Sequence
+from concurrent.futures import ThreadPoolExecutor
 from functools import partial
 from typing import Dict, List
 
@@ -14,6 +15,8 @@ import torch.nn.functional as F
 from einops import rearrange
 from transformers import GPT2Config
 
+from flash_attn.bert_padding import position_ids_from_cu_seqlens
+from flash_attn.losses.cross_entropy import linear_cross_entropy
 from flash_attn.models.bigcode import remap_state_dict_hf_bigcode
 from flash_attn.models.falcon import remap_state_dict_hf_falcon
 from flash_attn.models.gpt_neox import remap_state_dict_hf_gpt_neox
@@ -39,6 +42,7 @@ from flash_attn.utils.distributed import (
     sync_shared_params,
 )
 from flash_attn.utils.generation import GenerationMixin
+from flash_attn.utils.lazy_load import SafetensorsWriter, lazy_load_file, materialize
 from flash_attn.utils.pretrained import state_dict_from_pretrained
 
 try:
@@ -58,6 +62,8 @@ except ImportError:
 
 logger = logging.getLogger(__name__)
 
+CausalLMOutput = namedtuple("CausalLMOutput", ["logits", "loss"], defaults=[None])
+
 
 def create_mixer_cls(config, layer_idx=None, process_group=None, device=None, dtype=None):
     factory_kwargs = {"device": device, "dtype": dtype}
@@ -77,6 +83,7 @@ def create_mixer_cls(config, layer_idx=None, process_group=None, device=None, dt
     rotary_emb_base = getattr(config, "rotary_emb_base", 10000.0)
     rotary_emb_scale_base = getattr(config, "rotary_emb_scale_base", None)
     rotary_emb_interleaved = getattr(config, "rotary_emb_interleaved", False)
+    rotary_emb_scaling = getattr(config, "rotary_emb_scaling", None)
     use_alibi = getattr(config, "use_alibi", False)
     window_size = getattr(config, "window_size", (-1, -1))
     use_flash_attn = getattr(config, "use_flash_attn", False)
@@ -91,6 +98,7 @@ def create_mixer_cls(config, layer_idx=None, process_group=None, device=None, dt
         {
             "process_group": process_group,
             "sequence_parallel": getattr(config, "sequence_parallel", True),
+            "sequence_parallel_chunks": getattr(config, "sequence_parallel_chunks", 1),
         }
         if process_group is not None
         else {}
@@ -110,6 +118,7 @@ def create_mixer_cls(config, layer_idx=None, process_group=None, device=None, dt
         rotary_emb_base=rotary_emb_base,
         rotary_emb_scale_base=rotary_emb_scale_base,
         rotary_emb_interleaved=rotary_emb_interleaved,
+        rotary_emb_scaling=rotary_emb_scaling,
         use_alibi=use_alibi,
         window_size=window_size,
         use_flash_attn=use_flash_attn,
@@ -164,6 +173,7 @@ def create_mlp_cls(config, layer_idx=None, process_group=None, device=None, dtyp
                 {
                     "process_group": process_group,
                     "sequence_parallel": getattr(config, "sequence_parallel", True),
+                    "sequence_parallel_chunks": getattr(config, "sequence_parallel_chunks", 1),
                 }
                 if process_group is not None
                 else {}
@@ -197,6 +207,7 @@ def create_mlp_cls(config, layer_idx=None, process_group=None, device=None, dtyp
                 {
                     "process_group": process_group,
                     "sequence_parallel": getattr(config, "sequence_parallel", True),
+                    "sequence_parallel_chunks": getattr(config, "sequence_parallel_chunks", 1),
                 }
                 if process_group is not None
                 else {}
@@ -511,7 +522,23 @@ class GPTModel(GPTPreTrainedModel):
             for i, layer in enumerate(self.layers)
         }
 
-    def forward(self, input_ids, position_ids=None, inference_params=None):
+    def forward(
+        self, input_ids, position_ids=None, inference_params=None, cu_seqlens=None, max_seqlen=None
+    ):
+        """
+        cu_seqlens: (num_sequences + 1,), dtype torch.int32. If not None, several sequences
+            (e.g. documents) are packed into input_ids, one after the other across its rows,
+            and cu_seqlens holds where each one starts in input_ids.flatten(). Attention doesn't
+            cross from one sequence to another. position_ids should restart at 0 at the start of
+            each sequence, it's computed from cu_seqlens if not passed.
+        max_seqlen: int. Length of the longest sequence, required if cu_seqlens is passed.
+        """
+        if cu_seqlens is not None:
+            assert max_seqlen is not None
+            assert inference_params is None
+            assert self.process_group is None, "Packed sequences don't support Tensor Parallel"
+            if position_ids is None:
+                position_ids = position_ids_from_cu_seqlens(cu_seqlens).reshape(input_ids.shape)
         # If using Tensor Parallel with sequence parallel, we combine the batch and the seqlen
         # dimensions so that we can split on it easily, in case of small batch size.
         # Only the attention layers need to know the seqlen.
@@ -533,6 +560,12 @@ class GPTModel(GPTPreTrainedModel):
         )
         if inference_params is not None:
             mixer_kwargs["inference_params"] = inference_params
+        if cu_seqlens is not None:
+            # The mixers take the packed tokens as (total, hidden_dim)
+            batch_size = hidden_states.shape[0]
+            hidden_states = rearrange(hidden_states, "b s d -> (b s) d")
+            mixer_kwargs["cu_seqlens"] = cu_seqlens
+            mixer_kwargs["max_seqlen"] = max_seqlen
         for layer in self.layers:
             if self.prenorm:
                 if not self.parallel_block:
@@ -571,6 +604,8 @@ class GPTModel(GPTPreTrainedModel):
                     prenorm=False,
                     is_rms_norm=isinstance(self.ln_f, RMSNorm)
                 )
+        if cu_seqlens is not None:
+            hidden_states = rearrange(hidden_states, "(b s) d -> b s d", b=batch_size)
         return hidden_states
 
 
@@ -632,28 +667,72 @@ class GPTLMHeadModel(GPTPreTrainedModel, GenerationMixin):
             batch_size, max_seqlen, dtype=dtype, **kwargs
         )
 
-    def forward(self, input_ids, position_ids=None, inference_params=None, num_last_tokens=0):
+    def forward(
+        self,
+        input_ids,
+        position_ids=None,
+        inference_params=None,
+        num_last_tokens=0,
+        cu_seqlens=None,
+        max_seqlen=None,
+        labels=None,
+        loss_fn=None,
+    ):
         """
         input_ids: (batch, seqlen) int tensor
         inference_params: for generation. Adapted from Megatron-LM (and Apex)
         https://github.com/NVIDIA/apex/blob/3ff1a10f72ec07067c4e44759442329804ac5162/apex/transformer/testing/standalone_transformer_lm.py#L470
         num_last_tokens: if > 0, only return the logits for the last n tokens
+        cu_seqlens, max_seqlen: for packed sequences, see GPTModel.forward.
+        labels: (batch, seqlen) int tensor, already shifted: labels[:, i] is the target of the
+            logits at position i, i.e. input_ids[:, i + 1] for language modeling (unlike the HF
+            models, which shift the labels themselves). If not None, return the mean cross-entropy
+            loss over the labels that aren't -100 (plus config.lse_square_scale * lse^2, the
+            z-loss) instead of the logits. The loss is fused with the LM head, so the logits are
+            never materialized, see linear_cross_entropy.
+        loss_fn: a FusedLinearCrossEntropyLoss (with reduction "mean") to compute the loss with,
+            instead of the defaults above, e.g. for label smoothing.
         """
         assert (
             input_ids.ndim == 2
         ), f"Expected `input_ids` to have shape [b, slen], but got shape {input_ids.shape}"
         b, slen = input_ids.shape
         hidden_states = self.transformer(
-            input_ids, position_ids=position_ids, inference_params=inference_params
+            input_ids,
+            position_ids=position_ids,
+            inference_params=inference_params,
+            cu_seqlens=cu_seqlens,
+            max_seqlen=max_seqlen,
         )
         if inference_params is not None:
             assert hidden_states.ndim == 3, "sequence_parallel is not supported in generation mode"
         if num_last_tokens > 0:
-            hidden_states = hidden_states[:, -num_last_tokens:]
+            if inference_params is not None and inference_params.cu_seqlens_q is not None:
+                # Packed batch of shape (1, total): the last token of each sequence
+                assert num_last_tokens == 1
+                hidden_states = hidden_states[:, inference_params.cu_seqlens_q[1:].long() - 1]
+            else:
+                hidden_states = hidden_states[:, -num_last_tokens:]
         if self.project_out is not None:
             hidden_states = self.project_out(hidden_states)
         if self.output_scale != 1.0:
             hidden_states = hidden_states * self.output_scale
+        if labels is not None:
+            assert self.process_group is None, "The fused loss does not support Tensor Parallel"
+            lm_head_weight = (
+                self.lm_head.weight if not self.norm_head else F.normalize(self.lm_head.weight)
+            )
+            if loss_fn is not None:
+                loss = loss_fn(hidden_states, lm_head_weight, self.lm_head.bias, labels)
+                return CausalLMOutput(logits=None, loss=loss)
+            losses, _ = linear_cross_entropy(
+                hidden_states,
+                lm_head_weight,
+                self.lm_head.bias,
+                labels,
+                lse_square_scale=getattr(self.config, "lse_square_scale", 0.0),
+            )
+            return CausalLMOutput(logits=None, loss=losses.sum() / (labels != -100).sum())
         if not self.norm_head:
             lm_logits = self.lm_head(hidden_states)
         else:
@@ -665,7 +744,6 @@ class GPTLMHeadModel(GPTPreTrainedModel, GenerationMixin):
         if isinstance(self.lm_head, ColumnParallelLinear) and inference_params is not None:
             lm_logits, _ = all_gather_raw(lm_logits, self.lm_head.process_group)
             lm_logits = rearrange(lm_logits, "(n b) ... d -> b ... (n d)", b=b)
-        CausalLMOutput = namedtuple("CausalLMOutput", ["logits"])
         return CausalLMOutput(logits=lm_logits)
 
     def load_state_dict(self, state_dict, strict=True):
@@ -834,8 +912,9 @@ def combine_state_dicts_tp(state_dicts: List[Dict[str, torch.Tensor]], config: G
     # Sometimes the word embeddings are sharded on the 0th dim, sometimes on the 1st dim.
     # vocab_size // world_size coordinates are nonzero.
     def combine_word_embeddings(state_dicts, state_dict, key):
-        dim = 0 if state_dicts[0][key].shape[0] == vocab_size // world_size else 1
-        state_dict[key] = torch.cat([s[key] for s in state_dicts], dim=dim)
+        if key in state_dict:
+            dim = 0 if state_dicts[0][key].shape[0] == vocab_size // world_size else 1
+            state_dict[key] = torch.cat([s[key] for s in state_dicts], dim=dim)
 
     def combine_dim(state_dicts, state_dict, key, dim=-1):
         if key in state_dict:
@@ -927,6 +1006,66 @@ def combine_state_dicts_tp(state_dicts: List[Dict[str, torch.Tensor]], config: G
     return state_dict
 
 
+def _reshard_tensor_tp(sources, key, config, world_size, read=materialize):
+    """Combine the tensor key of the state_dicts sources, then shard it in world_size.
+    Return the list of the shards (None on the ranks that don't have this tensor).
+    """
+    tensors = [{key: read(s[key])} if key in s else {} for s in sources]
+    if len(sources) > 1:
+        tensor = combine_state_dicts_tp(tensors, config)[key]
+    else:
+        tensor = tensors[0][key]
+    if world_size == 1:
+        return [tensor]
+    return [
+        shard_state_dict_tp({key: tensor}, config, world_size, rank).get(key)
+        for rank in range(world_size)
+    ]
+
+
+def reshard_checkpoint_tp(input_files, output_files, config, num_threads=8):
+    """Convert a GPT checkpoint from one tensor parallel degree to another, without loading the
+    full state_dict in memory.
+
+    input_files: the checkpoint files of each rank (safetensors or torch.save), in rank order.
+        A single file is a checkpoint without tensor parallel.
+    output_files: the safetensors files to write, one per rank of the new tensor parallel degree.
+
+    The inputs are loaded lazily (lazy_load_file), and the shapes of all the output tensors are
+    computed on the meta tensors first, so that each output file can be preallocated. Then each
+    tensor is read from all the input ranks, combined as in combine_state_dicts_tp, sharded as in
+    shard_state_dict_tp and written to all the output files, in parallel across num_threads
+    threads. The memory used is about num_threads times twice the size of the largest tensor.
+    """
+    sources = [lazy_load_file(f) for f in input_files]
+    world_size = len(output_files)
+    # Rank 0 has all the keys, the other ranks don't have the biases of out_proj and fc2
+    keys = list(sources[0].keys())
+    metas = {
+        key: _reshard_tensor_tp(sources, key, config, world_size, read=lambda x: x)
+        for key in keys
+    }
+    writers = [
+        SafetensorsWriter(
+            filename,
+            {key: shards[rank] for key, shards in metas.items() if shards[rank] is not None},
+            metadata={"format": "pt"},
+        )
+        for rank, filename in enumerate(output_files)
+    ]
+
+    def reshard(key):
+        for writer, shard in zip(writers, _reshard_tensor_tp(sources, key, config, world_size)):
+            if shard is not None:
+                writer.write(key, shard)
+
+    with ThreadPoolExecutor(max_workers=num_threads) as executor:
+        # list() to raise the exceptions of the threads
+        list(executor.map(reshard, keys))
+    for writer in writers:
+        writer.close()
+
+
 def remap_state_dict_hf_gpt2(state_dict, config):
     # Word embedding and position embedding
     def key_mapping_pos_emb(key):
@@ -7,7 +7,12 @@ import torch
 import torch.nn as nn
 from einops import rearrange, repeat
 
-from flash_attn.utils.distributed import get_dim_for_local_rank
+from flash_attn.utils.distributed import (
+    get_dim_for_local_rank,
+    linear_head_to_seq,
+    linear_seq_to_head,
+)
+from flash_attn.utils.kv_cache import kv_cache_read, kv_cache_write, paged_kv_cache_update
 
 try:
     from flash_attn import (
@@ -22,15 +27,21 @@ except ImportError:
     flash_attn_qkvpacked_func, flash_attn_kvpacked_func = None, None
     flash_attn_with_kvcache = None
 
+try:
+    # FlashAttention 3 also takes a packed (varlen) batch of new queries and keys
+    from flash_attn_interface import flash_attn_with_kvcache as flash_attn_varlen_with_kvcache
+except ImportError:
+    flash_attn_varlen_with_kvcache = None
+
 try:
     from flash_attn.ops.fused_dense import ColumnParallelLinear, RowParallelLinear
 except ImportError:
     ColumnParallelLinear, RowParallelLinear = None, None
 
 try:
-    from flash_attn.layers.rotary import RotaryEmbedding
+    from flash_attn.layers.rotary import RotaryEmbedding, apply_rotary_emb, apply_rotary_emb_torch
 except ImportError:
-    RotaryEmbedding = None
+    RotaryEmbedding, apply_rotary_emb, apply_rotary_emb_torch = None, None, None
 
 
 # From https://github.com/ofirpress/attention_with_linear_biases/blob/4b92f28a005ead2567abe2359f633e73e08f3833/fairseq/models/transformer.py#L742
@@ -227,6 +238,15 @@ class FlashCrossAttention(nn.Module):
             )
 
 
+def _same_sequence_mask(cu_seqlens, total):
+    """(total, total) bool, True where the query and the key are in the same sequence of a packed
+    batch described by cu_seqlens."""
+    seq_idx = torch.searchsorted(
+        cu_seqlens[1:], torch.arange(total, device=cu_seqlens.device), right=True
+    )
+    return seq_idx[:, None] == seq_idx[None, :]
+
+
 class SelfAttention(nn.Module):
     """Implement the scaled dot product attention with softmax.
     Arguments
@@ -236,28 +256,46 @@ class SelfAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) or (batch_size, nheads). Same bias as FlashAttention, i.e.
+                      -alibi_slope * |i - j| (the queries and keys are the same tokens).
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
-    def forward(self, qkv, causal=None, key_padding_mask=None):
+    def forward(self, qkv, causal=None, key_padding_mask=None, cu_seqlens=None, max_seqlen=None):
         """Implements the multihead softmax attention.
         Arguments
         ---------
-            qkv: The tensor containing the query, key, and value. (B, S, 3, H, D)
+            qkv: The tensor containing the query, key, and value. (B, S, 3, H, D), or
+                (total, 3, H, D) if cu_seqlens is not None.
             causal: if passed, will override self.causal
             key_padding_mask: boolean mask to apply to the attention weights. True means to keep,
                 False means to mask out. (B, S)
+            cu_seqlens: (batch_size + 1,), dtype torch.int32. The cumulative sequence lengths
+                of the sequences packed into qkv. Each sequence only attends to itself.
+                This materializes the (total, total) attention matrix, it's only a reference.
+            max_seqlen: unused, for compatibility with FlashSelfAttention.
         """
+        unpadded = cu_seqlens is not None
+        if unpadded:
+            assert key_padding_mask is None
+            qkv = qkv.unsqueeze(0)
         batch_size, seqlen = qkv.shape[0], qkv.shape[1]
         causal = self.causal if causal is None else causal
         q, k, v = qkv.unbind(dim=2)
         softmax_scale = self.softmax_scale or 1.0 / math.sqrt(q.shape[-1])
         scores = torch.einsum("bthd,bshd->bhts", q, k * softmax_scale)
+        if self.alibi_slopes is not None:
+            assert not unpadded, "ALiBi with cu_seqlens is not supported"
+            idx = torch.arange(seqlen, device=q.device, dtype=torch.long)
+            distance = (rearrange(idx, "s -> s 1") - idx).abs()
+            slopes = rearrange(self.alibi_slopes.to(torch.float32), "... h -> ... h 1 1")
+            scores = scores - (slopes * distance).to(scores.dtype)
         if key_padding_mask is not None:
             padding_mask = torch.full(
                 (batch_size, seqlen), -10000.0, dtype=scores.dtype, device=scores.device
@@ -273,10 +311,12 @@ class SelfAttention(nn.Module):
             )
             # TD [2022-09-30]: Adding is faster than masked_fill_ (idk why, just better kernel I guess)
             scores = scores + causal_mask.to(dtype=scores.dtype)
+        if unpadded:
+            scores = scores.masked_fill(~_same_sequence_mask(cu_seqlens, seqlen), -10000.0)
         attention = torch.softmax(scores, dim=-1, dtype=v.dtype)
         attention_drop = self.drop(attention)
         output = torch.einsum("bhts,bshd->bthd", attention_drop, v)
-        return output
+        return output if not unpadded else output.squeeze(0)
 
 
 class CrossAttention(nn.Module):
@@ -288,24 +328,38 @@ class CrossAttention(nn.Module):
                       runtime)
         attention_dropout: The dropout rate to apply to the attention
                            (default: 0.0)
+        alibi_slopes: (nheads,) or (batch_size, nheads). Same bias as FlashAttention, i.e.
+                      -alibi_slope * |i + seqlen_k - seqlen_q - j|, where seqlen_k is the
+                      number of keys of the sequence if key_padding_mask is passed.
     """
 
-    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0):
+    def __init__(self, causal=False, softmax_scale=None, attention_dropout=0.0, alibi_slopes=None):
         super().__init__()
         self.causal = causal
         self.softmax_scale = softmax_scale
         self.drop = nn.Dropout(attention_dropout)
+        self.register_buffer("alibi_slopes", alibi_slopes, persistent=False)
 
-    def forward(self, q, kv, causal=None, key_padding_mask=None):
+    def forward(self, q, kv, causal=None, key_padding_mask=None, cu_seqlens=None, max_seqlen=None):
         """Implements the multihead softmax attention.
         Arguments
         ---------
-            q: The tensor containing the query. (B, Sq, H, D)
-            kv: The tensor containing the key and value. (B, Sk, 2, H_k, D)
+            q: The tensor containing the query. (B, Sq, H, D), or (total, H, D) if cu_seqlens is
+                not None.
+            kv: The tensor containing the key and value. (B, Sk, 2, H_k, D), or
+                (total, 2, H_k, D) if cu_seqlens is not None.
             causal: if passed, will override self.causal
             key_padding_mask: boolean mask to apply to the attention weights. True means to keep,
                 False means to mask out. (B, Sk)
+            cu_seqlens: (batch_size + 1,), dtype torch.int32. The cumulative sequence lengths
+                of the sequences packed into q and kv. Each sequence only attends to itself.
+                This materializes the (total, total) attention matrix, it's only a reference.
+            max_seqlen: unused, for compatibility with FlashCrossAttention.
         """
+        unpadded = cu_seqlens is not None
+        if unpadded:
+            assert key_padding_mask is None
+            q, kv = q.unsqueeze(0), kv.unsqueeze(0)
         batch_size, seqlen_q = q.shape[0], q.shape[1]
         causal = self.causal if causal is None else causal
         seqlen_k = kv.shape[1]
@@ -315,6 +369,20 @@ class CrossAttention(nn.Module):
         k, v = kv.unbind(dim=2)
         softmax_scale = self.softmax_scale or 1.0 / math.sqrt(q.shape[-1])
         scores = torch.einsum("bthd,bshd->bhts", q, k * softmax_scale)
+        if self.alibi_slopes is not None:
+            assert not unpadded, "ALiBi with cu_seqlens is not supported"
+            row_idx = rearrange(
+                torch.arange(seqlen_q, device=q.device, dtype=torch.long), "s -> s 1"
+            )
+            col_idx = torch.arange(seqlen_k, device=kv.device, dtype=torch.long)
+            sk = (
+                seqlen_k
+                if key_padding_mask is None
+                else rearrange(key_padding_mask.sum(-1), "b -> b 1 1 1")
+            )
+            distance = (row_idx + sk - seqlen_q - col_idx).abs()
+            slopes = rearrange(self.alibi_slopes.to(torch.float32), "... h -> ... h 1 1")
+            scores = scores - (slopes * distance).to(scores.dtype)
         if key_padding_mask is not None:
             padding_mask = torch.full(
                 (batch_size, seqlen_k), -10000.0, dtype=scores.dtype, device=scores.device
@@ -335,14 +403,34 @@ class CrossAttention(nn.Module):
             )
             causal_mask = col_idx > row_idx + sk - seqlen_q
             scores = scores.masked_fill(causal_mask, -10000.0)
+        if unpadded:
+            scores = scores.masked_fill(~_same_sequence_mask(cu_seqlens, seqlen_q), -10000.0)
         attention = torch.softmax(scores, dim=-1, dtype=v.dtype)
         attention_drop = self.drop(attention)
         output = torch.einsum("bhts,bshd->bthd", attention_drop, v)
-        return output
+        return output if not unpadded else output.squeeze(0)
+
+
+def _get_kv_scales(inference_params, layer_idx):
+    """Scales of the quantized (paged) cache of layer_idx, or None if the cache isn't quantized."""
+    if inference_params.kv_scales is None:
+        return None
+    return inference_params.kv_scales[layer_idx]
 
 
 def _update_kv_cache(kv, inference_params, layer_idx):
     """kv: (batch_size, seqlen, 2, nheads, head_dim) or (batch_size, 1, 2, nheads, head_dim)"""
+    if inference_params.page_table is not None:
+        # The page pool is allocated up front by PagedKVCache, we just write into it.
+        batch_start = inference_params.batch_size_offset
+        batch_end = batch_start + kv.shape[0]
+        return paged_kv_cache_update(
+            inference_params.key_value_memory_dict[layer_idx],
+            inference_params.page_table[batch_start:batch_end],
+            kv,
+            inference_params.seqlen_offset,
+            kv_scales=_get_kv_scales(inference_params, layer_idx),
+        )
     # Pre-allocate memory for key-values for inference.
     num_heads, head_dim = kv.shape[-2:]
     if layer_idx not in inference_params.key_value_memory_dict:
@@ -366,10 +454,291 @@ def _update_kv_cache(kv, inference_params, layer_idx):
     assert batch_end <= kv_cache.shape[0]
     assert sequence_end <= kv_cache.shape[1]
     assert kv_cache is not None
+    if inference_params.cache_batch_idx is not None:
+        cache_batch_idx = inference_params.cache_batch_idx.long()
+        kv_cache[cache_batch_idx, sequence_start:sequence_end, ...] = kv
+        return kv_cache[cache_batch_idx, :sequence_end, ...]
     kv_cache[batch_start:batch_end, sequence_start:sequence_end, ...] = kv
     return kv_cache[batch_start:batch_end, :sequence_end, ...]
 
 
+def _update_kv_cache_at(kv, batch_idx, positions, seqlens_k, inference_params, layer_idx):
+    """Write kv[i] at position positions[i] of sequence batch_idx[i] of the cache, then read back
+    the keys and values of every sequence, padded to the longest one. This is the reference path
+    for batches where the sequences have different lengths (e.g. continuous batching).
+    kv: (..., 2, nheads, head_dim), where batch_idx and positions broadcast to (...).
+    seqlens_k: (batch_size,), the length of each sequence after the update.
+    Return:
+        kv: (batch_size, max(seqlens_k), 2, nheads, head_dim)
+        key_padding_mask: (batch_size, max(seqlens_k)), True for the positions that hold a key.
+    """
+    batch = seqlens_k.shape[0]
+    kv_cache = inference_params.key_value_memory_dict[layer_idx]
+    positions_k = torch.arange(seqlens_k.max().item(), device=kv.device)
+    if inference_params.page_table is not None:
+        page_size = kv_cache.shape[1]
+        page_table = inference_params.page_table[:batch].long()
+        kv_scales = _get_kv_scales(inference_params, layer_idx)
+        kv_cache_write(
+            kv_cache,
+            page_table[batch_idx, positions // page_size],
+            positions % page_size,
+            kv,
+            kv_scales,
+        )
+        kv = kv_cache_read(
+            kv_cache,
+            page_table[:, positions_k // page_size],
+            positions_k % page_size,
+            kv_scales,
+            dtype=kv.dtype,
+        )
+    else:
+        if inference_params.cache_batch_idx is not None:
+            cache_batch_idx = inference_params.cache_batch_idx[:batch].long()
+        else:
+            batch_start = inference_params.batch_size_offset
+            cache_batch_idx = torch.arange(batch_start, batch_start + batch, device=kv.device)
+        kv_cache[cache_batch_idx[batch_idx], positions] = kv
+        kv = kv_cache[cache_batch_idx, : positions_k.shape[0]]
+    key_padding_mask = positions_k < seqlens_k[:, None]
+    # The cache is allocated with torch.empty, so the padding could hold NaNs
+    kv = kv.masked_fill(rearrange(~key_padding_mask, "b s -> b s 1 1 1"), 0.0)
+    return kv, key_padding_mask
+
+
+def _update_kv_cache_per_sample(kv, inference_params, layer_idx):
+    """Same as _update_kv_cache, except that the new tokens of sequence b start at position
+    lengths_per_sample[b] instead of seqlen_offset.
+    kv: (batch_size, seqlen, 2, nheads, head_dim)
+    Return kv and key_padding_mask as in _update_kv_cache_at.
+    """
+    batch, seqlen = kv.shape[:2]
+    cache_seqlens = inference_params.lengths_per_sample[:batch].long()
+    positions = cache_seqlens[:, None] + torch.arange(seqlen, device=kv.device)
+    batch_idx = torch.arange(batch, device=kv.device)[:, None]
+    return _update_kv_cache_at(
+        kv, batch_idx, positions, cache_seqlens + seqlen, inference_params, layer_idx
+    )
+
+
+def _masked_cross_attn(cross_attn, q, kv, key_padding_mask):
+    """cross_attn(q, kv, key_padding_mask=key_padding_mask). FlashCrossAttention doesn't take a
+    key_padding_mask, so in that case we use the reference CrossAttention with the same causal,
+    softmax_scale and alibi_slopes (this is only called at inference, so there's no dropout).
+    """
+    if isinstance(cross_attn, CrossAttention):
+        return cross_attn(q, kv, key_padding_mask=key_padding_mask)
+    assert tuple(cross_attn.window_size) == (-1, -1), "Local attention is not supported here"
+    cross_attn_ref = CrossAttention(
+        causal=cross_attn.causal,
+        softmax_scale=cross_attn.softmax_scale,
+        alibi_slopes=cross_attn.alibi_slopes,
+    )
+    return cross_attn_ref(q, kv, key_padding_mask=key_padding_mask)
+
+
+def _varlen_batch_idx(inference_params, total):
+    """For a packed batch, return the sequence of each token and its index in the sequence."""
+    cu_seqlens = inference_params.cu_seqlens_q.long()
+    seqlens_q = cu_seqlens[1:] - cu_seqlens[:-1]
+    batch_idx = torch.repeat_interleave(
+        torch.arange(seqlens_q.shape[0], device=cu_seqlens.device), seqlens_q, output_size=total
+    )
+    return batch_idx, torch.arange(total, device=cu_seqlens.device) - cu_seqlens[batch_idx]
+
+
+def _apply_rotary_emb_varlen(rotary_emb, q, kv, inference_params):
+    """Rotary for a packed batch, where the tokens of sequence b start at position
+    lengths_per_sample[b].
+    q: (total, nheads, head_dim), kv: (total, 2, nheads_kv, head_dim)
+    """
+    assert rotary_emb.scale is None, "This code path does not support xPos"
+    rotary_emb._update_cos_sin_cache(inference_params.max_seqlen, device=q.device, dtype=q.dtype)
+    batch = inference_params.cu_seqlens_q.shape[0] - 1
+    rotary_kwargs = dict(
+        interleaved=rotary_emb.interleaved,
+        seqlen_offsets=inference_params.lengths_per_sample[:batch],
+        cu_seqlens=inference_params.cu_seqlens_q,
+        max_seqlen=inference_params.max_seqlen_q,
+    )
+    cos, sin = rotary_emb._cos_cached, rotary_emb._sin_cached
+    q = apply_rotary_emb(q, cos, sin, **rotary_kwargs)
+    k = apply_rotary_emb(kv[:, 0], cos, sin, **rotary_kwargs)
+    return q, torch.stack([k, kv[:, 1]], dim=1)
+
+
+def _update_kvcache_attention_varlen_ref(q, kv, inference_params, layer_idx, cross_attn):
+    """Reference path of a packed batch: write kv to the cache and do attention.
+    q: (total, nheads, head_dim), kv: (total, 2, nheads_kv, head_dim)
+    """
+    total = q.shape[0]
+    batch_idx, idx_in_seq = _varlen_batch_idx(inference_params, total)
+    cu_seqlens = inference_params.cu_seqlens_q.long()
+    seqlens_q = cu_seqlens[1:] - cu_seqlens[:-1]
+    cache_seqlens = inference_params.lengths_per_sample[: seqlens_q.shape[0]].long()
+    kv, key_padding_mask = _update_kv_cache_at(
+        kv,
+        batch_idx,
+        cache_seqlens[batch_idx] + idx_in_seq,
+        cache_seqlens + seqlens_q,
+        inference_params,
+        layer_idx,
+    )
+    # Left-pad the queries so that the last query of each sequence lines up with its last key
+    max_seqlen_q = inference_params.max_seqlen_q
+    rows = max_seqlen_q - seqlens_q[batch_idx] + idx_in_seq
+    q_padded = q.new_zeros(seqlens_q.shape[0], max_seqlen_q, *q.shape[1:])
+    q_padded[batch_idx, rows] = q
+    return _masked_cross_attn(cross_attn, q_padded, kv, key_padding_mask)[batch_idx, rows]
+
+
+def _update_kvcache_attention(q, kv, inference_params, layer_idx, cross_attn, use_flash_attn):
+    """Write kv to inference_params, then do attention.
+    q: (batch_size, seqlen, nheads, head_dim)
+    kv: (batch_size, seqlen, 2, nheads_kv, head_dim)
+    cross_attn: the inner_cross_attn of the layer, FlashCrossAttention or CrossAttention.
+    """
+    assert layer_idx is not None, "Generation requires layer_idx in the constructor"
+    if (
+        inference_params.seqlen_offset == 0
+        or flash_attn_with_kvcache is None
+        or not use_flash_attn
+        # flash_attn_with_kvcache doesn't read quantized caches, the reference path dequantizes
+        # them when reading the keys and values back
+        or inference_params.kv_scales is not None
+    ):
+        if inference_params.seqlen_offset > 0 and inference_params.lengths_per_sample is not None:
+            kv, key_padding_mask = _update_kv_cache_per_sample(kv, inference_params, layer_idx)
+            return _masked_cross_attn(cross_attn, q, kv, key_padding_mask)
+        # At prefill, all the sequences start at position 0
+        kv = _update_kv_cache(kv, inference_params, layer_idx)
+        return cross_attn(q, kv)
+    kv_cache, kv_cache_kwargs = _get_kv_cache_args(inference_params, layer_idx, q.shape[0])
+    return flash_attn_with_kvcache(
+        q,
+        kv_cache[:, :, 0],
+        kv_cache[:, :, 1],
+        kv[:, :, 0],
+        kv[:, :, 1],
+        **kv_cache_kwargs,
+        softmax_scale=cross_attn.softmax_scale,
+        causal=cross_attn.causal,
+        alibi_slopes=getattr(cross_attn, "alibi_slopes", None),
+    )
+
+
+def _update_kvcache_attention_varlen(
+    q, kv, inference_params, layer_idx, rotary_emb, cross_attn, use_flash_attn
+):
+    """Apply rotary, write kv to inference_params, then do attention, for a packed batch where
+    sequence b has the tokens cu_seqlens_q[b]:cu_seqlens_q[b + 1], which start at position
+    lengths_per_sample[b] (e.g. a chunk of a prompt, or a single token being decoded).
+    q: (1, total, nheads, head_dim)
+    kv: (1, total, 2, nheads_kv, head_dim)
+    rotary_emb: RotaryEmbedding or None.
+    cross_attn: the inner_cross_attn of the layer, FlashCrossAttention or CrossAttention.
+    """
+    assert layer_idx is not None, "Generation requires layer_idx in the constructor"
+    q, kv = q[0], kv[0]
+    if rotary_emb is not None:
+        q, kv = _apply_rotary_emb_varlen(rotary_emb, q, kv, inference_params)
+    if (
+        flash_attn_varlen_with_kvcache is None
+        or not use_flash_attn
+        or inference_params.kv_scales is not None
+        # The varlen kernel with a KV cache doesn't take ALiBi
+        or getattr(cross_attn, "alibi_slopes", None) is not None
+    ):
+        context = _update_kvcache_attention_varlen_ref(
+            q, kv, inference_params, layer_idx, cross_attn
+        )
+    else:
+        batch = inference_params.cu_seqlens_q.shape[0] - 1
+        kv_cache, kv_cache_kwargs = _get_kv_cache_args(inference_params, layer_idx, batch)
+        context = flash_attn_varlen_with_kvcache(
+            q,
+            kv_cache[:, :, 0],
+            kv_cache[:, :, 1],
+            kv[:, 0],
+            kv[:, 1],
+            cache_seqlens=kv_cache_kwargs["cache_seqlens"],
+            cache_batch_idx=kv_cache_kwargs["cache_batch_idx"],
+            page_table=kv_cache_kwargs["block_table"],
+            cu_seqlens_q=inference_params.cu_seqlens_q,
+            cu_seqlens_k_new=inference_params.cu_seqlens_q,
+            max_seqlen_q=inference_params.max_seqlen_q,
+            softmax_scale=cross_attn.softmax_scale,
+            causal=cross_attn.causal,
+            window_size=cross_attn.window_size,
+        )
+    return rearrange(context, "t h d -> 1 t h d")
+
+
+def _update_kvcache_attention_tree(q, kv, inference_params, layer_idx, rotary_emb, softmax_scale):
+    """Write kv to inference_params, then do attention, where the new tokens are part of a tree
+    described by inference_params.tree_attn_mask instead of a sequence (e.g. the candidates of
+    tree speculative decoding). FlashAttention doesn't take an arbitrary mask, so this always
+    uses the reference attention.
+    q: (batch_size, seqlen, nheads, head_dim)
+    kv: (batch_size, seqlen, 2, nheads_kv, head_dim)
+    rotary_emb: RotaryEmbedding or None.
+    """
+    seqlen = q.shape[1]
+    tree_attn_mask = inference_params.tree_attn_mask
+    tree_size = tree_attn_mask.shape[1]
+    # The tree takes the last tree_size positions of the cache, and a token is at the position of
+    # the root plus its depth
+    tree_start = inference_params.seqlen_offset + seqlen - tree_size
+    assert tree_start >= 0
+    if rotary_emb is not None:
+        assert rotary_emb.scale is None, "This code path does not support xPos"
+        rotary_emb._update_cos_sin_cache(
+            inference_params.max_seqlen, device=q.device, dtype=q.dtype
+        )
+        positions = tree_start + tree_attn_mask.sum(dim=-1) - 1
+        cos, sin = rotary_emb._cos_cached[positions], rotary_emb._sin_cached[positions]
+        q = apply_rotary_emb_torch(q, cos, sin, rotary_emb.interleaved)
+        k = apply_rotary_emb_torch(kv[:, :, 0], cos, sin, rotary_emb.interleaved)
+        kv = torch.stack([k, kv[:, :, 1]], dim=2)
+    kv = _update_kv_cache(kv, inference_params, layer_idx)
+    if kv.shape[3] != q.shape[2]:  # MQA/GQA
+        kv = repeat(kv, "... hkv d -> ... (hkv g) d", g=q.shape[2] // kv.shape[3])
+    k, v = kv.unbind(dim=2)
+    softmax_scale = softmax_scale or 1.0 / math.sqrt(q.shape[-1])
+    scores = torch.einsum("bthd,bshd->bhts", q, k * softmax_scale)
+    # The tokens before the tree are visible to every token of the tree
+    attn_mask = torch.cat(
+        [
+            torch.ones(seqlen, tree_start, dtype=torch.bool, device=q.device),
+            tree_attn_mask.to(device=q.device, dtype=torch.bool),
+        ],
+        dim=1,
+    )
+    scores = scores.masked_fill(~attn_mask, -10000.0)
+    attention = torch.softmax(scores, dim=-1, dtype=v.dtype)
+    return torch.einsum("bhts,bshd->bthd", attention, v)
+
+
+def _get_kv_cache_args(inference_params, layer_idx, batch):
+    """Return the cache and the kwargs describing it to pass to flash_attn_with_kvcache."""
+    kv_cache = inference_params.key_value_memory_dict[layer_idx]
+    if inference_params.page_table is None and inference_params.cache_batch_idx is None:
+        kv_cache = kv_cache[:batch]
+    cache_seqlens = (
+        inference_params.lengths_per_sample[:batch]
+        if inference_params.lengths_per_sample is not None
+        else inference_params.seqlen_offset
+    )
+    page_table = inference_params.page_table
+    kwargs = dict(
+        cache_seqlens=cache_seqlens,
+        cache_batch_idx=inference_params.cache_batch_idx,
+        block_table=page_table[:batch] if page_table is not None else None,
+    )
+    return kv_cache, kwargs
+
+
 class MHA(nn.Module):
     """Multi-head self-attention and cross-attention"""
 
@@ -390,6 +759,7 @@ class MHA(nn.Module):
         rotary_emb_base=10000.0,
         rotary_emb_scale_base=None,
         rotary_emb_interleaved=False,
+        rotary_emb_scaling=None,
         use_alibi=False,
         window_size=(-1, -1),
         fused_bias_fc=False,
@@ -401,6 +771,8 @@ class MHA(nn.Module):
     ) -> None:
         """
         num_heads_kv: can be used to toggle MQA / GQA. If None, use num_heads.
+        rotary_emb_scaling: dict of the context extension arguments of RotaryEmbedding
+            (scaling_type, scaling_factor, original_max_seqlen, ...), or None.
         return_residual: whether to return the input x along with the output. This is for
             performance reason: for post-norm architecture, returning the input allows us
             to fuse the backward of nn.Linear with the residual connection.
@@ -442,6 +814,7 @@ class MHA(nn.Module):
                 base=rotary_emb_base,
                 scale_base=rotary_emb_scale_base,
                 interleaved=rotary_emb_interleaved,
+                **(rotary_emb_scaling or {}),
                 device=device,
             )
 
@@ -515,13 +888,7 @@ class MHA(nn.Module):
             rotary_cos, rotary_sin = self.rotary_emb._cos_cached, self.rotary_emb._sin_cached
         else:
             rotary_cos, rotary_sin = None, None
-        batch = q.shape[0]
-        kv_cache = inference_params.key_value_memory_dict[self.layer_idx][:batch]
-        cache_seqlens = (
-            inference_params.lengths_per_sample[:batch]
-            if inference_params.lengths_per_sample is not None
-            else inference_params.seqlen_offset
-        )
+        kv_cache, kv_cache_kwargs = _get_kv_cache_args(inference_params, self.layer_idx, q.shape[0])
         alibi_slopes = getattr(self.inner_cross_attn, "alibi_slopes", None)
         context = flash_attn_with_kvcache(
             q,
@@ -531,7 +898,7 @@ class MHA(nn.Module):
             kv[:, :, 1],
             rotary_cos=rotary_cos,
             rotary_sin=rotary_sin,
-            cache_seqlens=cache_seqlens,
+            **kv_cache_kwargs,
             softmax_scale=self.inner_cross_attn.softmax_scale,
             causal=self.inner_cross_attn.causal,
             rotary_interleaved=self.rotary_emb.interleaved if self.rotary_emb_dim > 0 else False,
@@ -539,37 +906,6 @@ class MHA(nn.Module):
         )
         return context
 
-    def _update_kvcache_attention(self, q, kv, inference_params):
-        """Write kv to inference_params, then do attention"""
-        if (
-            inference_params.seqlen_offset == 0
-            or flash_attn_with_kvcache is None
-            or not self.use_flash_attn
-        ):
-            # TODO: this only uses seqlen_offset and not lengths_per_sample.
-            kv = self._update_kv_cache(kv, inference_params)
-            return self.inner_cross_attn(q, kv)
-        else:
-            batch = q.shape[0]
-            kv_cache = inference_params.key_value_memory_dict[self.layer_idx][:batch]
-            cache_seqlens = (
-                inference_params.lengths_per_sample[:batch]
-                if inference_params.lengths_per_sample is not None
-                else inference_params.seqlen_offset
-            )
-            alibi_slopes = getattr(self.inner_cross_attn, "alibi_slopes", None)
-            return flash_attn_with_kvcache(
-                q,
-                kv_cache[:, :, 0],
-                kv_cache[:, :, 1],
-                kv[:, :, 0],
-                kv[:, :, 1],
-                cache_seqlens=cache_seqlens,
-                softmax_scale=self.inner_cross_attn.softmax_scale,
-                causal=self.inner_cross_attn.causal,
-                alibi_slopes=alibi_slopes,
-            )
-
     def forward(
         self,
         x,
@@ -588,8 +924,9 @@ class MHA(nn.Module):
                 is the is the sum of the sequence lengths in the batch.
             x_kv: (batch, seqlen, hidden_dim), only applicable for cross-attention. If None, use x.
             cu_seqlens: (batch_size + 1,), dtype torch.int32. The cumulative sequence lengths
-                of the sequences in the batch, used to index into x. Only applicable when using
-                FlashAttention.
+                of the sequences in the batch, used to index into x. Each sequence only attends
+                to itself, and the rotary embedding positions restart at 0 for each sequence.
+                Without FlashAttention, this uses the (slow) reference attention.
             max_seqlen: int. Maximum sequence length in the batch.
             key_padding_mask: boolean mask, True means to keep, False means to mask out.
                 (batch, seqlen). Only applicable when not using FlashAttention.
@@ -602,9 +939,7 @@ class MHA(nn.Module):
         if cu_seqlens is not None:
             assert max_seqlen is not None
             assert key_padding_mask is None
-            assert self.use_flash_attn
             assert not self.dwconv
-            assert self.rotary_emb_dim == 0
         if key_padding_mask is not None:
             assert cu_seqlens is None
             assert max_seqlen is None
@@ -616,7 +951,7 @@ class MHA(nn.Module):
 
         kwargs = (
             {"cu_seqlens": cu_seqlens, "max_seqlen": max_seqlen, **kwargs}
-            if self.use_flash_attn
+            if self.use_flash_attn or cu_seqlens is not None
             else {"key_padding_mask": key_padding_mask, **kwargs}
         )
         seqlen_offset = (
@@ -628,7 +963,9 @@ class MHA(nn.Module):
                 else inference_params.seqlen_offset
             )
         )
-        rotary_max_seqlen = inference_params.max_seqlen if inference_params is not None else None
+        rotary_max_seqlen = (
+            inference_params.max_seqlen if inference_params is not None else max_seqlen
+        )
         batch, seqlen = x.shape[:2]
         if not self.cross_attn and self.num_heads_kv == self.num_heads:
             assert x_kv is None and mixer_subset is None
@@ -638,15 +975,38 @@ class MHA(nn.Module):
                     self.dwconv_qkv(rearrange(qkv, "b s d -> b d s"))[..., :-2], "b d s -> b s d"
                 ).contiguous()
             qkv = rearrange(qkv, "... (three h d) -> ... three h d", three=3, d=self.head_dim)
-            if (
+            if inference_params is not None and inference_params.cu_seqlens_q is not None:
+                context = _update_kvcache_attention_varlen(
+                    qkv[:, :, 0],
+                    qkv[:, :, 1:],
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn,
+                    self.use_flash_attn,
+                )
+            elif inference_params is not None and inference_params.tree_attn_mask is not None:
+                context = _update_kvcache_attention_tree(
+                    qkv[:, :, 0],
+                    qkv[:, :, 1:],
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn.softmax_scale,
+                )
+            elif (
                 inference_params is None
                 or inference_params.seqlen_offset == 0
                 or (self.rotary_emb_dim == 0 or self.rotary_emb_dim % 16 != 0)
                 or not self.use_flash_attn
+                or inference_params.kv_scales is not None
             ):
                 if self.rotary_emb_dim > 0:
                     qkv = self.rotary_emb(
-                        qkv, seqlen_offset=seqlen_offset, max_seqlen=rotary_max_seqlen
+                        qkv,
+                        seqlen_offset=seqlen_offset,
+                        max_seqlen=rotary_max_seqlen,
+                        cu_seqlens=cu_seqlens,
                     )
                 if inference_params is None:
                     if not self.checkpointing:
@@ -654,8 +1014,13 @@ class MHA(nn.Module):
                     else:
                         context = torch.utils.checkpoint.checkpoint(self.inner_attn, qkv, **kwargs)
                 else:
-                    context = self._update_kvcache_attention(
-                        qkv[:, :, 0], qkv[:, :, 1:], inference_params
+                    context = _update_kvcache_attention(
+                        qkv[:, :, 0],
+                        qkv[:, :, 1:],
+                        inference_params,
+                        self.layer_idx,
+                        self.inner_cross_attn,
+                        self.use_flash_attn,
                     )
             else:
                 context = self._apply_rotary_update_kvcache_attention(
@@ -670,6 +1035,9 @@ class MHA(nn.Module):
                 qkv = self.Wqkv(x)
                 q = qkv[..., : self.num_heads * self.head_dim]
                 kv = qkv[..., self.num_heads * self.head_dim :]
+                if cu_seqlens is not None and self.use_flash_attn:
+                    # The keys and values are packed the same way as the queries
+                    kwargs.update(cu_seqlens_k=cu_seqlens, max_seqlen_k=max_seqlen)
             q = rearrange(q, "... (h d) -> ... h d", d=self.head_dim)
             kv = rearrange(kv, "... (two hkv d) -> ... two hkv d", two=2, d=self.head_dim)
             if self.dwconv:
@@ -679,15 +1047,39 @@ class MHA(nn.Module):
                 kv = rearrange(
                     self.dwconv_kv(rearrange(kv, "b s d -> b d s"))[..., :-2], "b d s -> b s d"
                 ).contiguous()
-            if (
+            if inference_params is not None and inference_params.cu_seqlens_q is not None:
+                context = _update_kvcache_attention_varlen(
+                    q,
+                    kv,
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn,
+                    self.use_flash_attn,
+                )
+            elif inference_params is not None and inference_params.tree_attn_mask is not None:
+                context = _update_kvcache_attention_tree(
+                    q,
+                    kv,
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn.softmax_scale,
+                )
+            elif (
                 inference_params is None
                 or inference_params.seqlen_offset == 0
                 or (self.rotary_emb_dim == 0 or self.rotary_emb_dim % 16 != 0)
                 or not self.use_flash_attn
+                or inference_params.kv_scales is not None
             ):
                 if self.rotary_emb_dim > 0:
                     q, kv = self.rotary_emb(
-                        q, kv, seqlen_offset=seqlen_offset, max_seqlen=rotary_max_seqlen
+                        q,
+                        kv,
+                        seqlen_offset=seqlen_offset,
+                        max_seqlen=rotary_max_seqlen,
+                        cu_seqlens=cu_seqlens,
                     )
                 if inference_params is None:
                     if not self.checkpointing:
@@ -697,7 +1089,14 @@ class MHA(nn.Module):
                             self.inner_cross_attn, q, kv, **kwargs
                         )
                 else:
-                    context = self._update_kvcache_attention(q, kv, inference_params)
+                    context = _update_kvcache_attention(
+                        q,
+                        kv,
+                        inference_params,
+                        self.layer_idx,
+                        self.inner_cross_attn,
+                        self.use_flash_attn,
+                    )
             else:
                 context = self._apply_rotary_update_kvcache_attention(q, kv, inference_params)
         out = self.out_proj(rearrange(context, "... h d -> ... (h d)"))
@@ -723,14 +1122,27 @@ class ParallelMHA(nn.Module):
         rotary_emb_base=10000.0,
         rotary_emb_scale_base=None,
         rotary_emb_interleaved=False,
+        rotary_emb_scaling=None,
         use_alibi=False,
         window_size=(-1, -1),
         use_flash_attn=False,
         checkpointing=False,
         sequence_parallel=True,
+        sequence_parallel_chunks=1,
+        ulysses=False,
         device=None,
         dtype=None,
     ) -> None:
+        """
+        sequence_parallel_chunks: with sequence_parallel, the all_gather before Wqkv and the
+            reduce_scatter after out_proj are split in this many chunks along the sequence, to
+            overlap them with the matmuls.
+        ulysses: if True, do sequence parallelism over process_group as in DeepSpeed-Ulysses
+            (https://arxiv.org/abs/2309.14509) instead of tensor parallelism: the weights are
+            replicated, x is sharded along the sequence, and all-to-alls switch it to sharded
+            along the heads for the attention, and back. The number of heads (and of KV heads)
+            must be divisible by the world size.
+        """
         factory_kwargs = {"device": device, "dtype": dtype}
         super().__init__()
         self.embed_dim = embed_dim
@@ -742,6 +1154,7 @@ class ParallelMHA(nn.Module):
         self.process_group = process_group
         self.world_size = process_group.size()
         self.local_rank = torch.distributed.get_rank(process_group)
+        self.ulysses = ulysses
 
         self.num_heads = num_heads
         assert self.embed_dim % self.num_heads == 0, "embed_dim must be divisible by num_heads"
@@ -759,6 +1172,10 @@ class ParallelMHA(nn.Module):
         )
         self.head_dim = self.embed_dim // num_heads
         qkv_dim = self.head_dim * (self.num_heads + 2 * self.num_heads_kv)
+        if ulysses:
+            assert (
+                self.num_heads_kv % self.world_size == 0
+            ), "Ulysses sequence parallel requires num_heads_kv to be divisible by the world size"
 
         if use_alibi:
             assert use_flash_attn, "ALiBi code path requires flash_attn"
@@ -781,20 +1198,25 @@ class ParallelMHA(nn.Module):
                 base=rotary_emb_base,
                 scale_base=rotary_emb_scale_base,
                 interleaved=rotary_emb_interleaved,
+                **(rotary_emb_scaling or {}),
                 device=device,
             )
 
-        if ColumnParallelLinear is None or RowParallelLinear is None:
-            raise ImportError("fused_dense is not installed")
-        self.Wqkv = ColumnParallelLinear(
-            embed_dim,
-            qkv_dim,
-            process_group,
-            bias=qkv_proj_bias,
-            sequence_parallel=sequence_parallel,
-            multiple_of=self.head_dim * (self.num_heads // self.num_heads_kv + 2),
-            **factory_kwargs,
-        )
+        if ulysses:
+            self.Wqkv = nn.Linear(embed_dim, qkv_dim, bias=qkv_proj_bias, **factory_kwargs)
+        else:
+            if ColumnParallelLinear is None or RowParallelLinear is None:
+                raise ImportError("fused_dense is not installed")
+            self.Wqkv = ColumnParallelLinear(
+                embed_dim,
+                qkv_dim,
+                process_group,
+                bias=qkv_proj_bias,
+                sequence_parallel=sequence_parallel,
+                multiple_of=self.head_dim * (self.num_heads // self.num_heads_kv + 2),
+                sequence_parallel_chunks=sequence_parallel_chunks,
+                **factory_kwargs,
+            )
         inner_attn_cls = (
             partial(FlashSelfAttention, alibi_slopes=alibi_slopes, window_size=window_size)
             if use_flash_attn
@@ -811,15 +1233,26 @@ class ParallelMHA(nn.Module):
         self.inner_cross_attn = inner_cross_attn_cls(
             causal=causal, softmax_scale=softmax_scale, attention_dropout=dropout
         )
-        self.out_proj = RowParallelLinear(
-            embed_dim,
-            embed_dim,
-            process_group,
-            bias=out_proj_bias,
-            sequence_parallel=sequence_parallel,
-            multiple_of=self.head_dim,
-            **factory_kwargs,
-        )
+        if ulysses:
+            self.out_proj = nn.Linear(embed_dim, embed_dim, bias=out_proj_bias, **factory_kwargs)
+            # The weights are replicated, and each rank computes the gradient of its part of the
+            # sequence, see allreduce_sequence_parallel_grad
+            for p in [*self.Wqkv.parameters(), *self.out_proj.parameters()]:
+                p._sequence_parallel = True
+                p._shared_params = True
+            # The output all-to-all is done in chunks of heads, to overlap it with out_proj
+            self.ulysses_num_chunks = math.gcd(self.num_heads_per_rank, 4)
+        else:
+            self.out_proj = RowParallelLinear(
+                embed_dim,
+                embed_dim,
+                process_group,
+                bias=out_proj_bias,
+                sequence_parallel=sequence_parallel,
+                multiple_of=self.head_dim,
+                sequence_parallel_chunks=sequence_parallel_chunks,
+                **factory_kwargs,
+            )
 
     def allocate_inference_cache(self, batch_size, max_seqlen, dtype=None):
         dtype = self.out_proj.weight.dtype if dtype is None else dtype
@@ -855,13 +1288,7 @@ class ParallelMHA(nn.Module):
             rotary_cos, rotary_sin = self.rotary_emb._cos_cached, self.rotary_emb._sin_cached
         else:
             rotary_cos, rotary_sin = None, None
-        batch = q.shape[0]
-        kv_cache = inference_params.key_value_memory_dict[self.layer_idx][:batch]
-        cache_seqlens = (
-            inference_params.lengths_per_sample[:batch]
-            if inference_params.lengths_per_sample is not None
-            else inference_params.seqlen_offset
-        )
+        kv_cache, kv_cache_kwargs = _get_kv_cache_args(inference_params, self.layer_idx, q.shape[0])
         alibi_slopes = getattr(self.inner_cross_attn, "alibi_slopes", None)
         context = flash_attn_with_kvcache(
             q,
@@ -871,7 +1298,7 @@ class ParallelMHA(nn.Module):
             kv[:, :, 1],
             rotary_cos=rotary_cos,
             rotary_sin=rotary_sin,
-            cache_seqlens=cache_seqlens,
+            **kv_cache_kwargs,
             softmax_scale=self.inner_cross_attn.softmax_scale,
             causal=self.inner_cross_attn.causal,
             rotary_interleaved=self.rotary_emb.interleaved if self.rotary_emb_dim > 0 else False,
@@ -879,34 +1306,6 @@ class ParallelMHA(nn.Module):
         )
         return context
 
-    def _update_kvcache_attention(self, q, kv, inference_params):
-        """Write kv to inference_params, then do attention"""
-        if inference_params.seqlen_offset == 0 or not self.use_flash_attn:
-            # TODO: this only uses seqlen_offset and not lengths_per_sample.
-            kv = self._update_kv_cache(kv, inference_params)
-            return self.inner_cross_attn(q, kv)
-        else:
-            batch = q.shape[0]
-            kv_cache = inference_params.key_value_memory_dict[self.layer_idx][:batch]
-            cache_seqlens = (
-                inference_params.lengths_per_sample[:batch]
-                if inference_params.lengths_per_sample is not None
-                else inference_params.seqlen_offset
-            )
-            alibi_slopes = getattr(self.inner_cross_attn, "alibi_slopes", None)
-            context = flash_attn_with_kvcache(
-                q,
-                kv_cache[:, :, 0],
-                kv_cache[:, :, 1],
-                kv[:, :, 0],
-                kv[:, :, 1],
-                cache_seqlens=cache_seqlens,
-                softmax_scale=self.inner_cross_attn.softmax_scale,
-                causal=self.inner_cross_attn.causal,
-                alibi_slopes=alibi_slopes,
-            )
-            return context
-
     def forward(self, x, seqlen=None, inference_params=None, **kwargs):
         """
         Arguments:
@@ -914,8 +1313,20 @@ class ParallelMHA(nn.Module):
                 If seqlen is not None, x is (batch * seqlen, hidden_dim). This is so that when we
                 split x during sequence parallel, we split the batch * seqlen dimension
                 (in case batch is small).
+                With ulysses=True, x is (batch, seqlen / world_size, hidden_dim), the r-th chunk of
+                the sequence on rank r, and the output has the same shape.
         """
-        qkv = self.Wqkv(x)
+        if self.ulysses:
+            assert seqlen is None, "Ulysses sequence parallel shards x along seqlen, not batch"
+            assert inference_params is None, "Ulysses sequence parallel does not support generation"
+            # Q, K, V separately, so that the all-to-all of one overlaps the projection of the next
+            splits = [self.num_heads * self.head_dim] + [self.num_heads_kv * self.head_dim] * 2
+            qkv = linear_seq_to_head(
+                x, self.Wqkv.weight, self.Wqkv.bias, splits, self.head_dim, self.process_group
+            )
+            qkv = rearrange(qkv, "b s h d -> b s (h d)")
+        else:
+            qkv = self.Wqkv(x)
         if seqlen is not None:
             qkv = rearrange(qkv, "(b s) ... -> b s ...", s=seqlen)
         seqlen_offset = (
@@ -930,11 +1341,31 @@ class ParallelMHA(nn.Module):
         rotary_max_seqlen = inference_params.max_seqlen if inference_params is not None else None
         if self.num_heads_kv == self.num_heads:
             qkv = rearrange(qkv, "b s (three h d) -> b s three h d", three=3, d=self.head_dim)
-            if (
+            if inference_params is not None and inference_params.cu_seqlens_q is not None:
+                context = _update_kvcache_attention_varlen(
+                    qkv[:, :, 0],
+                    qkv[:, :, 1:],
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn,
+                    self.use_flash_attn,
+                )
+            elif inference_params is not None and inference_params.tree_attn_mask is not None:
+                context = _update_kvcache_attention_tree(
+                    qkv[:, :, 0],
+                    qkv[:, :, 1:],
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn.softmax_scale,
+                )
+            elif (
                 inference_params is None
                 or inference_params.seqlen_offset == 0
                 or (self.rotary_emb_dim == 0 or self.rotary_emb_dim % 16 != 0)
                 or not self.use_flash_attn
+                or inference_params.kv_scales is not None
             ):
                 if self.rotary_emb_dim > 0:
                     qkv = self.rotary_emb(
@@ -946,8 +1377,13 @@ class ParallelMHA(nn.Module):
                     else:
                         context = torch.utils.checkpoint.checkpoint(self.inner_attn, qkv, **kwargs)
                 else:
-                    context = self._update_kvcache_attention(
-                        qkv[:, :, 0], qkv[:, :, 1:], inference_params
+                    context = _update_kvcache_attention(
+                        qkv[:, :, 0],
+                        qkv[:, :, 1:],
+                        inference_params,
+                        self.layer_idx,
+                        self.inner_cross_attn,
+                        self.use_flash_attn,
                     )
             else:
                 context = self._apply_rotary_update_kvcache_attention(
@@ -965,11 +1401,31 @@ class ParallelMHA(nn.Module):
                 two=2,
                 d=self.head_dim,
             )
-            if (
+            if inference_params is not None and inference_params.cu_seqlens_q is not None:
+                context = _update_kvcache_attention_varlen(
+                    q,
+                    kv,
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn,
+                    self.use_flash_attn,
+                )
+            elif inference_params is not None and inference_params.tree_attn_mask is not None:
+                context = _update_kvcache_attention_tree(
+                    q,
+                    kv,
+                    inference_params,
+                    self.layer_idx,
+                    self.rotary_emb if self.rotary_emb_dim > 0 else None,
+                    self.inner_cross_attn.softmax_scale,
+                )
+            elif (
                 inference_params is None
                 or inference_params.seqlen_offset == 0
                 or (self.rotary_emb_dim == 0 or self.rotary_emb_dim % 16 != 0)
                 or not self.use_flash_attn
+                or inference_params.kv_scales is not None
             ):
                 if self.rotary_emb_dim > 0:
                     q, kv = self.rotary_emb(
@@ -983,9 +1439,24 @@ class ParallelMHA(nn.Module):
                             self.inner_cross_attn, q, kv, **kwargs
                         )
                 else:
-                    context = self._update_kvcache_attention(q, kv, inference_params)
+                    context = _update_kvcache_attention(
+                        q,
+                        kv,
+                        inference_params,
+                        self.layer_idx,
+                        self.inner_cross_attn,
+                        self.use_flash_attn,
+                    )
             else:
                 context = self._apply_rotary_update_kvcache_attention(q, kv, inference_params)
+        if self.ulysses:
+            return linear_head_to_seq(
+                context,
+                self.out_proj.weight,
+                self.out_proj.bias,
+                self.process_group,
+                self.ulysses_num_chunks,
+            )
         context = rearrange(context, "b s h d -> b s (h d)")
         if seqlen is not None:
             context = rearrange(context, "b s d -> (b s) d")
@@ -62,6 +62,7 @@ class ParallelMLP(nn.Module):
         sequence_parallel=True,
         bias1=True,
         bias2=True,
+        sequence_parallel_chunks=1,
         device=None,
         dtype=None,
     ):
@@ -77,6 +78,7 @@ class ParallelMLP(nn.Module):
             process_group,
             bias=bias1,
             sequence_parallel=sequence_parallel,
+            sequence_parallel_chunks=sequence_parallel_chunks,
             **factory_kwargs,
         )
         self.activation = activation
@@ -86,6 +88,7 @@ class ParallelMLP(nn.Module):
             process_group,
             bias=bias2,
             sequence_parallel=sequence_parallel,
+            sequence_parallel_chunks=sequence_parallel_chunks,
             **factory_kwargs,
         )
 
@@ -150,6 +153,7 @@ class ParallelGatedMlp(nn.Module):
         bias2=True,
         multiple_of=128,
         sequence_parallel=True,
+        sequence_parallel_chunks=1,
         device=None,
         dtype=None,
     ):
@@ -168,6 +172,7 @@ class ParallelGatedMlp(nn.Module):
             process_group,
             bias=bias1,
             sequence_parallel=sequence_parallel,
+            sequence_parallel_chunks=sequence_parallel_chunks,
             **factory_kwargs,
         )
         self.activation = activation
@@ -177,6 +182,7 @@ class ParallelGatedMlp(nn.Module):
             process_group,
             bias=bias2,
             sequence_parallel=sequence_parallel,
+            sequence_parallel_chunks=sequence_parallel_chunks,
             **factory_kwargs,
         )
 
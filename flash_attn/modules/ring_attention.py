@@ -0,0 +1,288 @@
+# Ring attention (context parallel): https://arxiv.org/abs/2310.01889
+# Each rank holds a shard of the sequence. The K/V shards go around the ring of ranks, and each
+# rank attends its queries to one K/V shard at a time, merging the partial outputs with their
+# log-sum-exp. The merge uses the flash_attn_combine kernel of FlashAttention 3 (hopper/) or of
+# the CuTe DSL implementation (flash_attn/cute/) when one of them is installed, and torch
+# otherwise.
+
+import math
+
+import torch
+import torch.distributed as dist
+import torch.nn as nn
+from einops import rearrange
+
+try:
+    from flash_attn.flash_attn_interface import _flash_attn_backward, _flash_attn_forward
+except ImportError:
+    _flash_attn_forward, _flash_attn_backward = None, None
+
+try:
+    from flash_attn_interface import flash_attn_combine
+except ImportError:
+    try:
+        from flash_attn.cute.interface import flash_attn_combine
+    except ImportError:
+        flash_attn_combine = None
+
+
+def zigzag_shard(x, world_size, rank, dim=1):
+    """Shard x along dim for causal ring attention: x is split in 2 * world_size chunks, and rank
+    gets chunks rank and 2 * world_size - 1 - rank, so that every rank has the same amount of
+    causal attention to compute.
+    """
+    chunks = x.chunk(2 * world_size, dim=dim)
+    return torch.cat([chunks[rank], chunks[2 * world_size - 1 - rank]], dim=dim)
+
+
+def zigzag_unshard(shards, dim=1):
+    """Inverse of zigzag_shard: the list of the shards of all the ranks -> the full tensor."""
+    world_size = len(shards)
+    halves = [shard.chunk(2, dim=dim) for shard in shards]
+    chunks = [halves[r][0] for r in range(world_size)]
+    chunks += [halves[r][1] for r in reversed(range(world_size))]
+    return torch.cat(chunks, dim=dim)
+
+
+def _attn_block_forward_ref(q, k, v, softmax_scale, causal):
+    """Attention of q against one K/V block. Return the output (in fp32) and the LSE
+    (batch, nheads, seqlen_q)."""
+    ngroups = q.shape[2] // k.shape[2]
+    k, v = [x.float().repeat_interleave(ngroups, dim=2) for x in (k, v)]
+    scores = torch.einsum("bthd,bshd->bhts", q.float() * softmax_scale, k)
+    if causal:
+        mask = torch.ones(scores.shape[-2:], dtype=torch.bool, device=q.device).triu(1)
+        scores = scores.masked_fill(mask, float("-inf"))
+    lse = torch.logsumexp(scores, dim=-1)
+    out = torch.einsum("bhts,bshd->bthd", torch.exp(scores - lse.unsqueeze(-1)), v)
+    return out, lse
+
+
+def _attn_block_backward_ref(dout, q, k, v, out, lse, softmax_scale, causal):
+    """Gradients of the attention of q against one K/V block, given the final output and LSE
+    of q (over all the blocks)."""
+    ngroups = q.shape[2] // k.shape[2]
+    kf, vf = [x.float().repeat_interleave(ngroups, dim=2) for x in (k, v)]
+    qf, dout, out = q.float(), dout.float(), out.float()
+    scores = torch.einsum("bthd,bshd->bhts", qf * softmax_scale, kf)
+    if causal:
+        mask = torch.ones(scores.shape[-2:], dtype=torch.bool, device=q.device).triu(1)
+        scores = scores.masked_fill(mask, float("-inf"))
+    p = torch.exp(scores - lse.unsqueeze(-1))
+    dv = torch.einsum("bhts,bthd->bshd", p, dout)
+    dp = torch.einsum("bthd,bshd->bhts", dout, vf)
+    delta = rearrange((dout * out).sum(-1), "b t h -> b h t 1")
+    ds = p * (dp - delta) * softmax_scale
+    dq = torch.einsum("bhts,bshd->bthd", ds, kf)
+    dk = torch.einsum("bhts,bthd->bshd", ds, qf)
+    dk, dv = [rearrange(x, "b s (h g) d -> b s h g d", g=ngroups).sum(3) for x in (dk, dv)]
+    return dq, dk, dv
+
+
+def _attn_block_forward(q, k, v, softmax_scale, causal):
+    if q.is_cuda and _flash_attn_forward is not None:
+        out, lse, _, _ = _flash_attn_forward(
+            q, k, v, 0.0, softmax_scale, causal, -1, -1, 0.0, None, False
+        )
+        return out, lse
+    return _attn_block_forward_ref(q, k, v, softmax_scale, causal)
+
+
+def _attn_block_backward(dout, q, k, v, out, lse, softmax_scale, causal):
+    if q.is_cuda and _flash_attn_backward is not None:
+        dq, dk, dv = torch.empty_like(q), torch.empty_like(k), torch.empty_like(v)
+        _flash_attn_backward(
+            dout, q, k, v, out, lse.contiguous(), dq, dk, dv, 0.0, softmax_scale, causal, -1, -1,
+            0.0, None, False
+        )
+        return dq, dk, dv
+    return _attn_block_backward_ref(dout, q, k, v, out, lse, softmax_scale, causal)
+
+
+def _merge(out, lse, block_out, block_lse):
+    """Merge the partial attention outputs of two sets of keys, from their LSE.
+    out: (batch, seqlen_q, nheads, headdim) in fp32, lse: (batch, nheads, seqlen_q).
+    """
+    if out.is_cuda and flash_attn_combine is not None:
+        out_partial = torch.stack([out, block_out.float()])
+        lse_partial = rearrange(torch.stack([lse, block_lse]), "n b h t -> n b t h")
+        new_out, new_lse = flash_attn_combine(out_partial, lse_partial, out_dtype=torch.float32)
+        return new_out, rearrange(new_lse, "b t h -> b h t")
+    new_lse = torch.logaddexp(lse, block_lse)
+    scale = rearrange(torch.exp(lse - new_lse), "b h t -> b t h 1")
+    block_scale = rearrange(torch.exp(block_lse - new_lse), "b h t -> b t h 1")
+    return out * scale + block_out.float() * block_scale, new_lse
+
+
+class RingComm:
+    """Send tensors to the next rank of the ring and receive the same shapes from the previous
+    one, asynchronously."""
+
+    def __init__(self, process_group):
+        self.process_group = process_group
+        world_size = dist.get_world_size(process_group)
+        rank = dist.get_rank(process_group)
+        self.next_rank = dist.get_global_rank(process_group, (rank + 1) % world_size)
+        self.prev_rank = dist.get_global_rank(process_group, (rank - 1) % world_size)
+
+    def send_recv(self, tensors, tag=0):
+        recv = [torch.empty(t.shape, dtype=t.dtype, device=t.device) for t in tensors]
+        ops = [
+            dist.P2POp(dist.isend, t.contiguous(), self.next_rank, self.process_group, tag)
+            for t in tensors
+        ]
+        ops += [dist.P2POp(dist.irecv, r, self.prev_rank, self.process_group, tag) for r in recv]
+        return recv, dist.batch_isend_irecv(ops)
+
+    @staticmethod
+    def wait(recv, reqs):
+        for req in reqs:
+            req.wait()
+        return recv
+
+
+def _block_schedule(step, rank, world_size, causal, seqlen_local):
+    """Which queries attend to which keys of the K/V shard of rank (rank - step) % world_size,
+    for shards from zigzag_shard. Return (q slice, kv slice, causal)."""
+    full = slice(0, seqlen_local)
+    if not causal:
+        return full, full, False
+    if step == 0:
+        return full, full, True
+    half = seqlen_local // 2
+    if (rank - step) % world_size < rank:
+        # Both chunks of q come after the first chunk of kv, and before its second chunk
+        return full, slice(0, half), False
+    # Only the second chunk of q comes after the chunks of kv
+    return slice(half, seqlen_local), full, False
+
+
+class RingAttnFunc(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, q, k, v, softmax_scale, causal, process_group):
+        world_size = dist.get_world_size(process_group)
+        rank = dist.get_rank(process_group)
+        seqlen_local = q.shape[1]
+        assert not causal or seqlen_local % 2 == 0, "Causal ring attention needs zigzag shards"
+        comm = RingComm(process_group)
+        out = lse = None
+        kv = [k, v]
+        for step in range(world_size):
+            if step + 1 < world_size:  # Overlap the transfer of the next K/V with this block
+                next_kv = comm.send_recv(kv)
+            q_slice, kv_slice, block_causal = _block_schedule(
+                step, rank, world_size, causal, seqlen_local
+            )
+            block_out, block_lse = _attn_block_forward(
+                q[:, q_slice], kv[0][:, kv_slice], kv[1][:, kv_slice], softmax_scale, block_causal
+            )
+            if out is None:
+                out, lse = block_out.float(), block_lse
+            else:
+                out[:, q_slice], lse[:, :, q_slice] = _merge(
+                    out[:, q_slice], lse[:, :, q_slice], block_out, block_lse
+                )
+            if step + 1 < world_size:
+                kv = RingComm.wait(*next_kv)
+        out = out.to(q.dtype)
+        ctx.save_for_backward(q, k, v, out, lse)
+        ctx.softmax_scale = softmax_scale
+        ctx.causal = causal
+        ctx.process_group = process_group
+        return out
+
+    @staticmethod
+    def backward(ctx, dout):
+        q, k, v, out, lse = ctx.saved_tensors
+        process_group = ctx.process_group
+        world_size = dist.get_world_size(process_group)
+        rank = dist.get_rank(process_group)
+        seqlen_local = q.shape[1]
+        comm = RingComm(process_group)
+        dq = torch.zeros_like(q, dtype=torch.float32)
+        # The gradients of each K/V shard go around the ring with it, and are back on the rank
+        # that owns the shard after world_size steps.
+        dkv = [torch.zeros_like(k, dtype=torch.float32), torch.zeros_like(v, dtype=torch.float32)]
+        next_dkv = None
+        kv = [k, v]
+        for step in range(world_size):
+            if step + 1 < world_size:
+                next_kv = comm.send_recv(kv)
+            q_slice, kv_slice, block_causal = _block_schedule(
+                step, rank, world_size, ctx.causal, seqlen_local
+            )
+            block_dq, block_dk, block_dv = _attn_block_backward(
+                dout[:, q_slice],
+                q[:, q_slice],
+                kv[0][:, kv_slice],
+                kv[1][:, kv_slice],
+                out[:, q_slice],
+                lse[:, :, q_slice],
+                ctx.softmax_scale,
+                block_causal,
+            )
+            dq[:, q_slice] += block_dq
+            if next_dkv is not None:
+                dkv = RingComm.wait(*next_dkv)
+            dkv[0][:, kv_slice] += block_dk
+            dkv[1][:, kv_slice] += block_dv
+            if world_size > 1:
+                next_dkv = comm.send_recv(dkv, tag=1)
+            if step + 1 < world_size:
+                kv = RingComm.wait(*next_kv)
+        dk, dv = RingComm.wait(*next_dkv) if world_size > 1 else dkv
+        return dq.to(q.dtype), dk.to(k.dtype), dv.to(v.dtype), None, None, None
+
+
+def ring_attn_func(q, k, v, softmax_scale=None, causal=False, process_group=None):
+    """Attention over a sequence that is sharded across the ranks of process_group.
+
+    Arguments:
+        q: (batch_size, seqlen_local, nheads, headdim), the queries of the local shard.
+        k, v: (batch_size, seqlen_local, nheads_k, headdim), the keys and values of the local
+            shard. nheads must be a multiple of nheads_k (MQA / GQA).
+        causal: if True, the shards must be laid out by zigzag_shard, and seqlen_local is even.
+            Otherwise the shards can be any split of the sequence (e.g. contiguous).
+    Return:
+        out: (batch_size, seqlen_local, nheads, headdim), the output for the local queries.
+
+    Each K/V block is attended to with the flash attention kernels on GPU (and a reference
+    implementation on CPU, e.g. to test with the gloo backend). The memory for the attention is
+    that of seqlen_local tokens, plus one K/V shard in flight.
+    """
+    if softmax_scale is None:
+        softmax_scale = 1.0 / math.sqrt(q.shape[-1])
+    if process_group is None:
+        process_group = dist.group.WORLD
+    return RingAttnFunc.apply(q, k, v, softmax_scale, causal, process_group)
+
+
+class RingSelfAttention(nn.Module):
+    """Implement the scaled dot product attention with softmax, over a sequence sharded across
+    the ranks of process_group (context parallel), with ring_attn_func.
+    Arguments
+    ---------
+        softmax_scale: The temperature to use for the softmax attention.
+                      (default: 1/sqrt(d_keys) where d_keys is computed at
+                      runtime)
+    """
+
+    def __init__(self, process_group=None, causal=False, softmax_scale=None):
+        super().__init__()
+        self.process_group = process_group
+        self.causal = causal
+        self.softmax_scale = softmax_scale
+
+    def forward(self, qkv, causal=None):
+        """Implements the multihead softmax attention.
+        Arguments
+        ---------
+            qkv: The tensor containing the query, key, and value of the local shard of the
+                sequence (from zigzag_shard if causal). (B, S_local, 3, H, D)
+            causal: if passed, will override self.causal
+        """
+        causal = self.causal if causal is None else causal
+        q, k, v = qkv.unbind(dim=2)
+        return ring_attn_func(
+            q, k, v, self.softmax_scale, causal=causal, process_group=self.process_group
+        )
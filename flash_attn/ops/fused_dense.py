@@ -16,9 +16,11 @@ from torch.distributed import ProcessGroup
 from flash_attn.utils.torch import custom_fwd, custom_bwd
 from flash_attn.ops.activations import gelu_bwd, relu_bwd, sqrelu_bwd, sqrelu_fwd
 from flash_attn.utils.distributed import (
+    all_gather_linear,
     all_gather_raw,
     all_reduce,
     all_reduce_raw,
+    linear_reduce_scatter,
     reduce_scatter,
     reduce_scatter_raw,
 )
@@ -172,6 +174,7 @@ class ColumnParallelLinear(nn.Linear):
         bias: bool = True,
         sequence_parallel=True,
         multiple_of=1,
+        sequence_parallel_chunks=1,
         device=None,
         dtype=None,
     ) -> None:
@@ -189,11 +192,17 @@ class ColumnParallelLinear(nn.Linear):
         )
         self.process_group = process_group
         self.sequence_parallel = sequence_parallel
+        self.sequence_parallel_chunks = sequence_parallel_chunks
 
     def forward(self, x):
         # If self.sequence_parallel is True, we're doing Tensor Parallel with sequence parallelism:
         # we do an all_gather of x before doing the matmul.
         # If not, then the input is already gathered.
+        if self.sequence_parallel and self.sequence_parallel_chunks > 1:
+            # The all_gather is split in chunks, each overlapped with the matmul of the previous one
+            return all_gather_linear(
+                x, self.weight, self.bias, self.process_group, self.sequence_parallel_chunks
+            )
         return fused_dense_func(
             x,
             self.weight,
@@ -212,6 +221,7 @@ class RowParallelLinear(nn.Linear):
         bias: bool = True,
         sequence_parallel=True,
         multiple_of=1,
+        sequence_parallel_chunks=1,
         device=None,
         dtype=None,
     ) -> None:
@@ -235,12 +245,19 @@ class RowParallelLinear(nn.Linear):
         )
         self.process_group = process_group
         self.sequence_parallel = sequence_parallel
+        self.sequence_parallel_chunks = sequence_parallel_chunks
 
     def forward(self, x):
         """
         We're doing Tensor Parallel with sequence parallelism: we do the matmul and then
         a reduce_scatter of the result.
+        With sequence_parallel_chunks > 1, the reduce_scatter is split in chunks, each overlapped
+        with the matmul of the next one.
         """
+        if self.sequence_parallel and self.sequence_parallel_chunks > 1:
+            return linear_reduce_scatter(
+                x, self.weight, self.bias, self.process_group, self.sequence_parallel_chunks
+            )
         out = fused_dense_func(x, self.weight, self.bias)
         reduce_fn = reduce_scatter if self.sequence_parallel else all_reduce
         return reduce_fn(out, self.process_group)
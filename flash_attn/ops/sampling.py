@@ -0,0 +1,91 @@
+from typing import Optional, Union
+
+import torch
+from torch import Tensor
+
+try:
+    from flash_attn.ops.triton.sampling import sample_top_k_top_p_fwd
+except ImportError:
+    sample_top_k_top_p_fwd = None
+
+
+def _ordered_key(x):
+    """Map float32 to int64 in [0, 2^32) with the same order (and -0.0 to the same key as 0.0)."""
+    bits = x.float().view(torch.int32)
+    return torch.where(bits >= 0, bits, (bits ^ 0x7FFFFFFF) + 1).long() + 2**31
+
+
+def _radix_threshold(keys, weights, target, num_bits=32):
+    """Largest key t per row such that the total weight of the keys >= t is at least target,
+    found bit by bit with one pass over the row per bit instead of sorting it.
+    """
+    threshold = torch.zeros(keys.shape[0], dtype=torch.long, device=keys.device)
+    for bit in range(num_bits - 1, -1, -1):
+        candidate = threshold | (1 << bit)
+        mass = torch.where(keys >= candidate[:, None], weights, 0.0).sum(dim=-1)
+        threshold = torch.where(mass >= target, candidate, threshold)
+    return threshold
+
+
+def _sample_top_k_top_p_torch(logits, top_k, top_p, temperature, generator=None):
+    keys = _ordered_key(logits)
+    logits = logits.float()
+    is_sampling = (top_k != 1) & (temperature > 0.0)
+    inv_temperature = torch.where(is_sampling, 1.0 / temperature, 1.0)[:, None]
+    threshold = torch.zeros_like(keys[:, 0])
+    use_top_k = is_sampling & (top_k > 0)
+    if use_top_k.any():
+        target = top_k.clamp(max=logits.shape[-1]).float()
+        threshold_k = _radix_threshold(keys, torch.ones_like(logits), target)
+        threshold = torch.where(use_top_k, threshold_k, threshold)
+    use_top_p = is_sampling & (top_p > 0.0) & (top_p < 1.0)
+    if use_top_p.any():
+        # Top-p is applied to the probabilities renormalized over the top-k
+        max_logit = logits.amax(dim=-1, keepdim=True)
+        probs = torch.exp((logits - max_logit) * inv_temperature)
+        probs = torch.where(keys >= threshold[:, None], probs, 0.0)
+        threshold_p = _radix_threshold(keys, probs, top_p * probs.sum(dim=-1))
+        threshold = torch.where(use_top_p, threshold_p, threshold)
+    # Gumbel-max: argmax of logits / temperature + Gumbel noise over the tokens that are kept
+    scores = logits * inv_temperature
+    u = torch.rand(logits.shape, device=logits.device, generator=generator)
+    scores = torch.where(is_sampling[:, None], scores - torch.log(-torch.log(u)), scores)
+    scores.masked_fill_(keys < threshold[:, None], float("-inf"))
+    return scores.argmax(dim=-1)
+
+
+def sample_top_k_top_p(
+    logits: Tensor,
+    top_k: Union[int, Tensor] = 0,
+    top_p: Union[float, Tensor] = 0.0,
+    temperature: Union[float, Tensor] = 1.0,
+    generator: Optional[torch.Generator] = None,
+) -> Tensor:
+    """Sample one token per row from the top-k, then top-p filtered distribution, with
+    temperature, without sorting the vocabulary.
+    The top-k and top-p thresholds on the logits are searched for a few bits at a time, each step
+    being a pass over the row, and the token is then drawn in a final pass with the Gumbel-max
+    trick. On CUDA this runs as a single Triton kernel per row, otherwise in PyTorch.
+    Ties at the top-k threshold are all kept.
+
+    Arguments:
+        logits: (batch, vocab_size)
+        top_k: int or (batch,). 0 means no top-k filtering, 1 means greedy.
+        top_p: float or (batch,). 0.0 or 1.0 means no top-p filtering.
+        temperature: float or (batch,). 0.0 means greedy.
+        generator (optional): torch.Generator on the device of logits, for the noise.
+    Return:
+        tokens: (batch,), int64
+    """
+    batch = logits.shape[0]
+    device = logits.device
+    top_k = torch.as_tensor(top_k, dtype=torch.int32, device=device).expand(batch).contiguous()
+    top_p = torch.as_tensor(top_p, dtype=torch.float32, device=device).expand(batch).contiguous()
+    temperature = (
+        torch.as_tensor(temperature, dtype=torch.float32, device=device).expand(batch).contiguous()
+    )
+    if logits.is_cuda and sample_top_k_top_p_fwd is not None:
+        # Draw the seed on the device, to not synchronize with the host
+        seed = torch.randint(2**31 - 1, (1,), device=device, generator=generator)
+        return sample_top_k_top_p_fwd(logits, top_k, top_p, temperature, seed)
+    return _sample_top_k_top_p_torch(logits, top_k, top_p, temperature, generator=generator)
@@ -0,0 +1,176 @@
+import torch
+
+import triton
+import triton.language as tl
+
+
+@triton.jit
+def _ordered_key(x):
+    # Map float32 to int64 in [0, 2^32) with the same order (and -0.0 to the same key as 0.0), so
+    # that thresholds on the logits can be searched for bit by bit
+    bits = x.to(tl.int32, bitcast=True)
+    key = tl.where(bits >= 0, bits, (bits ^ 0x7FFFFFFF) + 1)
+    return key.to(tl.int64) + 2147483648
+
+
+@triton.jit
+def _radix_threshold(
+    logits_ptr,
+    n_cols,
+    target,
+    lower,
+    max_logit,
+    inv_temperature,
+    WEIGHTED: tl.constexpr,
+    BLOCK_SIZE: tl.constexpr,
+    RADIX_BITS: tl.constexpr,
+):
+    """Largest key t such that the total weight of the logits with key >= max(t, lower) is at
+    least target. The weight is 1 (for top-k) or the unnormalized probability (for top-p).
+    Each of the 32 / RADIX_BITS passes over the row picks the next RADIX_BITS bits of t.
+    """
+    digits = tl.arange(0, 1 << RADIX_BITS)
+    threshold = tl.zeros([1], dtype=tl.int64)
+    for i in tl.static_range(32 // RADIX_BITS):
+        shift = 32 - RADIX_BITS * (i + 1)
+        candidates = threshold + (digits.to(tl.int64) << shift)
+        mass = tl.zeros([1 << RADIX_BITS], dtype=tl.float32)
+        for col_offset in range(0, n_cols, BLOCK_SIZE):
+            cols = col_offset + tl.arange(0, BLOCK_SIZE)
+            logits = tl.load(logits_ptr + cols, mask=cols < n_cols, other=-float("inf")).to(
+                tl.float32
+            )
+            keys = _ordered_key(logits)
+            if WEIGHTED:
+                weights = tl.exp((logits - max_logit) * inv_temperature)
+            else:
+                weights = tl.where(cols < n_cols, 1.0, 0.0)
+            weights = tl.where(keys >= lower, weights, 0.0)
+            above = keys[:, None] >= candidates[None, :]
+            mass += tl.sum(tl.where(above, weights[:, None], 0.0), axis=0)
+        # The weight is non-increasing in the digit, and digit 0 always qualifies
+        digit = tl.max(tl.where(mass >= target, digits, 0), axis=0)
+        threshold += digit.to(tl.int64) << shift
+    return threshold
+
+
+@triton.jit
+def sample_top_k_top_p_kernel(
+    out_ptr,
+    logits_ptr,
+    top_k_ptr,
+    top_p_ptr,
+    temperature_ptr,
+    seed_ptr,
+    n_cols,
+    logits_row_stride,
+    BLOCK_SIZE: tl.constexpr,
+    RADIX_BITS: tl.constexpr,
+):
+    row_idx = tl.program_id(0)
+    logits_ptr = logits_ptr + row_idx * logits_row_stride.to(tl.int64)
+    top_k = tl.load(top_k_ptr + row_idx)
+    top_p = tl.load(top_p_ptr + row_idx)
+    temperature = tl.load(temperature_ptr + row_idx)
+    seed = tl.load(seed_ptr)
+    # Greedy if top_k == 1 or temperature == 0
+    is_sampling = (top_k != 1) & (temperature > 0.0)
+    inv_temperature = tl.where(is_sampling, 1.0 / temperature, 1.0)
+    max_logit = -float("inf")
+    for col_offset in range(0, n_cols, BLOCK_SIZE):
+        cols = col_offset + tl.arange(0, BLOCK_SIZE)
+        logits = tl.load(logits_ptr + cols, mask=cols < n_cols, other=-float("inf"))
+        max_logit = tl.maximum(max_logit, tl.max(logits.to(tl.float32)))
+    threshold = tl.zeros([1], dtype=tl.int64)
+    if is_sampling:
+        if top_k > 0:
+            threshold = _radix_threshold(
+                logits_ptr,
+                n_cols,
+                tl.minimum(top_k, n_cols).to(tl.float32),
+                0,
+                max_logit,
+                inv_temperature,
+                WEIGHTED=False,
+                BLOCK_SIZE=BLOCK_SIZE,
+                RADIX_BITS=RADIX_BITS,
+            )
+        if (top_p > 0.0) & (top_p < 1.0):
+            # Top-p is applied to the probabilities renormalized over the top-k
+            total = tl.zeros([1], dtype=tl.float32)
+            for col_offset in range(0, n_cols, BLOCK_SIZE):
+                cols = col_offset + tl.arange(0, BLOCK_SIZE)
+                logits = tl.load(logits_ptr + cols, mask=cols < n_cols, other=-float("inf")).to(
+                    tl.float32
+                )
+                probs = tl.exp((logits - max_logit) * inv_temperature)
+                total += tl.sum(tl.where(_ordered_key(logits) >= threshold, probs, 0.0))
+            threshold = _radix_threshold(
+                logits_ptr,
+                n_cols,
+                top_p * total,
+                threshold,
+                max_logit,
+                inv_temperature,
+                WEIGHTED=True,
+                BLOCK_SIZE=BLOCK_SIZE,
+                RADIX_BITS=RADIX_BITS,
+            )
+    # Gumbel-max: argmax of logits / temperature + Gumbel noise over the tokens that are kept
+    best_score = -float("inf")
+    best_idx = 0
+    for col_offset in range(0, n_cols, BLOCK_SIZE):
+        cols = col_offset + tl.arange(0, BLOCK_SIZE)
+        logits = tl.load(logits_ptr + cols, mask=cols < n_cols, other=-float("inf")).to(
+            tl.float32
+        )
+        scores = logits * inv_temperature
+        if is_sampling:
+            u = tl.rand(seed, row_idx * n_cols + cols)
+            scores += -tl.log(-tl.log(u))
+        keep = (_ordered_key(logits) >= threshold) & (cols < n_cols)
+        scores = tl.where(keep, scores, -float("inf"))
+        block_max = tl.max(scores, axis=0)
+        block_idx = col_offset + tl.argmax(scores, axis=0)
+        best_idx = tl.where(block_max > best_score, block_idx, best_idx)
+        best_score = tl.maximum(best_score, block_max)
+    tl.store(out_ptr + row_idx, best_idx.to(tl.int64))
+
+
+def sample_top_k_top_p_fwd(
+    logits: torch.Tensor,
+    top_k: torch.Tensor,
+    top_p: torch.Tensor,
+    temperature: torch.Tensor,
+    seed: torch.Tensor,
+) -> torch.Tensor:
+    """
+    Arguments:
+        logits: (batch, vocab_size)
+        top_k: (batch,), int32
+        top_p: (batch,), float32
+        temperature: (batch,), float32
+        seed: (1,), int64, seed of the Gumbel noise
+    Return:
+        tokens: (batch,), int64
+    """
+    batch, n_cols = logits.shape
+    if logits.stride(-1) != 1:
+        logits = logits.contiguous()
+    out = torch.empty(batch, dtype=torch.long, device=logits.device)
+    BLOCK_SIZE = min(triton.next_power_of_2(n_cols), 1024)
+    with torch.cuda.device(logits.device.index):
+        sample_top_k_top_p_kernel[(batch,)](
+            out,
+            logits,
+            top_k,
+            top_p,
+            temperature,
+            seed,
+            n_cols,
+            logits.stride(0),
+            BLOCK_SIZE=BLOCK_SIZE,
+            RADIX_BITS=4,
+            num_warps=4 if BLOCK_SIZE <= 512 else 8,
+        )
+    return out
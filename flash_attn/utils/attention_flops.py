@@ -0,0 +1,90 @@
+import torch
+
+# The backward does 2.5x the matmul FLOPs of the forward (it recomputes QK^T, then dV, dP, dQ, dK)
+MODE_MULTIPLIERS = {"fwd": 1.0, "bwd": 2.5, "fwd_bwd": 3.5}
+
+
+def seqlens_from_cu_seqlens(cu_seqlens):
+    cu_seqlens = torch.as_tensor(cu_seqlens, device="cpu", dtype=torch.long)
+    return cu_seqlens[1:] - cu_seqlens[:-1]
+
+
+def attended_pairs(seqlen_q, seqlen_k, causal=False, window_size=(-1, -1), attention_chunk=0):
+    """Number of (query, key) pairs that attention computes for one sequence, with the masks
+    of flash_attn_func (aligned to the bottom right when seqlen_q != seqlen_k): query i sees the
+    keys j with i + seqlen_k - seqlen_q - window_size[0] <= j <= i + seqlen_k - seqlen_q +
+    window_size[1] (causal is window_size[1] = 0, a negative or None bound is no bound), and with
+    attention_chunk > 0, only the keys in the same chunk of attention_chunk keys.
+    """
+    left, right = [w if w is not None and w >= 0 else None for w in window_size]
+    if causal:
+        right = 0
+    diag = torch.arange(seqlen_q, dtype=torch.long) + seqlen_k - seqlen_q
+    lo = torch.zeros_like(diag) if left is None else (diag - left).clamp(min=0)
+    hi = diag + right if right is not None else torch.full_like(diag, seqlen_k - 1)
+    hi = hi.clamp(max=seqlen_k - 1)
+    if attention_chunk > 0:
+        chunk_start = diag - diag % attention_chunk
+        lo = torch.maximum(lo, chunk_start)
+        hi = torch.minimum(hi, chunk_start + attention_chunk - 1)
+    return int((hi - lo + 1).clamp(min=0).sum())
+
+
+def attention_flops(
+    cu_seqlens_q,
+    cu_seqlens_k,
+    nheads,
+    headdim,
+    headdim_v=None,
+    causal=False,
+    window_size=(-1, -1),
+    attention_chunk=0,
+    mode="fwd",
+):
+    """Matmul FLOPs (QK^T and PV) of the attention of a batch of sequences with the given
+    cu_seqlens_q / cu_seqlens_k (as in flash_attn_varlen_func; a batch of b sequences of the
+    same lengths is cu_seqlens = [0, s, 2s, ..., b * s]), counting only the (query, key) pairs
+    that aren't masked, see attended_pairs. The number of KV heads (GQA) doesn't change the
+    FLOPs, only the bytes (attention_bytes).
+    mode: "fwd", "bwd" or "fwd_bwd".
+    """
+    headdim_v = headdim if headdim_v is None else headdim_v
+    seqlens_q = seqlens_from_cu_seqlens(cu_seqlens_q)
+    seqlens_k = seqlens_from_cu_seqlens(cu_seqlens_k)
+    # Packed batches have many sequences of the same lengths
+    lengths, counts = torch.unique(
+        torch.stack([seqlens_q, seqlens_k], dim=1), dim=0, return_counts=True
+    )
+    pairs = sum(
+        count * attended_pairs(seqlen_q, seqlen_k, causal, window_size, attention_chunk)
+        for (seqlen_q, seqlen_k), count in zip(lengths.tolist(), counts.tolist())
+    )
+    return MODE_MULTIPLIERS[mode] * 2 * nheads * pairs * (headdim + headdim_v)
+
+
+def attention_bytes(
+    cu_seqlens_q,
+    cu_seqlens_k,
+    nheads,
+    nheads_kv,
+    headdim,
+    headdim_v=None,
+    dtype_bytes=2,
+    mode="fwd",
+):
+    """Minimum global memory traffic of the attention of a batch: the forward reads Q, K, V and
+    writes O, the backward reads Q, K, V, dO and writes dQ, dK, dV (K and V have nheads_kv
+    heads). Same accounting as bandwidth_fwd_bytes / bandwidth_bwd_bytes of
+    flash_attn/cute/bench_utils.py, so the bandwidths of the benchmarks stay comparable: the
+    read of O (and LSE) by the preprocessing of the backward isn't counted.
+    """
+    headdim_v = headdim if headdim_v is None else headdim_v
+    total_q = int(seqlens_from_cu_seqlens(cu_seqlens_q).sum())
+    total_k = int(seqlens_from_cu_seqlens(cu_seqlens_k).sum())
+    q = total_q * nheads * headdim
+    kv = total_k * nheads_kv * (headdim + headdim_v)
+    o = total_q * nheads * headdim_v
+    fwd = q + kv + o
+    bwd = 2 * q + 2 * kv + o  # Q, K, V, dO in, dQ, dK, dV out
+    nbytes = {"fwd": fwd, "bwd": bwd, "fwd_bwd": fwd + bwd}[mode]
+    return nbytes * dtype_bytes
@@ -1,9 +1,13 @@
-from typing import Optional
+from typing import List, Optional
 
 import torch
+import torch.nn.functional as F
+from einops import rearrange
 from torch import Tensor
 from torch.distributed import ProcessGroup
 
+from flash_attn.utils.torch import custom_bwd, custom_fwd
+
 # `all_gather_into_tensor` and `reduce_scatter_tensor` are new placeholders for
 # `_all_gather_base` and `_reduce_scatter_base`. They require the most recent
 # version of PyTorch. The following 4 lines are for backward compatibility with
@@ -48,6 +52,18 @@ def all_reduce_raw(input_: Tensor, process_group: ProcessGroup, async_op: bool =
     return input_, handle
 
 
+# Raw operation, does not support autograd, but does support async
+def all_to_all_raw(input_: Tensor, process_group: ProcessGroup, async_op: bool = False):
+    """Chunk r of input_ (along dim 0) is sent to rank r, chunk r of the output is received from
+    rank r."""
+    input_ = input_.contiguous()
+    output = torch.empty_like(input_)
+    handle = torch.distributed.all_to_all_single(
+        output, input_, group=process_group, async_op=async_op
+    )
+    return output, handle
+
+
 class AllGatherFunc(torch.autograd.Function):
     """Gather the input from sequence parallel region and concatenate."""
 
@@ -104,6 +120,322 @@ class AllReduceFunc(torch.autograd.Function):
 all_reduce = AllReduceFunc.apply
 
 
+def _wgrad(grad_output: Tensor, x: Tensor) -> Tensor:
+    return grad_output.reshape(-1, grad_output.shape[-1]).t() @ x.reshape(-1, x.shape[-1])
+
+
+class AllGatherLinearFunc(torch.autograd.Function):
+    """Tensor parallel with sequence parallelism: all-gather x along dim 0 and multiply it by
+    weight (as ColumnParallelLinear does), pipelined over num_chunks chunks of x.
+
+    All the chunks of x are all-gathered asynchronously, and the GEMM of a chunk runs while the
+    next ones are in flight. In the backward, the reduce-scatter of the gradient of a chunk of x
+    overlaps the GEMMs of the next chunk.
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, process_group, num_chunks):
+        if torch.is_autocast_enabled():
+            x = x.to(dtype=torch.get_autocast_gpu_dtype())
+        world_size = torch.distributed.get_world_size(process_group)
+        ctx.process_group, ctx.num_chunks = process_group, num_chunks
+        ctx.has_bias = bias is not None
+        x = x.contiguous()
+        gathered = [
+            all_gather_raw(x_chunk, process_group, async_op=True)
+            for x_chunk in x.chunk(num_chunks)
+        ]
+        outputs = []
+        for total_chunk, handle in gathered:
+            handle.wait()
+            out = F.linear(total_chunk, weight, bias)
+            outputs.append(out.reshape(world_size, -1, *out.shape[1:]))
+        ctx.save_for_backward(x, weight)
+        # Chunk c of the output has rows c of every rank, put them back in the order of total_x
+        output = torch.cat(outputs, dim=1)
+        return output.reshape(-1, *output.shape[2:])
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        x, weight = ctx.saved_tensors
+        world_size = torch.distributed.get_world_size(ctx.process_group)
+        x_chunks = x.chunk(ctx.num_chunks)
+        if ctx.needs_input_grad[1]:
+            # We need total_x again for the weight gradient
+            gathered = [all_gather_raw(c, ctx.process_group, async_op=True) for c in x_chunks]
+        grad_output = grad_output.reshape(world_size, -1, *grad_output.shape[1:])
+        grad_inputs, grad_weight, start = [], None, 0
+        for c, x_chunk in enumerate(x_chunks):
+            grad_chunk = grad_output[:, start : start + x_chunk.shape[0]]
+            grad_chunk = grad_chunk.reshape(-1, *grad_chunk.shape[2:])
+            start += x_chunk.shape[0]
+            if ctx.needs_input_grad[0]:
+                grad_inputs.append(
+                    reduce_scatter_raw(
+                        F.linear(grad_chunk, weight.t()), ctx.process_group, async_op=True
+                    )
+                )
+            if ctx.needs_input_grad[1]:
+                total_chunk, handle = gathered[c]
+                handle.wait()
+                grad = _wgrad(grad_chunk, total_chunk)
+                grad_weight = grad if grad_weight is None else grad_weight + grad
+        grad_bias = None
+        if ctx.has_bias and ctx.needs_input_grad[2]:
+            grad_bias = grad_output.reshape(-1, grad_output.shape[-1]).sum(dim=0)
+        grad_input = None
+        if grad_inputs:
+            for _, handle in grad_inputs:
+                handle.wait()
+            grad_input = torch.cat([grad for grad, _ in grad_inputs])
+        return grad_input, grad_weight, grad_bias, None, None
+
+
+def all_gather_linear(
+    x: Tensor,
+    weight: Tensor,
+    bias: Optional[Tensor],
+    process_group: ProcessGroup,
+    num_chunks: int = 1,
+):
+    return AllGatherLinearFunc.apply(x, weight, bias, process_group, num_chunks)
+
+
+class LinearReduceScatterFunc(torch.autograd.Function):
+    """Tensor parallel with sequence parallelism: multiply x by weight, then reduce-scatter the
+    output along dim 0 (as RowParallelLinear does), pipelined over num_chunks chunks of the
+    local part of the output.
+
+    The reduce-scatter of a chunk overlaps the GEMM of the next one. In the backward, all the
+    chunks of the gradient are all-gathered asynchronously, and the GEMMs of a chunk run while
+    the next ones are in flight.
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, process_group, num_chunks):
+        if torch.is_autocast_enabled():
+            x = x.to(dtype=torch.get_autocast_gpu_dtype())
+        world_size = torch.distributed.get_world_size(process_group)
+        ctx.process_group, ctx.num_chunks = process_group, num_chunks
+        ctx.has_bias = bias is not None
+        assert x.shape[0] % world_size == 0
+        x = x.contiguous()
+        ctx.save_for_backward(x, weight)
+        # Chunk c of x has the rows that end up in chunk c of the output of every rank
+        x = x.reshape(world_size, -1, *x.shape[1:])
+        outputs = []
+        for x_chunk in x.chunk(num_chunks, dim=1):
+            out = F.linear(x_chunk.reshape(-1, *x_chunk.shape[2:]), weight, bias)
+            outputs.append(reduce_scatter_raw(out, process_group, async_op=True))
+        for _, handle in outputs:
+            handle.wait()
+        return torch.cat([out for out, _ in outputs])
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        x, weight = ctx.saved_tensors
+        world_size = torch.distributed.get_world_size(ctx.process_group)
+        gathered = [
+            all_gather_raw(grad_chunk, ctx.process_group, async_op=True)
+            for grad_chunk in grad_output.chunk(ctx.num_chunks)
+        ]
+        x_chunks = x.reshape(world_size, -1, *x.shape[1:]).chunk(ctx.num_chunks, dim=1)
+        grad_inputs, grad_weight, grad_bias = [], None, None
+        for (grad_chunk, handle), x_chunk in zip(gathered, x_chunks):
+            handle.wait()
+            if ctx.needs_input_grad[0]:
+                grad = F.linear(grad_chunk, weight.t())
+                grad_inputs.append(grad.reshape(world_size, -1, *grad.shape[1:]))
+            if ctx.needs_input_grad[1]:
+                grad = _wgrad(grad_chunk, x_chunk)
+                grad_weight = grad if grad_weight is None else grad_weight + grad
+            if ctx.has_bias and ctx.needs_input_grad[2]:
+                grad = grad_chunk.reshape(-1, grad_chunk.shape[-1]).sum(dim=0)
+                grad_bias = grad if grad_bias is None else grad_bias + grad
+        grad_input = None
+        if grad_inputs:
+            grad_input = torch.cat(grad_inputs, dim=1)
+            grad_input = grad_input.reshape(-1, *grad_input.shape[2:])
+        return grad_input, grad_weight, grad_bias, None, None
+
+
+def linear_reduce_scatter(
+    x: Tensor,
+    weight: Tensor,
+    bias: Optional[Tensor],
+    process_group: ProcessGroup,
+    num_chunks: int = 1,
+):
+    return LinearReduceScatterFunc.apply(x, weight, bias, process_group, num_chunks)
+
+
+class LinearSeqToHeadFunc(torch.autograd.Function):
+    """Ulysses sequence parallel: project x, sharded along the sequence, then all-to-all the
+    output so that it's sharded along the heads.
+
+    x is (batch, seqlen_local, in_features), rank r holding the r-th chunk of the sequence. The
+    weight is split in the projections of size splits (e.g. Q, K, V), each of them with nheads
+    heads of size head_dim, and the output is (batch, seqlen, sum(nheads) / world_size,
+    head_dim): rank r gets the r-th chunk of the heads of every projection. The all-to-all of a
+    projection overlaps the GEMM of the next one, and in the backward, the GEMMs of a projection
+    overlap the all-to-all of the next one.
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, splits, head_dim, process_group):
+        world_size = torch.distributed.get_world_size(process_group)
+        ctx.splits, ctx.head_dim, ctx.process_group = splits, head_dim, process_group
+        ctx.has_bias = bias is not None
+        ctx.save_for_backward(x, weight)
+        biases = bias.split(splits) if bias is not None else [None] * len(splits)
+        outs, handles = [], []
+        for w, b in zip(weight.split(splits), biases):
+            out = rearrange(
+                F.linear(x, w, b), "b s (r h d) -> r b s h d", r=world_size, d=head_dim
+            )
+            out, handle = all_to_all_raw(out, process_group, async_op=True)
+            outs.append(out)
+            handles.append(handle)
+        for handle in handles:
+            handle.wait()
+        return torch.cat([rearrange(out, "r b s h d -> b (r s) h d") for out in outs], dim=2)
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        x, weight = ctx.saved_tensors
+        world_size = torch.distributed.get_world_size(ctx.process_group)
+        nheads_local = [split // (world_size * ctx.head_dim) for split in ctx.splits]
+        # Kick off all the all-to-alls, then do the GEMMs of each projection as it arrives
+        grads, handles = [], []
+        for grad in grad_output.split(nheads_local, dim=2):
+            grad = rearrange(grad, "b (r s) h d -> r b s h d", r=world_size)
+            grad, handle = all_to_all_raw(grad, ctx.process_group, async_op=True)
+            grads.append(grad)
+            handles.append(handle)
+        grad_input, grad_weights, grad_biases = None, [], []
+        for grad, handle, w in zip(grads, handles, weight.split(ctx.splits)):
+            handle.wait()
+            grad = rearrange(grad, "r b s h d -> (b s) (r h d)")
+            if ctx.needs_input_grad[0]:
+                gx = F.linear(grad, w.t())
+                grad_input = gx if grad_input is None else grad_input + gx
+            if ctx.needs_input_grad[1]:
+                grad_weights.append(grad.t() @ x.reshape(-1, x.shape[-1]).to(grad.dtype))
+            if ctx.has_bias and ctx.needs_input_grad[2]:
+                grad_biases.append(grad.sum(dim=0))
+        if grad_input is not None:
+            grad_input = grad_input.reshape(*x.shape[:-1], grad_input.shape[-1])
+        grad_weight = torch.cat(grad_weights) if grad_weights else None
+        grad_bias = torch.cat(grad_biases) if grad_biases else None
+        return grad_input, grad_weight, grad_bias, None, None, None
+
+
+def linear_seq_to_head(
+    x: Tensor,
+    weight: Tensor,
+    bias: Optional[Tensor],
+    splits: List[int],
+    head_dim: int,
+    process_group: ProcessGroup,
+):
+    return LinearSeqToHeadFunc.apply(x, weight, bias, splits, head_dim, process_group)
+
+
+class LinearHeadToSeqFunc(torch.autograd.Function):
+    """Ulysses sequence parallel: all-to-all x, sharded along the heads, so that it's sharded
+    along the sequence, then project it. The inverse of LinearSeqToHeadFunc.
+
+    x is (batch, seqlen, nheads / world_size, head_dim), rank r holding the r-th chunk of the
+    heads, and the output is (batch, seqlen_local, out_features) for the r-th chunk of the
+    sequence. The heads are all-to-all'ed in num_chunks chunks, and the GEMM of a chunk overlaps
+    the all-to-all of the next one (in the backward, the all-to-all of the previous one).
+    """
+
+    @staticmethod
+    @custom_fwd
+    def forward(ctx, x, weight, bias, process_group, num_chunks):
+        world_size = torch.distributed.get_world_size(process_group)
+        head_dim = x.shape[-1]
+        ctx.process_group, ctx.num_chunks, ctx.head_dim = process_group, num_chunks, head_dim
+        ctx.has_bias = bias is not None
+        xs, handles = [], []
+        for x_chunk in x.chunk(num_chunks, dim=2):
+            x_chunk = rearrange(x_chunk, "b (r s) h d -> r b s h d", r=world_size)
+            x_chunk, handle = all_to_all_raw(x_chunk, process_group, async_op=True)
+            xs.append(x_chunk)
+            handles.append(handle)
+        # The columns of weight that multiply the heads of chunk c of all the ranks
+        weights = rearrange(
+            weight, "o (r c h d) -> c o (r h d)", r=world_size, c=num_chunks, d=head_dim
+        )
+        output = None
+        for c, (x_chunk, handle) in enumerate(zip(xs, handles)):
+            handle.wait()
+            xs[c] = rearrange(x_chunk, "r b s h d -> b s (r h d)")
+            out = F.linear(xs[c], weights[c], bias if c == 0 else None)
+            output = out if output is None else output + out
+        ctx.save_for_backward(*xs, weight)
+        return output
+
+    @staticmethod
+    @custom_bwd
+    def backward(ctx, grad_output):
+        *xs, weight = ctx.saved_tensors
+        world_size = torch.distributed.get_world_size(ctx.process_group)
+        weights = rearrange(
+            weight, "o (r c h d) -> c o (r h d)", r=world_size, c=ctx.num_chunks, d=ctx.head_dim
+        )
+        grad_output = grad_output.reshape(-1, grad_output.shape[-1])
+        grads, handles, grad_weights = [], [], []
+        for x_chunk, w in zip(xs, weights):
+            if ctx.needs_input_grad[0]:
+                grad = rearrange(
+                    F.linear(grad_output, w.t()).reshape(*x_chunk.shape),
+                    "b s (r h d) -> r b s h d",
+                    r=world_size,
+                    d=ctx.head_dim,
+                )
+                grad, handle = all_to_all_raw(grad, ctx.process_group, async_op=True)
+                grads.append(grad)
+                handles.append(handle)
+            if ctx.needs_input_grad[1]:
+                x_chunk = x_chunk.reshape(-1, x_chunk.shape[-1])
+                grad_weights.append(grad_output.t() @ x_chunk.to(grad_output.dtype))
+        grad_weight = None
+        if grad_weights:
+            grad_weight = rearrange(
+                torch.stack(grad_weights),
+                "c o (r h d) -> o (r c h d)",
+                r=world_size,
+                d=ctx.head_dim,
+            )
+        grad_bias = grad_output.sum(dim=0) if ctx.has_bias and ctx.needs_input_grad[2] else None
+        grad_input = None
+        if grads:
+            for handle in handles:
+                handle.wait()
+            grad_input = torch.cat(
+                [rearrange(grad, "r b s h d -> b (r s) h d") for grad in grads], dim=2
+            )
+        return grad_input, grad_weight, grad_bias, None, None
+
+
+def linear_head_to_seq(
+    x: Tensor,
+    weight: Tensor,
+    bias: Optional[Tensor],
+    process_group: ProcessGroup,
+    num_chunks: int = 1,
+):
+    return LinearHeadToSeqFunc.apply(x, weight, bias, process_group, num_chunks)
+
+
 def sync_shared_params(model: torch.nn.Module, process_group: ProcessGroup):
     # We want to iterate over parameters with _shared_params=True in the same order,
     # as different ranks might have different number of parameters (e.g., only rank 0 has bias).
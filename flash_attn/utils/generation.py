@@ -1,6 +1,7 @@
 # Copyright (c) 2023, Tri Dao.
 # Adapted from https://github.com/NVIDIA/Megatron-LM/blob/0bb597b42c53355a567aba2a1357cc34b9d99ddd/megatron/text_generation/forward_step.py#L31
 import gc
+import math
 import time
 from collections import namedtuple
 from dataclasses import dataclass, field
@@ -13,6 +14,8 @@ from einops import rearrange, repeat
 from torch import Tensor
 from torch.profiler import ProfilerActivity, profile, record_function
 
+from flash_attn.ops.sampling import sample_top_k_top_p
+
 try:
     from transformers.generation import GreedySearchDecoderOnlyOutput, SampleDecoderOnlyOutput
 except ImportError:
@@ -31,6 +34,26 @@ class InferenceParams:
     batch_size_offset: int = 0
     key_value_memory_dict: dict = field(default_factory=dict)
     lengths_per_sample: Optional[Tensor] = None
+    # If not None, key_value_memory_dict holds paged caches of shape
+    # (num_pages, page_size, 2, nheads, headdim) and page_table is the (batch_size,
+    # max_num_pages_per_seq) int32 block table of each sequence. See kv_cache.PagedKVCache.
+    page_table: Optional[Tensor] = None
+    # If the paged cache is quantized (int8 / fp8), dict of layer_idx -> (num_pages, 2, nheads)
+    # fp32 scales. See kv_cache.PagedKVCache.
+    kv_scales: Optional[dict] = None
+    # If not None, sequence b of the batch lives in row cache_batch_idx[b] of the (dense) cache,
+    # instead of row batch_size_offset + b.
+    cache_batch_idx: Optional[Tensor] = None
+    # If not None, the input is a packed batch of shape (1, total): sequence b has the new tokens
+    # cu_seqlens_q[b]:cu_seqlens_q[b + 1], which start at position lengths_per_sample[b].
+    # This lets chunks of prompts be processed in the same forward as tokens being decoded.
+    cu_seqlens_q: Optional[Tensor] = None
+    max_seqlen_q: Optional[int] = None
+    # If not None, the last tree_size tokens of the cache (the new tokens being the last seqlen
+    # of them) form a tree instead of a sequence. This is a (seqlen, tree_size) bool tensor, True
+    # where new token i may attend to tree token j, i.e. j is i or one of its ancestors. The
+    # tokens before the tree are visible to all. See decode_speculative with speculative_tree.
+    tree_attn_mask: Optional[Tensor] = None
 
     def reset(self, max_seqlen, max_batch_size):
         self.max_seqlen = max_seqlen
@@ -70,29 +93,16 @@ def sample(logits, top_k=1, top_p=0.0, temperature=1.0):
     """Sample from top-k logits.
     Arguments:
         logits: Tensor of shape (batch_size, vocab_size)
+        top_k, top_p, temperature: scalars, or tensors of shape (batch_size,) to use different
+            values for each sequence. A row with top_k == 1 or temperature == 0 is greedy.
     """
-    if top_k == 1:  # Short-circuit for greedy decoding
+    if not torch.is_tensor(top_k) and top_k == 1:  # Short-circuit for greedy decoding
         return logits.argmax(dim=-1)
     else:
-        if top_p > 0.0:
+        if not torch.is_tensor(top_p) and top_p > 0.0:
             assert top_p <= 1.0, "top-p should be in (0, 1]."
-        if top_k > 0:
-            top_k = min(top_k, logits.size(-1))  # Safety check
-            logits_top, indices = torch.topk(logits, top_k, dim=-1)
-            if temperature != 1.0:
-                logits_top /= temperature
-            modify_logits_for_top_p_filtering(logits_top, top_p)
-            return indices[
-                torch.arange(indices.shape[0], device=indices.device),
-                torch.multinomial(torch.softmax(logits_top, dim=-1), num_samples=1).squeeze(dim=-1),
-            ]
-        else:
-            # Clone so that when we modify for top_p we don't change the original logits
-            logits_top = logits / temperature if temperature != 1.0 else logits.clone()
-            modify_logits_for_top_p_filtering(logits_top, top_p)
-            return torch.multinomial(torch.softmax(logits_top, dim=-1), num_samples=1).squeeze(
-                dim=-1
-            )
+        # Fused top-k / top-p / temperature sampling, without sorting the vocabulary
+        return sample_top_k_top_p(logits, top_k=top_k, top_p=top_p, temperature=temperature)
 
 
 @torch.inference_mode()
@@ -109,24 +119,61 @@ def decode(
     tensor_parallel=1,
     cg=False,
     enable_timing=False,
+    paged_kv_cache=None,
+    prefix_cache=None,
+    stop_token_ids=None,
+    pad_token_id=None,
+    streamer=None,
 ):
     """Decoding, either greedy or with top-k or top-p sampling.
     If top-k = 0, don't limit the number of candidates (pure sampling).
     Top-k and top-p can be used together. If top_k > 0 and top_p > 0, then top-k is applied first,
     then top-p.
     We assume that all sequences in the same batch have the same length.
+    A sequence stops once it samples eos_token_id or one of its stop_token_ids, or reaches its
+    max_length. The tokens after that are set to pad_token_id, and decoding ends once every
+    sequence has stopped.
 
     Arguments:
         input_ids: (batch, seq_len)
-        max_length: int
+        max_length: int, or (batch,) to give each sequence its own maximum length.
+        top_k, top_p, temperature: scalars, or (batch,) tensors for per-sequence sampling.
+        eos_token_id (optional): int, stop token shared by all the sequences.
+        stop_token_ids (optional): for each sequence, a collection of stop tokens. Either a list
+            of lists, or a (batch, num_stop_tokens) tensor padded with -1.
+        pad_token_id (optional): int, defaults to eos_token_id, or 0 if there is none.
         teacher_outputs (optional): (batch, seq_len). If provided, instead of sampling from the
             logits, the next token is taken from the teacher_outputs. Useful for testing.
+        paged_kv_cache (optional): PagedKVCache. If provided, the KV cache is stored in its pages,
+            which are allocated as the sequences grow and given back once decoding finishes.
+        prefix_cache (optional): PrefixCache over paged_kv_cache. If provided, the longest prompt
+            prefix (in whole pages) that all sequences have in the cache is reused instead of
+            being recomputed, and the prompts are added to the cache once decoding finishes.
+        streamer (optional): TokenStreamer (see flash_attn.utils.streaming), or any object with
+            put(tokens, active) and end() methods. put is called with the (batch, 1) tokens of
+            each step and a (batch,) mask of the sequences that hadn't stopped before that step.
     Returns: GreedySearchDecoderOnlyOutput or SampleDecoderOnlyOutput, with the following fields:
         sequences: (batch, max_length)
         scores: tuples of (batch, vocab_size)
     """
     batch_size, seqlen_og = input_ids.shape
+    max_lengths = torch.as_tensor(max_length, device=input_ids.device).expand(batch_size)
+    max_length = int(max_lengths.max())
+    stop_tokens = _get_stop_tokens(eos_token_id, stop_token_ids, batch_size, input_ids.device)
+    if pad_token_id is None:
+        pad_token_id = eos_token_id if eos_token_id is not None else 0
+    finished = torch.zeros(batch_size, dtype=torch.bool, device=input_ids.device)
+    # Otherwise every sequence stops at max_length, and we don't need to sync to check
+    stop_per_sequence = stop_tokens is not None or int(max_lengths.min()) < max_length
     teacher_output_len = teacher_outputs.shape[1] if teacher_outputs is not None else 0
+    if prefix_cache is not None:
+        if paged_kv_cache is None:
+            paged_kv_cache = prefix_cache.paged_kv_cache
+        assert prefix_cache.paged_kv_cache is paged_kv_cache
+    if paged_kv_cache is not None:
+        assert not cg, "CUDA graph decoding does not support paged KV cache yet"
+        assert batch_size <= paged_kv_cache.max_batch_size
+        assert max_length <= paged_kv_cache.max_seqlen
     if cg:
         if not hasattr(model, "_decoding_cache"):
             model._decoding_cache = None
@@ -142,16 +189,39 @@ def decode(
         inference_params.reset(max_length, batch_size)
     else:
         inference_params = InferenceParams(max_seqlen=max_length, max_batch_size=batch_size)
+        if paged_kv_cache is not None:
+            inference_params.key_value_memory_dict = paged_kv_cache.kv_cache
+            inference_params.page_table = paged_kv_cache.page_table[:batch_size]
+            inference_params.kv_scales = paged_kv_cache.kv_scales
+
+    num_cached_tokens = 0
+    if prefix_cache is not None:
+        # Only reuse the prefix that every sequence in the batch has in the cache, so that the
+        # rest of the prompts have the same length. At least one prompt token is left to process
+        # since we need its logits.
+        cached_pages = [
+            prefix_cache.match(input_ids[i].tolist(), max_num_tokens=seqlen_og - 1)
+            for i in range(batch_size)
+        ]
+        num_cached_pages = min(len(pages) for pages in cached_pages)
+        for i, pages in enumerate(cached_pages):
+            paged_kv_cache.share(i, pages[:num_cached_pages])
+        num_cached_tokens = num_cached_pages * paged_kv_cache.page_size
+        inference_params.seqlen_offset = num_cached_tokens
 
     def get_logits(input_ids, inference_params):
         decoding = inference_params.seqlen_offset > 0
+        if paged_kv_cache is not None:
+            seqlen_end = inference_params.seqlen_offset + input_ids.shape[1]
+            for i in range(batch_size):
+                paged_kv_cache.reserve(i, seqlen_end)
         if decoding:
-            position_ids = torch.full(
-                (batch_size, 1),
+            position_ids = torch.arange(
                 inference_params.seqlen_offset,
+                inference_params.seqlen_offset + input_ids.shape[1],
                 dtype=torch.long,
                 device=input_ids.device,
-            )
+            ).expand(batch_size, -1)
         else:
             position_ids = None
         if not cg or not decoding:
@@ -172,40 +242,78 @@ def decode(
             token = sample(logits, top_k=top_k, top_p=top_p, temperature=temperature)
         else:
             token = teacher_outputs[:, inference_params.seqlen_offset]
+        # Sequences that have already stopped are padded
+        token = token.masked_fill(finished, pad_token_id)
+        finished.logical_or_(inference_params.seqlen_offset + 1 >= max_lengths)
+        if stop_tokens is not None:
+            finished.logical_or_((token[:, None] == stop_tokens).any(dim=-1))
         # return rearrange(token, "b -> b 1")
         return token.unsqueeze(1)
 
     def should_stop(current_token, inference_params):
-        if inference_params.seqlen_offset == 0:
+        if inference_params.seqlen_offset < seqlen_og:  # The prompt hasn't been processed yet
             return False
-        if eos_token_id is not None and (current_token == eos_token_id).all():
-            return True
         if inference_params.seqlen_offset >= max_length - 1:
             return True
-        return False
-
-    start = torch.cuda.Event(enable_timing=enable_timing)
-    end = torch.cuda.Event(enable_timing=enable_timing)
+        return stop_per_sequence and bool(finished.all())
 
     if enable_timing:
+        start = torch.cuda.Event(enable_timing=enable_timing)
+        end = torch.cuda.Event(enable_timing=enable_timing)
         if tensor_parallel > 1:
             torch.distributed.barrier()
         start.record()
     scores, sequences = [], [input_ids]
+    # Tokens that are not in the KV cache yet
+    input_ids_new = input_ids[:, num_cached_tokens:]
     while not should_stop(sequences[-1], inference_params):
-        scores.append(get_logits(sequences[-1], inference_params))
-        inference_params.seqlen_offset += sequences[-1].shape[1]
+        scores.append(get_logits(input_ids_new, inference_params))
+        inference_params.seqlen_offset += input_ids_new.shape[1]
+        active = ~finished if streamer is not None else None
         sequences.append(sample_tokens(scores[-1], inference_params))
+        if streamer is not None:
+            streamer.put(sequences[-1], active)
+        input_ids_new = sequences[-1]
+    if streamer is not None:
+        streamer.end()
     if enable_timing:
         end.record()
         if tensor_parallel > 1:
             torch.distributed.barrier()
         torch.cuda.synchronize()
         print(f"Prompt processing + decoding time: {(start.elapsed_time(end)):.0f}ms")
-    output_cls = GreedySearchDecoderOnlyOutput if top_k == 1 else SampleDecoderOnlyOutput
+    if paged_kv_cache is not None:
+        for i in range(batch_size):
+            if prefix_cache is not None:
+                prefix_cache.insert(input_ids[i].tolist(), paged_kv_cache.pages(i))
+            paged_kv_cache.free(i)
+    greedy = not torch.is_tensor(top_k) and top_k == 1
+    output_cls = GreedySearchDecoderOnlyOutput if greedy else SampleDecoderOnlyOutput
     return output_cls(sequences=torch.cat(sequences, dim=1), scores=tuple(scores))
 
 
+def _get_stop_tokens(eos_token_id, stop_token_ids, batch_size, device):
+    """Return a (batch, num_stop_tokens) tensor of the stop tokens of each sequence, padded with
+    -1, or None if there are none.
+    """
+    if stop_token_ids is None:
+        stop_tokens = torch.empty(batch_size, 0, dtype=torch.long, device=device)
+    elif torch.is_tensor(stop_token_ids):
+        stop_tokens = stop_token_ids.to(device=device, dtype=torch.long)
+    else:
+        assert len(stop_token_ids) == batch_size
+        num_stop_tokens = max(len(tokens) for tokens in stop_token_ids)
+        stop_tokens = torch.tensor(
+            [list(tokens) + [-1] * (num_stop_tokens - len(tokens)) for tokens in stop_token_ids],
+            dtype=torch.long,
+            device=device,
+        ).reshape(batch_size, num_stop_tokens)
+    if eos_token_id is not None:
+        eos = torch.full((batch_size, 1), eos_token_id, dtype=torch.long, device=device)
+        stop_tokens = torch.cat([stop_tokens, eos], dim=1)
+    return stop_tokens if stop_tokens.shape[1] > 0 else None
+
+
 def sample_speculative(logits, logits_draft, tokens_draft, top_k=1, top_p=0.0, temperature=1.0):
     """Algorithm 1 from [1]
     [1] Fast Inference from Transformers via Speculative Decoding
@@ -281,6 +389,7 @@ def decode_speculative(
     cg=False,
     enable_timing=False,
     debug=False,
+    speculative_tree=None,
 ):
     """
     TD: WIP, for my own understanding, lightly tested. Only support batch_size == 1 for now.
@@ -294,10 +403,29 @@ def decode_speculative(
     Arguments:
         input_ids: (batch, seq_len)
         max_length: int
+        speculative_tree (optional): tuple of ints, the number of branches per level of the draft
+            tree, e.g. (4, 2, 2, 1). If provided, the draft model proposes a tree of candidates
+            instead of a single sequence of speculative_lookahead tokens, see
+            decode_speculative_tree.
     Returns: GreedySearchDecoderOnlyOutput or SampleDecoderOnlyOutput, with the following fields:
         sequences: (batch, max_length)
         scores: tuples of (batch, vocab_size)
     """
+    if speculative_tree is not None:
+        assert not cg, "Tree speculative decoding does not support CUDA graph yet"
+        return decode_speculative_tree(
+            input_ids,
+            model,
+            model_draft,
+            max_length,
+            speculative_tree,
+            top_k=top_k,
+            top_p=top_p,
+            temperature=temperature,
+            eos_token_id=eos_token_id,
+            vocab_size=vocab_size,
+            enable_timing=enable_timing,
+        )
     batch_size, seqlen_og = input_ids.shape
     assert batch_size == 1, "Speculative decoding implementation only supports batch_size=1"
     assert eos_token_id is None, "Speculative decoding implementation doesn't support eos_token_id"
@@ -563,6 +691,196 @@ def decode_speculative(
     return output_cls(sequences=sequences, scores=scores)
 
 
+def build_speculative_tree(parents):
+    """Return the attention mask of a tree given the parent of each node (-1 for the children of
+    the root), where parents come before their children.
+    Return:
+        tree_attn_mask: (num_nodes, num_nodes) bool, True where j is i or an ancestor of i.
+    """
+    num_nodes = len(parents)
+    tree_attn_mask = torch.eye(num_nodes, dtype=torch.bool)
+    for i, parent in enumerate(parents):
+        if parent >= 0:
+            assert parent < i, "Parents must come before their children"
+            tree_attn_mask[i] |= tree_attn_mask[parent]
+    return tree_attn_mask
+
+
+def _move_kv_cache(inference_params, src, dst):
+    """Move the keys and values at positions src to positions dst in the cache of every layer.
+    src and dst are lists of ints, with dst[i] <= src[i].
+    """
+    if src == dst:
+        return
+    for kv_cache in inference_params.key_value_memory_dict.values():
+        src_t = torch.tensor(src, device=kv_cache.device)
+        kv_cache[:, torch.tensor(dst, device=kv_cache.device)] = kv_cache[:, src_t]
+
+
+@torch.inference_mode()
+def decode_speculative_tree(
+    input_ids,
+    model,
+    model_draft,
+    max_length,
+    speculative_tree,
+    top_k=1,
+    top_p=0.0,
+    temperature=1.0,
+    eos_token_id=None,
+    vocab_size=None,
+    enable_timing=False,
+):
+    """Speculative decoding where the draft model proposes a tree of candidates [1], which the
+    model verifies in a single forward with a tree attention mask (InferenceParams.tree_attn_mask).
+    Level l of the tree has the speculative_tree[l - 1] most likely tokens (according to the draft
+    model) after each node of level l - 1. Only supports batch_size == 1.
+
+    The model samples a token at the root (the last generated token); if it's one of the children
+    of the root, we move to that child and sample again, until the sampled token is not in the
+    tree. So every generated token is sampled from the model, exactly as without speculation, and
+    each forward of the model generates between 1 and len(speculative_tree) + 1 tokens. The keys
+    and values of the accepted path are then moved to the front of the tree in the KV cache, which
+    overwrites the rejected branches.
+
+    [1] SpecInfer: Accelerating Generative Large Language Model Serving with Tree-based Speculative
+    Inference and Verification. Miao et al. https://arxiv.org/abs/2305.09781
+
+    Arguments:
+        input_ids: (1, seq_len)
+        max_length: int
+        speculative_tree: tuple of ints, number of branches per level, e.g. (4, 2, 2, 1).
+    Returns: GreedySearchDecoderOnlyOutput or SampleDecoderOnlyOutput, with the following fields:
+        sequences: (1, max_length)
+        scores: (1, max_length - seq_len, vocab_size)
+    """
+    batch_size, seqlen_og = input_ids.shape
+    assert batch_size == 1, "Speculative decoding implementation only supports batch_size=1"
+    assert eos_token_id is None, "Speculative decoding implementation doesn't support eos_token_id"
+    assert len(speculative_tree) > 0 and all(b > 0 for b in speculative_tree)
+    device = input_ids.device
+    # The tree is written to the cache after the tokens generated so far
+    max_num_nodes = sum(
+        math.prod(speculative_tree[: i + 1]) for i in range(len(speculative_tree))
+    )
+    inference_params = InferenceParams(
+        max_seqlen=max_length + max_num_nodes + 1, max_batch_size=batch_size
+    )
+    inference_params_draft = InferenceParams(
+        max_seqlen=max_length + max_num_nodes + 1, max_batch_size=batch_size
+    )
+    sample_fn = partial(sample, top_k=top_k, top_p=top_p, temperature=temperature)
+
+    def get_logits(model, input_ids, inference_params, position_ids=None, num_last_tokens=1):
+        logits = model(
+            input_ids,
+            position_ids=position_ids,
+            inference_params=inference_params,
+            num_last_tokens=num_last_tokens,
+        ).logits[0]
+        return logits[..., :vocab_size] if vocab_size is not None else logits
+
+    if enable_timing:
+        torch.cuda.synchronize()
+        start = time.time()
+
+    tokens = input_ids[0].tolist()
+    scores = []
+    # The model's cache holds all the tokens but the last one, the draft model's cache holds
+    # the first num_tokens_draft tokens.
+    if seqlen_og > 1:
+        get_logits(model, input_ids[:, :-1], inference_params)
+    inference_params.seqlen_offset = seqlen_og - 1
+    num_tokens_draft = 0
+    num_main_model_calls = 0
+    while len(tokens) < max_length:
+        seqlen = len(tokens)
+        depth = min(len(speculative_tree), max_length - seqlen - 1)
+        # 1. Grow the tree level by level with the draft model. The root is the last token.
+        parents, node_tokens, level_start = [], [], 0
+        if depth > 0:
+            inference_params_draft.seqlen_offset = num_tokens_draft
+            inference_params_draft.tree_attn_mask = None
+            input_ids_draft = torch.tensor([tokens[num_tokens_draft:]], device=device)
+            position_ids = torch.arange(num_tokens_draft, seqlen, device=device)[None]
+            logits_draft = get_logits(
+                model_draft, input_ids_draft, inference_params_draft, position_ids
+            )
+            num_tokens_draft = seqlen
+            for level in range(depth):
+                num_parents = logits_draft.shape[0]
+                children = torch.topk(logits_draft, speculative_tree[level], dim=-1).indices
+                level_start = len(parents)
+                for p, parent_children in enumerate(children.tolist()):
+                    parent = level_start - num_parents + p if level > 0 else -1
+                    parents.extend([parent] * len(parent_children))
+                    node_tokens.extend(parent_children)
+                if level == depth - 1:  # The leaves don't need to be expanded
+                    break
+                tree_attn_mask = build_speculative_tree(parents).to(device)
+                inference_params_draft.seqlen_offset = seqlen + level_start
+                inference_params_draft.tree_attn_mask = tree_attn_mask[level_start:]
+                logits_draft = get_logits(
+                    model_draft,
+                    torch.tensor([node_tokens[level_start:]], device=device),
+                    inference_params_draft,
+                    position_ids=seqlen + tree_attn_mask[level_start:].sum(dim=-1)[None] - 1,
+                    num_last_tokens=len(parents) - level_start,
+                )
+        # 2. Verify the whole tree, with the root at index 0, in one forward of the model.
+        tree_attn_mask = build_speculative_tree([-1] + [p + 1 for p in parents]).to(device)
+        inference_params.tree_attn_mask = tree_attn_mask
+        logits = get_logits(
+            model,
+            torch.tensor([tokens[-1:] + node_tokens], device=device),
+            inference_params,
+            position_ids=seqlen - 1 + tree_attn_mask.sum(dim=-1)[None] - 1,
+            num_last_tokens=len(parents) + 1,
+        )
+        num_main_model_calls += 1
+        # 3. Walk down the tree while the sampled token is one of the children.
+        children = [dict() for _ in range(len(parents) + 1)]
+        for i, (parent, token) in enumerate(zip(parents, node_tokens)):
+            children[parent + 1][token] = i + 1
+        path, node = [0], 0
+        while True:
+            token = sample_fn(logits[node : node + 1])[0].item()
+            scores.append(logits[node])
+            tokens.append(token)
+            if token not in children[node]:
+                break
+            node = children[node][token]
+            path.append(node)
+        # 4. Compact the KV caches: the accepted path goes right after the previous tokens.
+        _move_kv_cache(
+            inference_params,
+            [seqlen - 1 + i for i in path],
+            list(range(seqlen - 1, seqlen - 1 + len(path))),
+        )
+        inference_params.seqlen_offset = seqlen - 1 + len(path)
+        # The draft model has the keys and values of the nodes that were expanded, i.e. all
+        # but the last level, which come first in the tree.
+        num_expanded = level_start if depth > 1 else 0
+        path_draft = [i - 1 for i in path[1:] if i - 1 < num_expanded]
+        _move_kv_cache(
+            inference_params_draft,
+            [seqlen + i for i in path_draft],
+            list(range(seqlen, seqlen + len(path_draft))),
+        )
+        num_tokens_draft = seqlen + len(path_draft)
+    inference_params.tree_attn_mask = None
+    inference_params_draft.tree_attn_mask = None
+    if enable_timing:
+        torch.cuda.synchronize()
+        print(f"Prompt processing + decoding time: {(time.time() - start) * 1000:.0f}ms")
+        print(f"Number of calls to main model: {num_main_model_calls}")
+        num_generated = len(tokens) - seqlen_og
+        print(f"Tokens per call to main model: {num_generated / num_main_model_calls:.2f}")
+    sequences = torch.tensor([tokens], dtype=input_ids.dtype, device=device)
+    output_cls = GreedySearchDecoderOnlyOutput if top_k == 1 else SampleDecoderOnlyOutput
+    return output_cls(sequences=sequences, scores=torch.stack(scores)[None])
+
+
 class GenerationMixin:
     def allocate_inference_cache(self, batch_size, max_seqlen, dtype=None, **kwargs):
         raise NotImplementedError
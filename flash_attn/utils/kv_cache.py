@@ -0,0 +1,555 @@
+import heapq
+import itertools
+import json
+import math
+import os
+import threading
+from concurrent.futures import Future, ThreadPoolExecutor
+from typing import Callable, Dict, Hashable, List, Optional, Sequence, Union
+
+import torch
+from torch import Tensor
+
+
+# KV cache dtypes that are stored quantized, with a scale per (page, K or V, head)
+QUANTIZED_KV_CACHE_DTYPES = [torch.int8] + (
+    [torch.float8_e4m3fn] if hasattr(torch, "float8_e4m3fn") else []
+)
+
+
+def allocate_paged_inference_cache(
+    num_pages,
+    page_size,
+    nheads,
+    headdim,
+    layers: Union[int, Sequence],
+    device,
+    dtype=torch.float16,
+):
+    """The page pool of each layer has the same layout as the dense cache, with
+    (max_batch_size, max_seqlen) replaced by (num_pages, page_size).
+    dtype can also be one of QUANTIZED_KV_CACHE_DTYPES, see PagedKVCache.
+    """
+    assert dtype in [torch.float16, torch.bfloat16, torch.float32] + QUANTIZED_KV_CACHE_DTYPES
+    kv_cache_shape = (num_pages, page_size, 2, nheads, headdim)
+    if isinstance(layers, int):
+        layers = range(layers)
+    return {i: torch.empty(kv_cache_shape, device=device, dtype=dtype) for i in layers}
+
+
+class PagedKVCache:
+    """Paged KV cache: a fixed pool of pages shared by all the sequences of a batch.
+
+    Instead of reserving (max_batch_size, max_seqlen) tokens for every layer, each sequence only
+    holds ceil(seqlen / page_size) pages, which are taken from a free list when the sequence grows
+    and given back when it ends. The pages owned by sequence b are listed in page_table[b], which
+    is the (batch_size, max_num_pages_per_seq) int32 block table that flash_attn_with_kvcache
+    accepts. Entries past the pages a sequence owns are 0 and are never read since they lie
+    beyond cache_seqlens.
+
+    Pages are ref-counted so that a page can be shared by several sequences and by a PrefixCache.
+    A page goes back to the free list when its last reference is dropped. If the pool runs out,
+    evict_fn (if set, e.g. by PrefixCache) is asked to release pages before giving up.
+
+    If the pages are int8 or fp8 (QUANTIZED_KV_CACHE_DTYPES), which halves the memory per token
+    compared to fp16, kv_scales holds for each layer a (num_pages, 2, nheads_kv) fp32 tensor of
+    dequantization scales, one per page, K / V and head. Keys and values are quantized as they
+    are appended (see kv_cache_write) and dequantized as they are read (see kv_cache_read).
+
+    Arguments:
+        kv_cache: dict of layer_idx -> (num_pages, page_size, 2, nheads_kv, headdim) tensors,
+            e.g. from allocate_paged_inference_cache or model.allocate_inference_cache(num_pages,
+            page_size).
+        max_batch_size: int. Number of sequence slots (rows of page_table).
+        max_seqlen: int. Longest sequence a single slot can hold.
+    """
+
+    def __init__(self, kv_cache: Dict[int, Tensor], max_batch_size: int, max_seqlen: int):
+        assert len(kv_cache) > 0
+        example = next(iter(kv_cache.values()))
+        assert all(v.shape[:2] == example.shape[:2] for v in kv_cache.values())
+        self.kv_cache = kv_cache
+        self.num_pages, self.page_size = example.shape[:2]
+        self.max_batch_size = max_batch_size
+        self.max_seqlen = max_seqlen
+        self.max_num_pages_per_seq = math.ceil(max_seqlen / self.page_size)
+        self.device = example.device
+        self.kv_scales: Optional[Dict[int, Tensor]] = None
+        if example.dtype in QUANTIZED_KV_CACHE_DTYPES:
+            self.kv_scales = {
+                layer_idx: torch.zeros(
+                    self.num_pages, 2, v.shape[3], dtype=torch.float32, device=self.device
+                )
+                for layer_idx, v in kv_cache.items()
+            }
+        self.page_table = torch.zeros(
+            max_batch_size, self.max_num_pages_per_seq, dtype=torch.int32, device=self.device
+        )
+        # Stack of free page ids, popped from the end so that low page ids are handed out first.
+        self._free_pages: List[int] = list(range(self.num_pages - 1, -1, -1))
+        # Host-side copy of page_table, so that growing a sequence doesn't need a device sync.
+        self._seq_pages: List[List[int]] = [[] for _ in range(max_batch_size)]
+        self._refcount: List[int] = [0] * self.num_pages
+        # Called with the number of pages we're short of when the free list runs out.
+        self.evict_fn: Optional[Callable[[int], int]] = None
+
+    @classmethod
+    def from_model(cls, model, num_pages, page_size, max_batch_size, max_seqlen, dtype=None):
+        kv_cache = model.allocate_inference_cache(num_pages, page_size, dtype=dtype)
+        return cls(kv_cache, max_batch_size, max_seqlen)
+
+    @property
+    def num_free_pages(self) -> int:
+        return len(self._free_pages)
+
+    def num_pages_needed(self, seqlen: int) -> int:
+        return math.ceil(seqlen / self.page_size)
+
+    def pages(self, batch_idx: int) -> List[int]:
+        return list(self._seq_pages[batch_idx])
+
+    def refcount(self, page: int) -> int:
+        return self._refcount[page]
+
+    def incref(self, pages: Sequence[int]):
+        for page in pages:
+            assert self._refcount[page] > 0, f"page {page} is not allocated"
+            self._refcount[page] += 1
+
+    def decref(self, pages: Sequence[int]):
+        for page in pages:
+            assert self._refcount[page] > 0, f"page {page} is not allocated"
+            self._refcount[page] -= 1
+            if self._refcount[page] == 0:
+                self._free_pages.append(page)
+
+    def capacity(self, batch_idx: int) -> int:
+        """Number of tokens that sequence @batch_idx can hold without allocating a new page."""
+        return len(self._seq_pages[batch_idx]) * self.page_size
+
+    def can_reserve(self, batch_idx: int, seqlen: int) -> bool:
+        num_new = self.num_pages_needed(seqlen) - len(self._seq_pages[batch_idx])
+        return seqlen <= self.max_seqlen and num_new <= self.num_free_pages
+
+    def reserve(self, batch_idx: int, seqlen: int):
+        """Make sure that sequence @batch_idx has pages for its first @seqlen tokens.
+        Pages are only allocated for the part that's not covered yet.
+        """
+        assert seqlen <= self.max_seqlen, f"seqlen {seqlen} exceeds max_seqlen {self.max_seqlen}"
+        pages = self._seq_pages[batch_idx]
+        num_new = self.num_pages_needed(seqlen) - len(pages)
+        if num_new <= 0:
+            return
+        if num_new > self.num_free_pages and self.evict_fn is not None:
+            self.evict_fn(num_new - self.num_free_pages)
+        if num_new > self.num_free_pages:
+            raise RuntimeError(
+                f"Out of KV cache pages: need {num_new} but only {self.num_free_pages} are free"
+            )
+        new_pages = [self._free_pages.pop() for _ in range(num_new)]
+        for page in new_pages:
+            self._refcount[page] = 1
+        if self.kv_scales is not None:
+            # A scale of 0 marks a page that doesn't hold anything yet
+            new_pages_t = torch.tensor(new_pages, dtype=torch.long, device=self.device)
+            for kv_scales in self.kv_scales.values():
+                kv_scales[new_pages_t] = 0.0
+        self.page_table[batch_idx, len(pages) : len(pages) + num_new] = torch.tensor(
+            new_pages, dtype=torch.int32
+        )
+        pages.extend(new_pages)
+
+    def share(self, batch_idx: int, pages: Sequence[int]):
+        """Make the already filled @pages the first pages of the (empty) sequence @batch_idx.
+        The pages are shared, so the caller must not write into them.
+        """
+        assert not self._seq_pages[batch_idx], "share() must be called on an empty sequence"
+        assert len(pages) <= self.max_num_pages_per_seq
+        if not pages:
+            return
+        self.incref(pages)
+        self.page_table[batch_idx, : len(pages)] = torch.tensor(pages, dtype=torch.int32)
+        self._seq_pages[batch_idx] = list(pages)
+
+    def free(self, batch_idx: int):
+        """Drop the references of sequence @batch_idx to its pages. Pages that aren't shared go
+        back to the pool.
+        """
+        pages = self._seq_pages[batch_idx]
+        if not pages:
+            return
+        self.decref(reversed(pages))
+        self.page_table[batch_idx, : len(pages)] = 0
+        self._seq_pages[batch_idx] = []
+
+    def reset(self):
+        for batch_idx in range(self.max_batch_size):
+            self.free(batch_idx)
+
+
+class _PrefixNode:
+    __slots__ = ["key", "page", "parent", "children", "last_access"]
+
+    def __init__(self, key, page, parent):
+        self.key = key
+        self.page = page
+        self.parent = parent
+        self.children = {}
+        self.last_access = 0
+
+
+class PrefixCache:
+    """Cache of the KV pages of previously seen prompts, for reuse by prompts that share a prefix
+    (e.g. a long system prompt).
+
+    This is a radix tree whose edges are blocks of page_size token ids: the node reached by
+    following blocks t[0:P], t[P:2P], ..., t[(n-1)P:nP] holds the page with the keys and values
+    of tokens (n-1)P..nP-1 of any prompt starting with t[:nP]. Only full pages are cached, and
+    cached pages are never written again. The tree holds one reference to each of its pages; when
+    the pool runs out of pages, the least recently used leaves that no sequence is using are
+    evicted.
+    """
+
+    def __init__(self, paged_kv_cache: PagedKVCache):
+        self.paged_kv_cache = paged_kv_cache
+        self.page_size = paged_kv_cache.page_size
+        self.root = _PrefixNode(None, None, None)
+        self.num_pages = 0
+        self._clock = itertools.count(1)
+        paged_kv_cache.evict_fn = self.evict
+
+    def _blocks(self, token_ids, num_blocks):
+        return [
+            tuple(token_ids[i * self.page_size : (i + 1) * self.page_size])
+            for i in range(num_blocks)
+        ]
+
+    def match(self, token_ids: Sequence[int], max_num_tokens: Optional[int] = None) -> List[int]:
+        """Return the pages of the longest cached prefix of @token_ids, made of at most
+        @max_num_tokens tokens. The prefix covers len(pages) * page_size tokens.
+        """
+        token_ids = list(token_ids)
+        if max_num_tokens is None:
+            max_num_tokens = len(token_ids)
+        num_blocks = min(len(token_ids), max_num_tokens) // self.page_size
+        now = next(self._clock)
+        node, pages = self.root, []
+        for key in self._blocks(token_ids, num_blocks):
+            node = node.children.get(key)
+            if node is None:
+                break
+            node.last_access = now
+            pages.append(node.page)
+        return pages
+
+    def insert(self, token_ids: Sequence[int], pages: Sequence[int]):
+        """Cache @pages, which hold the KV of the tokens @token_ids (page i holds tokens
+        i * page_size .. (i + 1) * page_size - 1). The last page is skipped if it's not full.
+        Blocks that are already in the cache keep their existing page.
+        """
+        token_ids = list(token_ids)
+        num_blocks = min(len(token_ids) // self.page_size, len(pages))
+        now = next(self._clock)
+        node = self.root
+        for key, page in zip(self._blocks(token_ids, num_blocks), pages):
+            child = node.children.get(key)
+            if child is None:
+                child = _PrefixNode(key, page, node)
+                node.children[key] = child
+                self.paged_kv_cache.incref([page])
+                self.num_pages += 1
+            child.last_access = now
+            node = child
+
+    def _is_evictable(self, node):
+        # Leaves that no sequence holds a reference to (besides us)
+        return not node.children and self.paged_kv_cache.refcount(node.page) == 1
+
+    def evict(self, num_pages: int) -> int:
+        """Evict up to @num_pages least recently used pages. Return the number of evicted pages."""
+        tiebreak = itertools.count()
+        heap, stack = [], list(self.root.children.values())
+        while stack:
+            node = stack.pop()
+            stack.extend(node.children.values())
+            if self._is_evictable(node):
+                heap.append((node.last_access, next(tiebreak), node))
+        heapq.heapify(heap)
+        num_evicted = 0
+        while heap and num_evicted < num_pages:
+            _, _, node = heapq.heappop(heap)
+            parent = node.parent
+            del parent.children[node.key]
+            self.paged_kv_cache.decref([node.page])
+            self.num_pages -= 1
+            num_evicted += 1
+            if parent is not self.root and self._is_evictable(parent):
+                heapq.heappush(heap, (parent.last_access, next(tiebreak), parent))
+        return num_evicted
+
+    def reset(self):
+        self.evict(self.num_pages)
+
+
+def _map_file(path, shape, dtype):
+    """Return a tensor of the given shape backed by the memory-mapped file @path."""
+    nbytes = math.prod(shape) * torch.empty((), dtype=dtype).element_size()
+    with open(path, "ab") as f:
+        if f.tell() < nbytes:
+            f.truncate(nbytes)
+    return torch.from_file(path, shared=True, size=math.prod(shape), dtype=dtype).view(shape)
+
+
+class KVSwapSpace:
+    """Host storage for the KV pages of preempted sequences, so that they can be swapped back in
+    instead of being recomputed.
+
+    The host pages live in a pinned CPU arena, or, if path is given, in a memory-mapped file
+    (so they can exceed the RAM and be paged out by the OS). swap_out gathers the pages of a
+    sequence into a temporary buffer on the current stream, after which the device pages can be
+    freed and reused right away. The copy of that buffer to the host then runs on a background
+    I/O thread (and a separate CUDA stream), overlapping with the next steps. swap_in waits for
+    that copy if it's still running and copies the pages into pages of the device pool. swap_in
+    is synchronous: the host pages of a sequence are scattered, so they're gathered on the CPU
+    first, and that pageable buffer can't be copied to the device asynchronously.
+
+    A manifest, key -> {"host_pages", "num_tokens", "complete"}, records where each swapped
+    sequence is. With a file, it's also written atomically to path + ".json" after every change,
+    next to the pages (and path + ".scales" for the scales of a quantized cache).
+
+    Arguments:
+        paged_kv_cache: PagedKVCache.
+        num_host_pages: int. Number of pages of the host storage.
+        path (optional): str, file to memory-map the host pages to.
+    """
+
+    def __init__(self, paged_kv_cache: PagedKVCache, num_host_pages: int, path=None):
+        self.paged_kv_cache = paged_kv_cache
+        self.layers = list(paged_kv_cache.kv_cache.keys())
+        example = paged_kv_cache.kv_cache[self.layers[0]]
+        self.num_host_pages = num_host_pages
+        self.path = path
+        shape = (len(self.layers), num_host_pages, *example.shape[1:])
+        scales_shape = (len(self.layers), num_host_pages, 2, example.shape[3])
+        if path is None:
+            pin_memory = paged_kv_cache.device.type == "cuda"
+            self.host_kv = torch.empty(shape, dtype=example.dtype, pin_memory=pin_memory)
+            self.host_kv_scales = torch.empty(scales_shape, pin_memory=pin_memory)
+        else:
+            self.host_kv = _map_file(path, shape, example.dtype)
+            self.host_kv_scales = _map_file(path + ".scales", scales_shape, torch.float32)
+        self._free_pages: List[int] = list(range(num_host_pages - 1, -1, -1))
+        self.manifest: Dict[Hashable, dict] = {}
+        self._pending: Dict[Hashable, Future] = {}
+        # Protects the manifest, which the I/O thread updates when a copy completes, and the free
+        # host pages
+        self._lock = threading.Lock()
+        self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="kv_swap")
+        self._stream = (
+            torch.cuda.Stream(paged_kv_cache.device)
+            if paged_kv_cache.device.type == "cuda"
+            else None
+        )
+
+    @property
+    def num_free_pages(self) -> int:
+        with self._lock:
+            return len(self._free_pages)
+
+    def can_swap_out(self, num_tokens: int) -> bool:
+        return self.paged_kv_cache.num_pages_needed(num_tokens) <= self.num_free_pages
+
+    def num_tokens(self, key: Hashable) -> int:
+        """Number of tokens swapped out under @key, 0 if there are none."""
+        with self._lock:
+            entry = self.manifest.get(key)
+            return entry["num_tokens"] if entry is not None else 0
+
+    def swap_out(self, key: Hashable, batch_idx: int, num_tokens: int) -> Future:
+        """Copy the KV of the first @num_tokens tokens of sequence @batch_idx to the host. The
+        sequence's device pages can be freed as soon as this returns. The returned future is done
+        once the copy to the host is.
+        """
+        paged_kv_cache = self.paged_kv_cache
+        num_pages = paged_kv_cache.num_pages_needed(num_tokens)
+        pages = paged_kv_cache.pages(batch_idx)[:num_pages]
+        assert len(pages) == num_pages, f"sequence {batch_idx} holds fewer than {num_tokens} tokens"
+        with self._lock:
+            assert key not in self.manifest, f"{key} is already swapped out"
+            if num_pages > len(self._free_pages):
+                raise RuntimeError(
+                    f"Out of host pages: need {num_pages} but only {len(self._free_pages)} are free"
+                )
+            host_pages = [self._free_pages.pop() for _ in range(num_pages)]
+        pages = torch.tensor(pages, dtype=torch.long, device=paged_kv_cache.device)
+        kv = torch.stack([paged_kv_cache.kv_cache[layer][pages] for layer in self.layers])
+        kv_scales = (
+            torch.stack([paged_kv_cache.kv_scales[layer][pages] for layer in self.layers])
+            if paged_kv_cache.kv_scales is not None
+            else None
+        )
+        event = None
+        if self._stream is not None:
+            event = torch.cuda.Event()
+            event.record()
+        with self._lock:
+            self.manifest[key] = {
+                "host_pages": host_pages,
+                "num_tokens": num_tokens,
+                "complete": False,
+            }
+        future = self._executor.submit(self._copy_to_host, key, host_pages, kv, kv_scales, event)
+        self._pending[key] = future
+        return future
+
+    def _copy_to_host(self, key, host_pages, kv, kv_scales, event):
+        # Runs on the I/O thread
+        if self._stream is not None:
+            self._stream.wait_event(event)
+            with torch.cuda.stream(self._stream):
+                kv = kv.cpu()
+                kv_scales = kv_scales.cpu() if kv_scales is not None else None
+        host_pages = torch.tensor(host_pages, dtype=torch.long)
+        self.host_kv[:, host_pages] = kv
+        if kv_scales is not None:
+            self.host_kv_scales[:, host_pages] = kv_scales
+        with self._lock:
+            self.manifest[key]["complete"] = True
+            self._write_manifest()
+
+    def swap_in(self, key: Hashable, batch_idx: int) -> int:
+        """Copy the KV swapped out under @key into the first pages of sequence @batch_idx, which
+        must already have been reserved. Return the number of tokens.
+        """
+        future = self._pending.pop(key, None)
+        if future is not None:
+            future.result()
+        paged_kv_cache = self.paged_kv_cache
+        with self._lock:
+            entry = self.manifest.pop(key)
+            self._write_manifest()
+        num_pages = len(entry["host_pages"])
+        pages = paged_kv_cache.pages(batch_idx)[:num_pages]
+        assert len(pages) == num_pages, f"pages for {entry['num_tokens']} tokens must be reserved"
+        pages = torch.tensor(pages, dtype=torch.long, device=paged_kv_cache.device)
+        host_pages = torch.tensor(entry["host_pages"], dtype=torch.long)
+        kv = self.host_kv[:, host_pages].to(paged_kv_cache.device)
+        for i, layer in enumerate(self.layers):
+            paged_kv_cache.kv_cache[layer][pages] = kv[i]
+        if paged_kv_cache.kv_scales is not None:
+            kv_scales = self.host_kv_scales[:, host_pages].to(paged_kv_cache.device)
+            for i, layer in enumerate(self.layers):
+                paged_kv_cache.kv_scales[layer][pages] = kv_scales[i]
+        with self._lock:
+            self._free_pages.extend(entry["host_pages"])
+        return entry["num_tokens"]
+
+    def discard(self, key: Hashable):
+        """Drop the KV swapped out under @key, e.g. if the request was cancelled."""
+        future = self._pending.pop(key, None)
+        if future is not None:
+            future.result()
+        with self._lock:
+            entry = self.manifest.pop(key)
+            self._write_manifest()
+            self._free_pages.extend(entry["host_pages"])
+
+    def synchronize(self):
+        """Wait for all the copies to the host."""
+        for future in list(self._pending.values()):
+            future.result()
+
+    def close(self):
+        self._executor.shutdown(wait=True)
+
+    def _write_manifest(self):
+        # Called with self._lock held
+        if self.path is None:
+            return
+        tmp_path = self.path + ".json.tmp"
+        with open(tmp_path, "w") as f:
+            json.dump({str(key): entry for key, entry in self.manifest.items()}, f)
+        os.replace(tmp_path, self.path + ".json")
+
+
+def _kv_cache_qmax(dtype):
+    return 127.0 if dtype == torch.int8 else torch.finfo(dtype).max
+
+
+def _quantize(x, scales, dtype):
+    # Pages with a scale of 0 only hold zeros
+    x = x / scales.clamp(min=torch.finfo(torch.float32).tiny)[..., None]
+    if dtype == torch.int8:
+        return x.round_().clamp_(-127, 127).to(dtype)
+    qmax = _kv_cache_qmax(dtype)
+    return x.clamp_(-qmax, qmax).to(dtype)
+
+
+def kv_cache_write(kv_cache, page_idx, page_offset, kv, kv_scales=None):
+    """kv_cache[page_idx, page_offset] = kv, where page_idx and page_offset broadcast to the
+    leading dimensions of kv (..., 2, nheads_kv, headdim).
+
+    If kv_scales (num_pages, 2, nheads_kv) is not None, kv_cache is quantized and kv is quantized
+    on the fly. The scale of a page is the largest amax / qmax of everything written to it, so
+    when the new tokens don't fit in the range of a page, its scale grows and the tokens it
+    already holds are requantized.
+    """
+    if kv_scales is None:
+        kv_cache[page_idx, page_offset] = kv
+        return
+    page_idx, page_offset = torch.broadcast_tensors(page_idx, page_offset)
+    kv = kv.float().reshape(-1, *kv.shape[-3:])
+    page_idx, page_offset = page_idx.reshape(-1), page_offset.reshape(-1)
+    new_scales = kv_scales.index_reduce(
+        0, page_idx, kv.abs().amax(dim=-1) / _kv_cache_qmax(kv_cache.dtype), "amax"
+    )
+    requantize = ((new_scales > kv_scales) & (kv_scales > 0)).flatten(1).any(dim=1)
+    pages = requantize.nonzero(as_tuple=True)[0]
+    if pages.numel() > 0:
+        kv_cache[pages] = _quantize(
+            kv_cache[pages].float() * kv_scales[pages][:, None, ..., None],
+            new_scales[pages][:, None],
+            kv_cache.dtype,
+        )
+    kv_scales.copy_(new_scales)
+    kv_cache[page_idx, page_offset] = _quantize(kv, kv_scales[page_idx], kv_cache.dtype)
+
+
+def kv_cache_read(kv_cache, page_idx, page_offset, kv_scales=None, dtype=None):
+    """Return kv_cache[page_idx, page_offset], dequantized to dtype if kv_scales is not None."""
+    kv = kv_cache[page_idx, page_offset]
+    if kv_scales is None:
+        return kv
+    page_idx = torch.broadcast_to(page_idx, kv.shape[:-3])
+    return (kv.float() * kv_scales[page_idx][..., None]).to(dtype)
+
+
+def paged_kv_cache_update(kv_cache, page_table, kv, seqlen_offset, kv_scales=None):
+    """Write kv into the pages of kv_cache and read back the KV of the whole prefix.
+    This is the reference (non-FlashAttention) path of the paged cache, which also runs on CPU.
+
+    Arguments:
+        kv_cache: (num_pages, page_size, 2, nheads_kv, headdim)
+        page_table: (batch_size, max_num_pages_per_seq), int32
+        kv: (batch_size, seqlen, 2, nheads_kv, headdim), the new keys and values.
+        seqlen_offset: int, the position of the first new token.
+        kv_scales (optional): (num_pages, 2, nheads_kv), if the cache is quantized.
+    Return:
+        kv: (batch_size, seqlen_offset + seqlen, 2, nheads_kv, headdim)
+    """
+    page_size = kv_cache.shape[1]
+    page_table = page_table.long()
+    seqlen_end = seqlen_offset + kv.shape[1]
+    assert seqlen_end <= page_table.shape[1] * page_size
+    positions = torch.arange(seqlen_offset, seqlen_end, device=kv.device)
+    kv_cache_write(
+        kv_cache, page_table[:, positions // page_size], positions % page_size, kv, kv_scales
+    )
+    positions = torch.arange(seqlen_end, device=kv.device)
+    return kv_cache_read(
+        kv_cache,
+        page_table[:, positions // page_size],
+        positions % page_size,
+        kv_scales,
+        dtype=kv.dtype,
+    )
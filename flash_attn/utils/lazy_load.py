@@ -0,0 +1,174 @@
+import json
+import os
+from functools import partial
+
+import torch
+from torch.utils._pytree import tree_flatten, tree_map
+
+# safetensors dtype names, see https://github.com/huggingface/safetensors
+SAFETENSORS_DTYPES = {
+    "F64": torch.float64,
+    "F32": torch.float32,
+    "F16": torch.float16,
+    "BF16": torch.bfloat16,
+    "I64": torch.int64,
+    "I32": torch.int32,
+    "I16": torch.int16,
+    "I8": torch.int8,
+    "U8": torch.uint8,
+    "BOOL": torch.bool,
+}
+if hasattr(torch, "float8_e4m3fn"):
+    SAFETENSORS_DTYPES.update({"F8_E4M3": torch.float8_e4m3fn, "F8_E5M2": torch.float8_e5m2})
+
+
+def _is_device(arg):
+    return isinstance(arg, (str, int, torch.device))
+
+
+class LazyTensor(torch.Tensor):
+    """A tensor whose data is only read when it is needed.
+
+    A LazyTensor is a meta tensor (so it has a shape, dtype, strides but no data) together with a
+    function that produces the actual tensor. The torch ops on LazyTensors (transpose, F.pad,
+    torch.cat, einops.rearrange, .to(dtype), ...) are not run, they return new LazyTensors that
+    record them. An op that mixes LazyTensors with real tensors, e.g. param.copy_(lazy_tensor) in
+    nn.Module.load_state_dict, materializes the LazyTensors and runs eagerly.
+
+    This way the functions that remap the keys and the layout of a checkpoint run on the whole
+    state dict without reading it, and each tensor is read (and converted) only when it's copied
+    into a parameter, so the peak memory is about the size of the largest tensor.
+    Materializing a LazyTensor twice reads it twice, the result isn't cached.
+    """
+
+    @staticmethod
+    def __new__(cls, meta, fn):
+        assert meta.is_meta
+        self = torch.Tensor._make_subclass(cls, meta)
+        self._fn = fn
+        return self
+
+    @classmethod
+    def from_tensor(cls, tensor):
+        """Wrap e.g. a memory-mapped tensor, so that the ops on it are deferred."""
+        return cls(torch.empty_like(tensor, device="meta"), lambda: tensor)
+
+    def materialize(self):
+        return self._fn()
+
+    @classmethod
+    def __torch_function__(cls, func, types, args=(), kwargs=None):
+        kwargs = kwargs or {}
+        name = getattr(func, "__name__", "")
+        inplace = (name.endswith("_") and not name.endswith("__")) or name == "__setitem__"
+        if inplace and args and isinstance(args[0], LazyTensor):
+            raise NotImplementedError(f"In-place op {name} on a LazyTensor")
+        tensors = [x for x in tree_flatten((args, kwargs))[0] if isinstance(x, torch.Tensor)]
+        if inplace or "out" in kwargs or not all(isinstance(x, LazyTensor) for x in tensors):
+            args, kwargs = tree_map(materialize, (args, kwargs))
+            return func(*args, **kwargs)
+        # Run the op on the meta tensors to get the metadata of the output. The data might be
+        # moved to another device, but the metadata stays on meta.
+        meta_args, meta_kwargs = args, kwargs
+        if name in ["to", "cuda", "cpu"]:
+            meta_args = [a for a in args if not _is_device(a)]
+            meta_kwargs = {k: v for k, v in kwargs.items() if k != "device"}
+        with torch._C.DisableTorchFunctionSubclass():
+            out = func(*meta_args, **meta_kwargs)
+        outs, _ = tree_flatten(out)
+        if not any(isinstance(o, torch.Tensor) for o in outs):
+            return out  # e.g. shape, dtype, dim()
+
+        def run():
+            return func(*tree_map(materialize, args), **tree_map(materialize, kwargs))
+
+        if isinstance(out, torch.Tensor):
+            return LazyTensor(out, run)
+        # Ops with several outputs, e.g. chunk, split, unbind
+        assert isinstance(out, (tuple, list)) and all(isinstance(o, torch.Tensor) for o in out)
+        return type(out)(LazyTensor(o, partial(lambda i: run()[i], i)) for i, o in enumerate(out))
+
+
+def materialize(x):
+    """Read a LazyTensor, anything else is returned as is."""
+    return x.materialize() if isinstance(x, LazyTensor) else x
+
+
+def lazy_load_file(filename):
+    """Load a safetensors or torch.save checkpoint file, with its tensors as LazyTensors.
+
+    safetensors files are opened once, and each tensor is read from the file on materialization.
+    torch.save files (zip format) are memory-mapped (torch.load(mmap=True)), only the pages of the
+    tensors that are materialized get read. Nested checkpoints (e.g. a Lightning checkpoint with a
+    "state_dict" key) keep their structure.
+    """
+    filename = str(filename)
+    if filename.endswith(".safetensors"):
+        from safetensors import safe_open
+
+        f = safe_open(filename, framework="pt", device="cpu")
+        state_dict = {}
+        for key in f.keys():
+            tensor_slice = f.get_slice(key)
+            meta = torch.empty(
+                tensor_slice.get_shape(),
+                dtype=SAFETENSORS_DTYPES[tensor_slice.get_dtype()],
+                device="meta",
+            )
+            state_dict[key] = LazyTensor(meta, partial(f.get_tensor, key))
+        return state_dict
+    checkpoint = torch.load(filename, map_location="cpu", mmap=True, weights_only=True)
+    return tree_map(
+        lambda x: LazyTensor.from_tensor(x) if isinstance(x, torch.Tensor) else x, checkpoint
+    )
+
+
+class SafetensorsWriter:
+    """Write a safetensors file one tensor at a time, e.g. from several threads.
+
+    The shapes and dtypes of all the tensors (anything with .shape and .dtype, such as
+    LazyTensors) are given upfront, so the header and the offset of each tensor are known: the
+    file is preallocated, and write(key, tensor) writes the data of key at its offset with
+    os.pwrite. The file is renamed to filename once close() is called, after all the tensors have
+    been written.
+    """
+
+    def __init__(self, filename, tensors, metadata=None):
+        dtype_names = {dtype: name for name, dtype in SAFETENSORS_DTYPES.items()}
+        self.filename = str(filename)
+        header, self.offsets, offset = {}, {}, 0
+        if metadata is not None:
+            header["__metadata__"] = metadata
+        for key, t in tensors.items():
+            nbytes = t.numel() * t.element_size()
+            header[key] = {
+                "dtype": dtype_names[t.dtype],
+                "shape": list(t.shape),
+                "data_offsets": [offset, offset + nbytes],
+            }
+            self.offsets[key] = (offset, nbytes)
+            offset += nbytes
+        header_bytes = json.dumps(header, separators=(",", ":")).encode()
+        header_bytes += b" " * (-len(header_bytes) % 8)  # The data starts 8-byte aligned
+        self.data_start = 8 + len(header_bytes)
+        self.remaining = set(self.offsets)
+        self.fd = os.open(f"{self.filename}.tmp", os.O_CREAT | os.O_TRUNC | os.O_WRONLY, 0o644)
+        os.pwrite(self.fd, len(header_bytes).to_bytes(8, "little") + header_bytes, 0)
+        os.ftruncate(self.fd, self.data_start + offset)
+
+    def write(self, key, tensor):
+        offset, nbytes = self.offsets[key]
+        tensor = tensor.detach().to(device="cpu").contiguous()
+        assert tensor.numel() * tensor.element_size() == nbytes, f"Wrong size for {key}"
+        if nbytes > 0:
+            data = memoryview(tensor.view(-1).view(torch.uint8).numpy())
+            written = 0
+            while written < nbytes:
+                written += os.pwrite(self.fd, data[written:], self.data_start + offset + written)
+        self.remaining.discard(key)
+
+    def close(self):
+        assert not self.remaining, f"Tensors {sorted(self.remaining)} were not written"
+        os.fsync(self.fd)
+        os.close(self.fd)
+        os.replace(f"{self.filename}.tmp", self.filename)
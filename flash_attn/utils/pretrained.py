@@ -11,8 +11,14 @@ from transformers.utils import (
 )
 from transformers.utils.hub import cached_file, get_checkpoint_shard_files
 
+from flash_attn.utils.lazy_load import lazy_load_file
 
-def state_dict_from_pretrained(model_name, device=None, dtype=None):
+
+def state_dict_from_pretrained(model_name, device=None, dtype=None, lazy=False):
+    """If lazy, the tensors of the state dict are LazyTensors: the files are memory-mapped, and
+    each tensor is only read (then converted to dtype and moved to device) when it's copied into
+    a parameter by model.load_state_dict. The remap_state_dict_* functions work on them as well.
+    """
     # If not fp32, then we don't want to load directly to the GPU
     mapped_device = "cpu" if dtype not in [torch.float32, None] else device
     is_sharded = False
@@ -56,7 +62,9 @@ def state_dict_from_pretrained(model_name, device=None, dtype=None):
     if resolved_archive_file is None:
         raise EnvironmentError(f"Model name {model_name} was not found.")
 
-    if load_safe:
+    if lazy:
+        loader = lazy_load_file
+    elif load_safe:
         loader = partial(safe_load_file, device=mapped_device)
     else:
         loader = partial(torch.load, map_location=mapped_device, weights_only=True)
@@ -0,0 +1,349 @@
+import itertools
+from collections import OrderedDict, deque
+from dataclasses import dataclass, field
+from typing import Collection, List, Optional, Sequence, Set
+
+import torch
+from torch import Tensor
+
+from flash_attn.utils.generation import InferenceParams, sample
+from flash_attn.utils.kv_cache import KVSwapSpace, PagedKVCache
+
+
+@dataclass
+class GenerationRequest:
+    request_id: int
+    prompt_ids: List[int]
+    # Total length (prompt + generated tokens) at which generation stops, as in decode()
+    max_length: int
+    # Sampling parameters of this request, None to use the scheduler's
+    top_k: Optional[int] = None
+    top_p: Optional[float] = None
+    temperature: Optional[float] = None
+    # Generation also stops at any of these tokens, on top of the scheduler's eos_token_id
+    stop_token_ids: Set[int] = field(default_factory=set)
+    output_ids: List[int] = field(default_factory=list)
+    finished: bool = False
+    # Number of times the request was preempted, and how many of those were swapped out rather
+    # than recomputed
+    num_preemptions: int = 0
+    num_swaps: int = 0
+
+    @property
+    def token_ids(self) -> List[int]:
+        return self.prompt_ids + self.output_ids
+
+
+class ContinuousBatchingScheduler:
+    """Iteration-level scheduler for generation: requests join and leave the running batch at
+    every step, instead of the whole batch waiting for its longest sequence as in decode().
+
+    Each running request owns a slot, i.e. a row of the KV cache. A step runs a single forward on
+    a packed batch (see InferenceParams.cu_seqlens_q) that mixes one token for each request that
+    is decoding with chunks of at most prefill_chunk_size prompt tokens for requests that are
+    still being prefilled, such that the step processes at most max_tokens_per_step tokens.
+    Decoding tokens are scheduled first, so a long prompt that arrives only delays the next token
+    of the other requests by the time it takes to process one chunk. Waiting requests are admitted
+    first-come first-served while there are free slots and tokens left in the budget. A request
+    leaves the batch, and frees its slot, as soon as it samples eos_token_id or one of its
+    stop_token_ids, or reaches its max_length. Requests can have their own sampling parameters,
+    which are passed per row to sample(), so they still share the batch.
+
+    If paged_kv_cache is given, slots are rows of its page table and pages are only taken for the
+    tokens each request actually has. When a decoding token doesn't fit, the most recently
+    admitted requests are preempted: their pages are freed and they go back to the front of the
+    queue. If swap_space has room, their KV is swapped out to the host and swapped back in when
+    they're readmitted; otherwise they're recomputed (prompt + tokens generated so far).
+
+    Arguments:
+        model: a model with allocate_inference_cache that supports packed batches, e.g.
+            GPTLMHeadModel.
+        max_batch_size: int. Number of slots, i.e. maximum number of running requests.
+        max_seqlen: int. Maximum length (prompt + generated tokens) of a request.
+        max_tokens_per_step: int. Budget of tokens (decoded tokens + prompt tokens) per step.
+            Defaults to max(max_seqlen, max_batch_size). It must be at least max_batch_size, so
+            that every decoding request gets its token at each step and none is starved.
+        prefill_chunk_size: int. Maximum number of prompt tokens of a request per step. Defaults
+            to max_tokens_per_step.
+        paged_kv_cache (optional): PagedKVCache to store the KV cache in.
+        swap_space (optional): KVSwapSpace over paged_kv_cache, to swap out preempted requests.
+    """
+
+    def __init__(
+        self,
+        model,
+        max_batch_size: int,
+        max_seqlen: int,
+        max_tokens_per_step: Optional[int] = None,
+        prefill_chunk_size: Optional[int] = None,
+        top_k=1,
+        top_p=0.0,
+        temperature=1.0,
+        eos_token_id=None,
+        vocab_size=None,
+        paged_kv_cache: Optional[PagedKVCache] = None,
+        swap_space: Optional[KVSwapSpace] = None,
+        dtype=None,
+    ):
+        self.model = model
+        self.max_batch_size = max_batch_size
+        self.max_seqlen = max_seqlen
+        self.max_tokens_per_step = (
+            max_tokens_per_step
+            if max_tokens_per_step is not None
+            else max(max_seqlen, max_batch_size)
+        )
+        self.prefill_chunk_size = (
+            prefill_chunk_size if prefill_chunk_size is not None else self.max_tokens_per_step
+        )
+        assert self.max_tokens_per_step > 0 and self.prefill_chunk_size > 0
+        assert (
+            self.max_tokens_per_step >= max_batch_size
+        ), "max_tokens_per_step must fit one decoding token of each slot"
+        self.top_k, self.top_p, self.temperature = top_k, top_p, temperature
+        self.eos_token_id = eos_token_id
+        self.vocab_size = vocab_size
+        self.paged_kv_cache = paged_kv_cache
+        self.swap_space = swap_space
+        if swap_space is not None:
+            assert swap_space.paged_kv_cache is paged_kv_cache
+        self.inference_params = InferenceParams(
+            max_seqlen=max_seqlen, max_batch_size=max_batch_size
+        )
+        if paged_kv_cache is not None:
+            assert max_batch_size <= paged_kv_cache.max_batch_size
+            assert max_seqlen <= paged_kv_cache.max_seqlen
+            self.inference_params.key_value_memory_dict = paged_kv_cache.kv_cache
+            self.inference_params.kv_scales = paged_kv_cache.kv_scales
+            self.device = paged_kv_cache.device
+        else:
+            self.inference_params.key_value_memory_dict = model.allocate_inference_cache(
+                max_batch_size, max_seqlen, dtype=dtype
+            )
+            self.device = next(iter(self.inference_params.key_value_memory_dict.values())).device
+        self.waiting: deque = deque()
+        # request_id -> (request, slot), in admission order
+        self.running: "OrderedDict[int, tuple]" = OrderedDict()
+        # Stack of free slots, popped from the end so that low slots are handed out first.
+        self._free_slots: List[int] = list(range(max_batch_size - 1, -1, -1))
+        # Number of tokens in the KV cache of each slot
+        self._cache_seqlens: List[int] = [0] * max_batch_size
+        self._next_request_id = 0
+
+    def add_request(
+        self,
+        prompt_ids: Sequence[int],
+        max_length: int,
+        top_k: Optional[int] = None,
+        top_p: Optional[float] = None,
+        temperature: Optional[float] = None,
+        stop_token_ids: Optional[Collection[int]] = None,
+    ) -> GenerationRequest:
+        """The sampling parameters default to the scheduler's."""
+        assert 0 < len(prompt_ids) < max_length <= self.max_seqlen
+        request = GenerationRequest(
+            self._next_request_id,
+            list(prompt_ids),
+            max_length,
+            top_k=top_k,
+            top_p=top_p,
+            temperature=temperature,
+            stop_token_ids=set(stop_token_ids) if stop_token_ids is not None else set(),
+        )
+        self._next_request_id += 1
+        self.waiting.append(request)
+        return request
+
+    def has_unfinished(self) -> bool:
+        return bool(self.waiting) or bool(self.running)
+
+    def _forward(self, schedule: List[tuple]) -> Tensor:
+        """Run the model on one packed batch. schedule is a list of (request, slot, num_tokens):
+        the next num_tokens tokens of each request that aren't in its KV cache yet.
+        Return the logits of the last token of each request.
+        """
+        inference_params = self.inference_params
+        token_ids, position_ids, seqlens_q = [], [], []
+        for request, slot, num_tokens in schedule:
+            cache_seqlen = self._cache_seqlens[slot]
+            token_ids.extend(request.token_ids[cache_seqlen : cache_seqlen + num_tokens])
+            position_ids.extend(range(cache_seqlen, cache_seqlen + num_tokens))
+            seqlens_q.append(num_tokens)
+        slots = torch.tensor([slot for _, slot, _ in schedule], dtype=torch.int32)
+        if self.paged_kv_cache is not None:
+            inference_params.page_table = self.paged_kv_cache.page_table[slots.long()]
+        else:
+            inference_params.cache_batch_idx = slots.to(self.device)
+        inference_params.lengths_per_sample = torch.tensor(
+            [self._cache_seqlens[slot] for _, slot, _ in schedule],
+            dtype=torch.int32,
+            device=self.device,
+        )
+        inference_params.cu_seqlens_q = torch.tensor(
+            [0] + list(itertools.accumulate(seqlens_q)), dtype=torch.int32, device=self.device
+        )
+        inference_params.max_seqlen_q = max(seqlens_q)
+        logits = self.model(
+            torch.tensor([token_ids], dtype=torch.long, device=self.device),
+            position_ids=torch.tensor([position_ids], dtype=torch.long, device=self.device),
+            inference_params=inference_params,
+            num_last_tokens=1,
+        ).logits.squeeze(dim=0)
+        for _, slot, num_tokens in schedule:
+            self._cache_seqlens[slot] += num_tokens
+        return logits[..., : self.vocab_size] if self.vocab_size is not None else logits
+
+    def _sample(self, logits: Tensor, requests: List[GenerationRequest]) -> List[int]:
+        params = [
+            (
+                request.top_k if request.top_k is not None else self.top_k,
+                request.top_p if request.top_p is not None else self.top_p,
+                request.temperature if request.temperature is not None else self.temperature,
+            )
+            for request in requests
+        ]
+        if all(p == params[0] for p in params):
+            top_k, top_p, temperature = params[0]
+        else:
+            top_k, top_p, temperature = (
+                torch.tensor(values, device=logits.device) for values in zip(*params)
+            )
+        return sample(logits, top_k=top_k, top_p=top_p, temperature=temperature).tolist()
+
+    def _append_token(self, request: GenerationRequest, token: int) -> bool:
+        request.output_ids.append(token)
+        request.finished = (
+            (self.eos_token_id is not None and token == self.eos_token_id)
+            or token in request.stop_token_ids
+            or len(request.prompt_ids) + len(request.output_ids) >= request.max_length
+        )
+        return request.finished
+
+    def _release(self, request: GenerationRequest):
+        _, slot = self.running.pop(request.request_id)
+        self._cache_seqlens[slot] = 0
+        if self.paged_kv_cache is not None:
+            self.paged_kv_cache.free(slot)
+        self._free_slots.append(slot)
+
+    def _preempt(self, request: GenerationRequest):
+        """Free the slot and pages of @request and put it back at the front of the queue. Since
+        we preempt the most recently admitted requests first, this keeps the queue in order.
+        """
+        _, slot = self.running[request.request_id]
+        num_tokens = self._cache_seqlens[slot]
+        if (
+            self.swap_space is not None
+            and num_tokens > 0
+            and self.swap_space.can_swap_out(num_tokens)
+        ):
+            self.swap_space.swap_out(request.request_id, slot, num_tokens)
+            request.num_swaps += 1
+        self._release(request)
+        request.num_preemptions += 1
+        self.waiting.appendleft(request)
+
+    def _reserve(self, slot: int, seqlen: int) -> bool:
+        """Make sure that @slot has pages for @seqlen tokens, evicting cached prefixes if needed.
+        Return False if there aren't enough pages.
+        """
+        paged_kv_cache = self.paged_kv_cache
+        if paged_kv_cache is None:
+            return True
+        if not paged_kv_cache.can_reserve(slot, seqlen) and paged_kv_cache.evict_fn is not None:
+            num_new = paged_kv_cache.num_pages_needed(seqlen) - len(paged_kv_cache.pages(slot))
+            paged_kv_cache.evict_fn(num_new - paged_kv_cache.num_free_pages)
+        if not paged_kv_cache.can_reserve(slot, seqlen):
+            return False
+        paged_kv_cache.reserve(slot, seqlen)
+        return True
+
+    def _schedule(self) -> List[tuple]:
+        """Pick the tokens to process in the next step, as a list of (request, slot, num_tokens)."""
+        schedule, budget = [], self.max_tokens_per_step
+        running = list(self.running.values())
+        num_pending = lambda request, slot: len(request.token_ids) - self._cache_seqlens[slot]
+        # Decoding requests first, so that they're not stalled by long prompts. They're charged to
+        # the budget too, and always fit since max_tokens_per_step >= max_batch_size.
+        for request, slot in running:
+            if request.request_id not in self.running or num_pending(request, slot) != 1:
+                continue
+            while not self._reserve(slot, self._cache_seqlens[slot] + 1):
+                victim, _ = next(reversed(self.running.values()))
+                self._preempt(victim)
+                if victim is request:
+                    break
+            else:
+                schedule.append((request, slot, 1))
+                budget -= 1
+        # Then the next chunk of the prompts being prefilled, oldest first
+        for request, slot in running:
+            if budget <= 0:
+                break
+            if request.request_id not in self.running or num_pending(request, slot) <= 1:
+                continue
+            num_tokens = min(num_pending(request, slot), self.prefill_chunk_size, budget)
+            if self._reserve(slot, self._cache_seqlens[slot] + num_tokens):
+                schedule.append((request, slot, num_tokens))
+                budget -= num_tokens
+        # Then admit new requests
+        while self.waiting and self._free_slots and budget > 0:
+            request, slot = self.waiting[0], self._free_slots[-1]
+            num_swapped = (
+                self.swap_space.num_tokens(request.request_id)
+                if self.swap_space is not None
+                else 0
+            )
+            num_tokens = min(len(request.token_ids) - num_swapped, self.prefill_chunk_size, budget)
+            if not self._reserve(slot, num_swapped + num_tokens):
+                break
+            self.waiting.popleft()
+            self._free_slots.pop()
+            self.running[request.request_id] = (request, slot)
+            if num_swapped > 0:
+                self._cache_seqlens[slot] = self.swap_space.swap_in(request.request_id, slot)
+            schedule.append((request, slot, num_tokens))
+            budget -= num_tokens
+        if not schedule and self.has_unfinished():
+            # The pages are all held by partially prefilled requests: make room for the oldest
+            if len(self.running) <= 1:
+                raise RuntimeError("A single request needs more KV cache pages than the cache has")
+            victim, _ = next(reversed(self.running.values()))
+            self._preempt(victim)
+        return schedule
+
+    @torch.inference_mode()
+    def step(self) -> List[GenerationRequest]:
+        """Process one packed batch of decoding tokens and prompt chunks, and sample the next
+        token of each request whose tokens are now all in the KV cache.
+        Return the requests that finished during this step.
+        """
+        schedule = self._schedule()
+        if not schedule:
+            return []
+        logits = self._forward(schedule)
+        # Requests in the middle of their prompt don't sample a token
+        ready = [
+            i
+            for i, (request, slot, _) in enumerate(schedule)
+            if self._cache_seqlens[slot] == len(request.token_ids)
+        ]
+        if not ready:
+            return []
+        tokens = self._sample(
+            logits[torch.tensor(ready, device=logits.device)], [schedule[i][0] for i in ready]
+        )
+        finished = []
+        for i, token in zip(ready, tokens):
+            request = schedule[i][0]
+            if self._append_token(request, token):
+                self._release(request)
+                finished.append(request)
+        return finished
+
+    def generate(self, prompts: Sequence[Sequence[int]], max_length: int) -> List[List[int]]:
+        """Run every prompt to completion. Return prompt + generated tokens of each prompt."""
+        requests = [self.add_request(prompt_ids, max_length) for prompt_ids in prompts]
+        while self.has_unfinished():
+            self.step()
+        return [request.token_ids for request in requests]
@@ -0,0 +1,168 @@
+import queue
+import threading
+from typing import Callable, Iterator, List, Optional, Union
+
+import torch
+from torch import Tensor
+
+from flash_attn.utils.generation import decode
+
+# Marks the end of the stream in the queues
+_END = object()
+
+
+class TokenStreamer:
+    """Streams the tokens generated by decode() as they are sampled, instead of only returning
+    them once generation finishes.
+
+    decode() calls put() with the tokens of each step. put() starts copying them to the host
+    without waiting for them and hands them to a worker thread through a bounded queue, so the
+    next step is launched right away. The worker waits for the copy, detokenizes the new tokens
+    of each sequence if a tokenizer is given, and passes the outputs of the step to callback, or
+    else to the iterator over the streamer. If the worker falls more than max_queue_size steps
+    behind, put() blocks.
+
+    The outputs of a step are a list with, for each sequence, its new token ids, or its new text
+    if there is a tokenizer. Sequences that have stopped get [] (or ""). Text is only emitted
+    once it no longer ends with an incomplete character, and only the last few tokens are
+    decoded again at each step.
+
+    A streamer is used for a single call to decode().
+
+    Arguments:
+        tokenizer (optional): object with a decode(token_ids) -> str method, e.g. a HF tokenizer.
+        callback (optional): called with the outputs of each step, from the worker thread.
+        max_queue_size: int. Maximum number of steps waiting for the worker.
+    """
+
+    def __init__(
+        self,
+        tokenizer=None,
+        callback: Optional[Callable[[list], None]] = None,
+        max_queue_size: int = 16,
+    ):
+        self.tokenizer = tokenizer
+        self.callback = callback
+        self._steps: queue.Queue = queue.Queue(maxsize=max_queue_size)
+        # Not bounded, so that the worker never blocks if nobody iterates over the streamer
+        self._outputs: queue.Queue = queue.Queue()
+        self._token_ids: List[List[int]] = []
+        # Per sequence, the offsets of the tokens that are decoded again for context, and of the
+        # first token whose text hasn't been emitted yet
+        self._offsets: List[List[int]] = []
+        self._error: Optional[BaseException] = None
+        self._ended = False
+        self._worker = threading.Thread(target=self._run, name="token_streamer", daemon=True)
+        self._worker.start()
+
+    def put(self, tokens: Tensor, active: Optional[Tensor] = None):
+        """
+        Arguments:
+            tokens: (batch, num_tokens)
+            active (optional): (batch,) bool, the sequences the tokens are valid for.
+        """
+        if active is None:
+            active = torch.ones(tokens.shape[0], dtype=torch.bool, device=tokens.device)
+        event = None
+        if tokens.is_cuda:
+            # Copied to pinned memory, asynchronously
+            tokens = tokens.to("cpu", non_blocking=True)
+            active = active.to("cpu", non_blocking=True)
+            event = torch.cuda.Event()
+            event.record()
+        self._steps.put((tokens, active, event))
+
+    def end(self):
+        """Wait for the worker to process every step. Raise if it failed."""
+        if not self._ended:
+            self._ended = True
+            self._steps.put(_END)
+            self._worker.join()
+        if self._error is not None and self.callback is not None:
+            raise self._error
+
+    def __iter__(self) -> Iterator[Union[List[List[int]], List[str]]]:
+        while True:
+            outputs = self._outputs.get()
+            if outputs is _END:
+                break
+            if isinstance(outputs, BaseException):
+                raise outputs
+            yield outputs
+
+    def _run(self):
+        try:
+            while True:
+                step = self._steps.get()
+                if step is _END:
+                    break
+                tokens, active, event = step
+                if event is not None:
+                    event.synchronize()
+                outputs = self._process(tokens.tolist(), active.tolist())
+                if self.callback is not None:
+                    self.callback(outputs)
+                else:
+                    self._outputs.put(outputs)
+        except BaseException as e:
+            self._error = e
+            self._outputs.put(e)
+            # Don't let put() block forever
+            while self._steps.get() is not _END:
+                pass
+        self._outputs.put(_END)
+
+    def _process(self, tokens: List[List[int]], active: List[bool]) -> list:
+        if not self._token_ids:
+            self._token_ids = [[] for _ in tokens]
+            self._offsets = [[0, 0] for _ in tokens]
+        outputs = []
+        for i, (new_tokens, is_active) in enumerate(zip(tokens, active)):
+            if not is_active:
+                outputs.append("" if self.tokenizer is not None else [])
+                continue
+            self._token_ids[i].extend(new_tokens)
+            outputs.append(self._detokenize(i) if self.tokenizer is not None else new_tokens)
+        return outputs
+
+    def _detokenize(self, i: int) -> str:
+        # Decode the new tokens together with the previous few, since the text of a token can
+        # depend on the tokens before it (e.g. leading spaces, multi-byte characters)
+        token_ids = self._token_ids[i]
+        prefix_offset, read_offset = self._offsets[i]
+        prefix_text = self.tokenizer.decode(token_ids[prefix_offset:read_offset])
+        text = self.tokenizer.decode(token_ids[prefix_offset:])
+        if len(text) > len(prefix_text) and not text.endswith("\ufffd"):
+            self._offsets[i] = [read_offset, len(token_ids)]
+            return text[len(prefix_text) :]
+        return ""
+
+
+def decode_stream(
+    input_ids,
+    model,
+    max_length,
+    tokenizer=None,
+    max_queue_size: int = 16,
+    **kwargs,
+) -> Iterator[Union[List[List[int]], List[str]]]:
+    """Run decode() in a background thread and yield the outputs of each step as they come, as
+    described in TokenStreamer. The other arguments are passed to decode().
+    """
+    streamer = TokenStreamer(tokenizer, max_queue_size=max_queue_size)
+    error = []
+
+    def run():
+        try:
+            decode(input_ids, model, max_length, streamer=streamer, **kwargs)
+        except BaseException as e:
+            error.append(e)
+        finally:
+            streamer.end()
+
+    thread = threading.Thread(target=run, name="decode_stream", daemon=True)
+    thread.start()
+    yield from streamer
+    thread.join()
+    if error:
+        raise error[0]
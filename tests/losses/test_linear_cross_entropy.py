@@ -0,0 +1,52 @@
+import pytest
+import torch
+import torch.nn.functional as F
+
+from flash_attn.losses.cross_entropy import FusedLinearCrossEntropyLoss
+
+
+@pytest.mark.parametrize("reduction", ["mean", "none"])
+@pytest.mark.parametrize("has_bias", [False, True])
+@pytest.mark.parametrize("lse_square_scale", [0.0, 1e-2])
+@pytest.mark.parametrize("logit_scale", [1.0, 0.7])
+@pytest.mark.parametrize("smoothing", [0.0, 0.9])
+def test_linear_cross_entropy_loss(smoothing, logit_scale, lse_square_scale, has_bias, reduction):
+    torch.manual_seed(0)
+    n_tokens, hidden_dim, vocab_size = 100, 32, 1000
+    x = torch.randn(n_tokens, hidden_dim, requires_grad=True)
+    weight = (torch.randn(vocab_size, hidden_dim) / hidden_dim**0.5).requires_grad_()
+    bias = torch.randn(vocab_size, requires_grad=True) if has_bias else None
+    target = torch.randint(0, vocab_size, (n_tokens,))
+    target[torch.randperm(n_tokens)[:10]] = -100
+    x_pt = x.detach().clone().requires_grad_()
+    weight_pt = weight.detach().clone().requires_grad_()
+    bias_pt = bias.detach().clone().requires_grad_() if has_bias else None
+    # Chunks that don't divide the number of tokens and the vocab size
+    loss_fn = FusedLinearCrossEntropyLoss(
+        label_smoothing=smoothing,
+        logit_scale=logit_scale,
+        lse_square_scale=lse_square_scale,
+        reduction=reduction,
+        return_z_loss=True,
+        chunk_size_tokens=32,
+        chunk_size_vocab=300,
+    )
+    loss, z_loss = loss_fn(x, weight, bias, target)
+
+    logits = F.linear(x_pt, weight_pt, bias_pt) * logit_scale
+    loss_pt = F.cross_entropy(logits, target, label_smoothing=smoothing, reduction="none")
+    z_loss_pt = lse_square_scale * torch.logsumexp(logits, dim=-1).square()
+    z_loss_pt = z_loss_pt.masked_fill(target == -100, 0.0)
+    loss_pt = loss_pt + z_loss_pt
+    if reduction == "mean":
+        num_valid = (target != -100).sum()
+        loss_pt, z_loss_pt = loss_pt.sum() / num_valid, z_loss_pt.sum() / num_valid
+    assert torch.allclose(loss, loss_pt, atol=1e-5)
+    assert torch.allclose(z_loss, z_loss_pt, atol=1e-5)
+    g = torch.randn_like(loss)
+    loss.backward(g)
+    loss_pt.backward(g)
+    assert torch.allclose(x.grad, x_pt.grad, atol=1e-5)
+    assert torch.allclose(weight.grad, weight_pt.grad, atol=1e-5)
+    if has_bias:
+        assert torch.allclose(bias.grad, bias_pt.grad, atol=1e-5)
@@ -2,15 +2,20 @@ import re
 
 import pytest
 import torch
+import torch.nn.functional as F
 from einops import rearrange
+from flash_attn.losses.cross_entropy import FusedLinearCrossEntropyLoss
 from flash_attn.models.gpt import (
     GPTLMHeadModel,
     remap_state_dict_hf_gpt2,
     shard_state_dict_tp,
     combine_state_dicts_tp,
+    reshard_checkpoint_tp,
 )
 from flash_attn.utils.generation import InferenceParams
 from flash_attn.utils.pretrained import state_dict_from_pretrained
+from safetensors.torch import load_file as safe_load_file
+from safetensors.torch import save_file as safe_save_file
 from transformers import GPT2Config, GPT2Tokenizer
 from transformers.models.gpt2.modeling_gpt2 import GPT2LMHeadModel as GPT2LMHeadModelHF
 
@@ -476,3 +481,195 @@ def test_gpt2_shard_unshard(n_heads_q_kv):
         ref = state_dict[k]
         new = state_dict[k]
         assert torch.allclose(ref, new, atol=0.0, rtol=0.0)
+
+
+@pytest.mark.parametrize("activation", ["gelu_new", "swiglu"])
+@pytest.mark.parametrize("n_heads_q_kv", [(8, 8), (8, 4)])
+@pytest.mark.parametrize("world_sizes", [(1, 2), (2, 4), (4, 2), (2, 1)])
+def test_gpt2_reshard_checkpoint_tp(tmp_path, world_sizes, n_heads_q_kv, activation):
+    world_size_in, world_size_out = world_sizes
+    config = GPT2Config(
+        n_embd=64, n_layer=2, vocab_size=128, n_positions=128, activation_function=activation
+    )
+    config.n_head, config.n_head_kv = n_heads_q_kv
+    state_dict = GPTLMHeadModel(config).state_dict()
+
+    def shards(world_size):
+        if world_size == 1:
+            return [state_dict]
+        return [
+            shard_state_dict_tp(dict(state_dict), config, world_size, rank)
+            for rank in range(world_size)
+        ]
+
+    input_files = [tmp_path / f"in_{rank}.safetensors" for rank in range(world_size_in)]
+    for filename, shard in zip(input_files, shards(world_size_in)):
+        shard = {k: v.clone(memory_format=torch.contiguous_format) for k, v in shard.items()}
+        safe_save_file(shard, filename)
+    output_files = [tmp_path / f"out_{rank}.safetensors" for rank in range(world_size_out)]
+    reshard_checkpoint_tp(input_files, output_files, config, num_threads=4)
+    for filename, shard_ref in zip(output_files, shards(world_size_out)):
+        shard = safe_load_file(filename)
+        assert shard.keys() == shard_ref.keys()
+        for k in shard:
+            assert torch.equal(shard[k], shard_ref[k]), k
+
+
+@pytest.mark.parametrize("device", ["cpu", "cuda"])
+@pytest.mark.parametrize("rotary", [False, True])
+@pytest.mark.parametrize("n_head_kv", [4, 1])
+def test_gpt2_packed_sequences(n_head_kv, rotary, device):
+    """Sequences packed with cu_seqlens give the same logits as each sequence on its own."""
+    if device == "cuda" and not torch.cuda.is_available():
+        pytest.skip("CUDA is not available")
+    if device == "cpu" and rotary:
+        pytest.skip("The rotary embedding kernel needs CUDA")
+    dtype = torch.float32 if device == "cpu" else torch.float16
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    config.n_head_kv = n_head_kv
+    config.rotary_emb_fraction = 0.5 if rotary else 0.0
+    config.use_flash_attn = device == "cuda"
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    # Two rows of 32 tokens, a sequence can't cross from one row to the next
+    seqlens = [10, 3, 19, 7, 20, 5]
+    cu_seqlens = torch.cumsum(torch.tensor([0] + seqlens), dim=0).to(device, torch.int32)
+    input_ids = torch.randint(0, config.vocab_size, (2, 32), device=device)
+    with torch.no_grad():
+        logits = model(input_ids, cu_seqlens=cu_seqlens, max_seqlen=max(seqlens)).logits
+        logits = rearrange(logits, "b s d -> (b s) d")
+        for start, end in zip(cu_seqlens[:-1].tolist(), cu_seqlens[1:].tolist()):
+            logits_ref = model(rearrange(input_ids, "b s -> 1 (b s)")[:, start:end]).logits[0]
+            assert torch.allclose(
+                logits[start:end], logits_ref, atol=1e-2 if device == "cuda" else 1e-5
+            )
+
+
+def test_gpt2_fused_loss():
+    """The loss fused with the LM head matches cross entropy on the logits, with its gradients."""
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    config.lse_square_scale = 1e-2
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config)
+    input_ids = torch.randint(0, config.vocab_size, (2, 32))
+    labels = torch.roll(input_ids, -1, dims=1)
+    labels[:, -1] = -100
+    loss = model(input_ids, labels=labels).loss
+    loss.backward()
+    grads = {name: p.grad for name, p in model.named_parameters()}
+    model.zero_grad()
+    logits = rearrange(model(input_ids).logits, "b s d -> (b s) d").float()
+    valid = rearrange(labels, "b s -> (b s)") != -100
+    loss_ref = F.cross_entropy(logits[valid], rearrange(labels, "b s -> (b s)")[valid])
+    loss_ref = loss_ref + 1e-2 * torch.logsumexp(logits[valid], dim=-1).square().mean()
+    loss_ref.backward()
+    assert torch.allclose(loss, loss_ref, atol=1e-5)
+    for name, p in model.named_parameters():
+        assert torch.allclose(grads[name], p.grad, atol=1e-5), name
+
+
+@pytest.mark.parametrize("use_alibi", [False, True])
+def test_gpt2_lengths_per_sample_flash(use_alibi, monkeypatch):
+    """Decoding sequences of different lengths with use_flash_attn=True, when
+    flash_attn_with_kvcache isn't available, falls back to the reference attention with a key
+    padding mask.
+    """
+    if not torch.cuda.is_available():
+        pytest.skip("CUDA is not available")
+    import flash_attn.modules.mha
+
+    monkeypatch.setattr(flash_attn.modules.mha, "flash_attn_with_kvcache", None)
+    device, dtype = "cuda", torch.float16
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    config.use_flash_attn = True
+    config.use_alibi = use_alibi
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    seqlens = [5, 9]
+    input_ids = torch.randint(0, config.vocab_size, (2, max(seqlens) + 1), device=device)
+    inference_params = InferenceParams(max_seqlen=32, max_batch_size=2)
+    with torch.no_grad():
+        # The prefill of the shorter sequence writes garbage past its end, which the decoding
+        # step overwrites.
+        model(input_ids[:, : max(seqlens)], inference_params=inference_params)
+        inference_params.seqlen_offset = max(seqlens)
+        lengths_per_sample = torch.tensor(seqlens, dtype=torch.int32, device=device)
+        inference_params.lengths_per_sample = lengths_per_sample
+        positions = rearrange(lengths_per_sample.long(), "b -> b 1")
+        next_ids = torch.gather(input_ids, 1, positions)
+        logits = model(
+            next_ids, position_ids=positions, inference_params=inference_params
+        ).logits[:, -1]
+        for i, seqlen in enumerate(seqlens):
+            logits_ref = model(input_ids[i : i + 1, : seqlen + 1]).logits[0, -1]
+            assert torch.allclose(logits[i], logits_ref, atol=1e-2)
+
+
+@pytest.mark.parametrize("varlen_kernel", [False, True])
+@pytest.mark.parametrize("use_alibi", [False, True])
+def test_gpt2_varlen_kvcache_flash(use_alibi, varlen_kernel, monkeypatch):
+    """Chunks of sequences packed with inference_params.cu_seqlens_q, with use_flash_attn=True,
+    give the same logits as each sequence on its own. Without the varlen kernel, or with ALiBi
+    which it doesn't take, this falls back to the reference attention.
+    """
+    if not torch.cuda.is_available():
+        pytest.skip("CUDA is not available")
+    import flash_attn.modules.mha
+
+    if not varlen_kernel:
+        monkeypatch.setattr(flash_attn.modules.mha, "flash_attn_varlen_with_kvcache", None)
+    elif flash_attn.modules.mha.flash_attn_varlen_with_kvcache is None:
+        pytest.skip("flash_attn_interface is not installed")
+    device, dtype = "cuda", torch.float16
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    config.use_flash_attn = True
+    config.use_alibi = use_alibi
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    input_ids = torch.randint(0, config.vocab_size, (2, 8), device=device)
+    inference_params = InferenceParams(max_seqlen=32, max_batch_size=2)
+    inference_params.key_value_memory_dict = model.allocate_inference_cache(2, 32, dtype=dtype)
+    inference_params.cache_batch_idx = torch.arange(2, dtype=torch.int32, device=device)
+    # Each step processes the tokens [start, end) of each sequence
+    steps = [((0, 5), (0, 3)), ((5, 7), (3, 8))]
+    with torch.no_grad():
+        for step in steps:
+            inference_params.lengths_per_sample = torch.tensor(
+                [start for start, _ in step], dtype=torch.int32, device=device
+            )
+            seqlens_q = [end - start for start, end in step]
+            inference_params.cu_seqlens_q = torch.tensor(
+                [0, seqlens_q[0], sum(seqlens_q)], dtype=torch.int32, device=device
+            )
+            inference_params.max_seqlen_q = max(seqlens_q)
+            token_ids = torch.cat([input_ids[i, start:end] for i, (start, end) in enumerate(step)])
+            position_ids = torch.cat([torch.arange(start, end) for start, end in step])
+            logits = model(
+                rearrange(token_ids, "t -> 1 t"),
+                position_ids=rearrange(position_ids, "t -> 1 t").to(device),
+                inference_params=inference_params,
+            ).logits[0]
+            for i, (start, end) in enumerate(step):
+                logits_ref = model(input_ids[i : i + 1, :end]).logits[0, start:]
+                cu_start = sum(seqlens_q[:i])
+                assert torch.allclose(
+                    logits[cu_start : cu_start + end - start], logits_ref, atol=1e-2
+                )
+
+
+def test_gpt2_fused_loss_fn():
+    """The loss_fn passed to the model is used for the fused loss, e.g. with label smoothing."""
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    torch.manual_seed(0)
+    model = GPTLMHeadModel(config)
+    input_ids = torch.randint(0, config.vocab_size, (2, 32))
+    labels = torch.roll(input_ids, -1, dims=1)
+    labels[:, -1] = -100
+    loss_fn = FusedLinearCrossEntropyLoss(label_smoothing=0.1, chunk_size_tokens=16)
+    loss = model(input_ids, labels=labels, loss_fn=loss_fn).loss
+    logits = rearrange(model(input_ids).logits, "b s d -> (b s) d").float()
+    loss_ref = F.cross_entropy(logits, rearrange(labels, "b s -> (b s)"), label_smoothing=0.1)
+    assert torch.allclose(loss, loss_ref, atol=1e-5)
@@ -0,0 +1,30 @@
+import pytest
+import torch
+
+from flash_attn.modules.mha import CrossAttention, SelfAttention, get_alibi_slopes
+
+
+@pytest.mark.parametrize("slopes_per_batch", [False, True])
+@pytest.mark.parametrize("causal", [False, True])
+def test_self_attention_alibi(causal, slopes_per_batch):
+    torch.manual_seed(0)
+    batch_size, seqlen, nheads, d = 2, 37, 4, 16
+    alibi_slopes = torch.tensor(get_alibi_slopes(nheads))
+    if slopes_per_batch:
+        alibi_slopes = torch.stack([alibi_slopes, 2 * alibi_slopes])
+    qkv = torch.randn(batch_size, seqlen, 3, nheads, d)
+    attn = SelfAttention(causal=causal, alibi_slopes=alibi_slopes)
+    attn_ref = CrossAttention(causal=causal, alibi_slopes=alibi_slopes)
+    out = attn(qkv)
+    out_ref = attn_ref(qkv[:, :, 0], qkv[:, :, 1:])
+    assert torch.allclose(out, out_ref, rtol=1e-5, atol=1e-6)
+
+    # With right padding, the tokens that are kept get the same output as without the padding
+    lengths = [seqlen, 23]
+    key_padding_mask = torch.arange(seqlen) < torch.tensor(lengths)[:, None]
+    out = attn(qkv, key_padding_mask=key_padding_mask)
+    for b, length in enumerate(lengths):
+        slopes_b = alibi_slopes[b : b + 1] if slopes_per_batch else alibi_slopes
+        attn_b = SelfAttention(causal=causal, alibi_slopes=slopes_b)
+        out_b = attn_b(qkv[b : b + 1, :length])
+        assert torch.allclose(out[b, :length], out_b[0], rtol=1e-5, atol=1e-6)
@@ -0,0 +1,53 @@
+import os
+import socket
+
+import pytest
+import torch
+import torch.distributed as dist
+import torch.multiprocessing as mp
+
+from flash_attn.modules.mha import MHA, ParallelMHA
+from flash_attn.utils.distributed import allreduce_sequence_parallel_grad, sync_shared_params
+
+
+def _mha_ulysses(rank, world_size, port, num_heads_kv, causal):
+    os.environ["MASTER_ADDR"] = "127.0.0.1"
+    os.environ["MASTER_PORT"] = str(port)
+    dist.init_process_group("gloo", rank=rank, world_size=world_size)
+    process_group = dist.group.WORLD
+    embed_dim, num_heads, batch_size, seqlen = 64, 8, 2, 32
+    torch.manual_seed(rank)  # Different weights on each rank, until sync_shared_params
+    model = ParallelMHA(
+        embed_dim, num_heads, process_group, num_heads_kv=num_heads_kv, causal=causal, ulysses=True
+    )
+    sync_shared_params(model, process_group)
+    model_ref = MHA(embed_dim, num_heads, num_heads_kv=num_heads_kv, causal=causal)
+    model_ref.load_state_dict(model.state_dict())
+
+    torch.manual_seed(0)
+    x_ref = torch.randn(batch_size, seqlen, embed_dim, requires_grad=True)
+    g = torch.randn(batch_size, seqlen, embed_dim)
+    out_ref = model_ref(x_ref)
+    out_ref.backward(g)
+
+    seqlen_local = seqlen // world_size
+    local = slice(rank * seqlen_local, (rank + 1) * seqlen_local)
+    x = x_ref[:, local].detach().clone().requires_grad_()
+    out = model(x)
+    out.backward(g[:, local])
+    allreduce_sequence_parallel_grad(model, process_group)
+    assert torch.allclose(out, out_ref[:, local], rtol=1e-4, atol=1e-5)
+    assert torch.allclose(x.grad, x_ref.grad[:, local], rtol=1e-4, atol=1e-5)
+    for (name, p), p_ref in zip(model.named_parameters(), model_ref.parameters()):
+        assert torch.allclose(p.grad, p_ref.grad, rtol=1e-4, atol=1e-5), name
+    dist.destroy_process_group()
+
+
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("num_heads_kv", [None, 4, 2])
+@pytest.mark.parametrize("world_size", [1, 2])
+def test_mha_ulysses_gloo(world_size, num_heads_kv, causal):
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        port = s.getsockname()[1]
+    mp.spawn(_mha_ulysses, args=(world_size, port, num_heads_kv, causal), nprocs=world_size)
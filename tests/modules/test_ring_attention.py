@@ -0,0 +1,88 @@
+import math
+import os
+import socket
+
+import pytest
+import torch
+import torch.distributed as dist
+import torch.multiprocessing as mp
+from einops import rearrange
+
+from flash_attn.modules import ring_attention
+from flash_attn.modules.ring_attention import ring_attn_func, zigzag_shard, zigzag_unshard
+
+
+def attention_ref(q, k, v, causal):
+    k, v = [x.repeat_interleave(q.shape[2] // k.shape[2], dim=2) for x in (k, v)]
+    scores = torch.einsum("bthd,bshd->bhts", q / math.sqrt(q.shape[-1]), k)
+    if causal:
+        mask = torch.ones(scores.shape[-2:], dtype=torch.bool).triu(1)
+        scores = scores.masked_fill(mask, float("-inf"))
+    return torch.einsum("bhts,bshd->bthd", torch.softmax(scores, dim=-1), v)
+
+
+def _ring_attn(rank, world_size, port, causal, nheads_k):
+    os.environ["MASTER_ADDR"] = "127.0.0.1"
+    os.environ["MASTER_PORT"] = str(port)
+    dist.init_process_group("gloo", rank=rank, world_size=world_size)
+    torch.manual_seed(0)
+    batch_size, seqlen, nheads, d = 2, 16 * world_size, 4, 32
+    q = torch.randn(batch_size, seqlen, nheads, d, requires_grad=True)
+    k, v = [torch.randn(batch_size, seqlen, nheads_k, d, requires_grad=True) for _ in range(2)]
+    g = torch.randn(batch_size, seqlen, nheads, d)
+    out_ref = attention_ref(q, k, v, causal)
+    dq_ref, dk_ref, dv_ref = torch.autograd.grad(out_ref, (q, k, v), g)
+
+    if causal:
+        shard = lambda x: zigzag_shard(x, world_size, rank)
+        unshard = zigzag_unshard
+    else:
+        shard = lambda x: x.chunk(world_size, dim=1)[rank]
+        unshard = lambda shards: torch.cat(shards, dim=1)
+    q_local, k_local, v_local = [shard(x.detach()).requires_grad_() for x in (q, k, v)]
+    out = ring_attn_func(q_local, k_local, v_local, causal=causal)
+    out.backward(shard(g))
+    for x, x_ref in [
+        (out, out_ref),
+        (q_local.grad, dq_ref),
+        (k_local.grad, dk_ref),
+        (v_local.grad, dv_ref),
+    ]:
+        shards = [torch.empty_like(x) for _ in range(world_size)]
+        dist.all_gather(shards, x.detach().contiguous())
+        assert torch.allclose(unshard(shards), x_ref, rtol=1e-4, atol=1e-5)
+    dist.destroy_process_group()
+
+
+@pytest.mark.parametrize("nheads_k", [4, 1])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("world_size", [1, 2, 4])
+def test_ring_attn_gloo(world_size, causal, nheads_k):
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        port = s.getsockname()[1]
+    mp.spawn(_ring_attn, args=(world_size, port, causal, nheads_k), nprocs=world_size)
+
+
+def test_zigzag_shard():
+    x = rearrange(torch.arange(24), "(b s) -> b s", b=2)
+    shards = [zigzag_shard(x, 3, rank) for rank in range(3)]
+    assert torch.equal(shards[0][0], torch.tensor([0, 1, 10, 11]))
+    assert torch.equal(zigzag_unshard(shards), x)
+
+
+@pytest.mark.skipif(
+    not torch.cuda.is_available() or ring_attention.flash_attn_combine is None,
+    reason="flash_attn_combine needs CUDA and FlashAttention 3 or the CuTe DSL implementation",
+)
+def test_merge_combine_vs_torch(monkeypatch):
+    torch.manual_seed(0)
+    batch_size, seqlen, nheads, d = 2, 77, 4, 64
+    out, block_out = [torch.randn(batch_size, seqlen, nheads, d, device="cuda") for _ in range(2)]
+    lse, block_lse = [torch.randn(batch_size, nheads, seqlen, device="cuda") for _ in range(2)]
+    new_out, new_lse = ring_attention._merge(out, lse, block_out, block_lse)
+    monkeypatch.setattr(ring_attention, "flash_attn_combine", None)
+    new_out_ref, new_lse_ref = ring_attention._merge(out, lse, block_out, block_lse)
+    assert new_out.dtype == torch.float32 and new_lse.shape == lse.shape
+    assert torch.allclose(new_lse, new_lse_ref, rtol=1e-5, atol=1e-5)
+    assert torch.allclose(new_out, new_out_ref, rtol=1e-4, atol=1e-5)
@@ -0,0 +1,111 @@
+import pytest
+import torch
+
+from flash_attn.ops.sampling import (
+    _sample_top_k_top_p_torch,
+    sample_top_k_top_p,
+    sample_top_k_top_p_fwd,
+)
+from flash_attn.utils.generation import (
+    modify_logits_for_top_k_filtering,
+    modify_logits_for_top_p_filtering,
+)
+
+devices = ["cpu"] + (["cuda"] if torch.cuda.is_available() else [])
+
+
+def probs_ref(logits, top_k, top_p, temperature):
+    """Sort-based reference: top-k, then temperature, then top-p."""
+    logits = logits.float().clone()
+    if top_k > 0:
+        modify_logits_for_top_k_filtering(logits, min(top_k, logits.shape[-1]))
+    logits /= temperature
+    modify_logits_for_top_p_filtering(logits, top_p)
+    return torch.softmax(logits, dim=-1)
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.bfloat16])
+@pytest.mark.parametrize("device", devices)
+def test_sample_top_k_top_p_greedy(device, dtype):
+    torch.random.manual_seed(0)
+    logits = torch.randn(8, 1000, device=device, dtype=dtype)
+    argmax = logits.argmax(dim=-1)
+    assert torch.equal(sample_top_k_top_p(logits, top_k=1, top_p=0.9), argmax)
+    assert torch.equal(sample_top_k_top_p(logits, top_k=50, temperature=0.0), argmax)
+
+
+@pytest.mark.parametrize(
+    "top_k, top_p, temperature",
+    [(0, 0.0, 1.0), (5, 0.0, 1.0), (0, 0.8, 0.7), (10, 0.5, 1.3), (100, 0.95, 1.0)],
+)
+@pytest.mark.parametrize("device", devices)
+def test_sample_top_k_top_p(device, top_k, top_p, temperature):
+    torch.random.manual_seed(0)
+    vocab_size, num_samples = 32, 20000
+    logits = torch.randn(vocab_size, device=device) * 2
+    probs = probs_ref(logits[None], top_k, top_p, temperature)[0]
+    tokens = sample_top_k_top_p(
+        logits.expand(num_samples, vocab_size), top_k=top_k, top_p=top_p, temperature=temperature
+    )
+    # Only the tokens kept by the filters are sampled, with the right frequencies
+    assert (probs[tokens] > 0).all()
+    freqs = torch.bincount(tokens, minlength=vocab_size).float() / num_samples
+    assert (freqs - probs).abs().max() < 0.02
+
+
+@pytest.mark.parametrize("device", devices)
+def test_sample_top_k_top_p_per_row(device):
+    torch.random.manual_seed(0)
+    batch, vocab_size, num_draws = 4, 50000, 20
+    logits = torch.randn(batch, vocab_size, device=device) * 3
+    top_k = torch.tensor([1, 0, 20, 1000], device=device)
+    top_p = torch.tensor([0.0, 0.5, 0.9, 0.0], device=device)
+    temperature = torch.tensor([1.0, 0.8, 1.0, 2.0], device=device)
+    kept = torch.stack(
+        [
+            probs_ref(logits[i : i + 1], top_k[i].item(), top_p[i].item(), temperature[i].item())[0]
+            > 0
+            for i in range(batch)
+        ]
+    )
+    for _ in range(num_draws):
+        tokens = sample_top_k_top_p(logits, top_k=top_k, top_p=top_p, temperature=temperature)
+        assert tokens[0] == logits[0].argmax()
+        assert kept[torch.arange(batch, device=device), tokens].all()
+
+
+@pytest.mark.skipif(
+    not torch.cuda.is_available() or sample_top_k_top_p_fwd is None,
+    reason="The Triton sampler needs CUDA",
+)
+@pytest.mark.parametrize(
+    "top_k, top_p, temperature",
+    [(1, 0.0, 1.0), (5, 0.0, 1.0), (0, 0.5, 0.7), (20, 0.9, 1.3), (1000, 0.3, 1.0)],
+)
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float16, torch.bfloat16])
+def test_sample_top_k_top_p_triton_vs_torch(dtype, top_k, top_p, temperature):
+    """The Triton kernel and the PyTorch path keep the same tokens and sample them with the same
+    frequencies. The vocab is larger than a block so the kernel loops over the row.
+    """
+    torch.random.manual_seed(0)
+    device = "cuda"
+    vocab_size, num_samples = 2000, 10000
+    logits = (torch.randn(vocab_size, device=device) * 3).to(dtype)
+    logits = logits.expand(num_samples, vocab_size)
+    params = [
+        torch.full((num_samples,), x, dtype=t, device=device)
+        for x, t in [(top_k, torch.int32), (top_p, torch.float32), (temperature, torch.float32)]
+    ]
+    seed = torch.tensor([0], device=device)
+    tokens = sample_top_k_top_p_fwd(logits, *params, seed)
+    generator = torch.Generator(device=device).manual_seed(0)
+    tokens_ref = _sample_top_k_top_p_torch(logits, *params, generator=generator)
+    if top_k == 1:
+        assert torch.equal(tokens, tokens_ref)
+        assert torch.equal(tokens, logits.argmax(dim=-1))
+    if dtype == torch.float32:  # No ties, so the sort-based reference keeps the same tokens
+        probs = probs_ref(logits[:1], top_k, top_p, temperature)[0]
+        assert (probs[tokens] > 0).all()
+    freqs = torch.bincount(tokens, minlength=vocab_size).float() / num_samples
+    freqs_ref = torch.bincount(tokens_ref, minlength=vocab_size).float() / num_samples
+    assert (freqs - freqs_ref).abs().max() < 0.025
@@ -0,0 +1,70 @@
+import pytest
+import torch
+import torch.nn.functional as F
+from einops import rearrange
+
+from flash_attn.bert_padding import unpad_input_for_concatenated_sequences
+
+
+def unpad_input_for_concatenated_sequences_ref(hidden_states, attention_mask_in_length):
+    batch, seqlen = attention_mask_in_length.shape
+    length = attention_mask_in_length.sum(dim=-1)
+    attention_mask_2d = torch.arange(seqlen, device=length.device) < rearrange(length, "b -> b 1")
+    indices = torch.nonzero(attention_mask_2d.flatten(), as_tuple=False).flatten()
+    lengths_flat = attention_mask_in_length.flatten()
+    seqlens_in_batch = lengths_flat[lengths_flat > 0]
+    cu_seqlens = F.pad(torch.cumsum(seqlens_in_batch, dim=0, dtype=torch.int32), (1, 0))
+    max_seqlen = seqlens_in_batch.max().item() if seqlens_in_batch.numel() > 0 else 0
+    hidden_states = rearrange(hidden_states, "b s ... -> (b s) ...")[indices]
+    return hidden_states, indices, cu_seqlens, max_seqlen
+
+
+def generate_attention_mask_in_length(batch, seqlen, zero_lengths, device):
+    attention_mask_in_length = torch.zeros(batch, seqlen, dtype=torch.int32, device=device)
+    for b in range(batch):
+        remaining = torch.randint(0, seqlen + 1, (1,)).item()
+        i = 0
+        while remaining > 0 and i < seqlen:
+            if zero_lengths and torch.rand(1).item() < 0.3:
+                i += 1  # Empty document, leaves a zero between two nonzero entries
+                continue
+            doc_len = torch.randint(1, remaining + 1, (1,)).item()
+            attention_mask_in_length[b, i] = doc_len
+            remaining -= doc_len
+            i += 1
+    return attention_mask_in_length
+
+
+@pytest.mark.parametrize("zero_lengths", [False, True])
+@pytest.mark.parametrize("seqlen", [1, 7, 128, 1000])
+@pytest.mark.parametrize("batch", [1, 5])
+def test_unpad_input_for_concatenated_sequences(batch, seqlen, zero_lengths):
+    device = "cpu"
+    torch.random.manual_seed(0)
+    hidden_states = torch.randn(batch, seqlen, 4, device=device)
+    attention_mask_in_length = generate_attention_mask_in_length(
+        batch, seqlen, zero_lengths, device
+    )
+    out, indices, cu_seqlens, max_seqlen = unpad_input_for_concatenated_sequences(
+        hidden_states, attention_mask_in_length
+    )
+    out_ref, indices_ref, cu_seqlens_ref, max_seqlen_ref = (
+        unpad_input_for_concatenated_sequences_ref(hidden_states, attention_mask_in_length)
+    )
+    assert torch.equal(indices, indices_ref)
+    assert torch.equal(cu_seqlens, cu_seqlens_ref)
+    assert cu_seqlens.dtype == torch.int32
+    assert max_seqlen == max_seqlen_ref
+    assert torch.equal(out, out_ref)
+
+
+def test_unpad_input_for_concatenated_sequences_empty():
+    hidden_states = torch.randn(3, 6, 4)
+    attention_mask_in_length = torch.zeros(3, 6, dtype=torch.int32)
+    out, indices, cu_seqlens, max_seqlen = unpad_input_for_concatenated_sequences(
+        hidden_states, attention_mask_in_length
+    )
+    assert out.shape == (0, 4)
+    assert indices.numel() == 0
+    assert cu_seqlens.tolist() == [0]
+    assert max_seqlen == 0
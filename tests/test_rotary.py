@@ -1,3 +1,4 @@
+import gc
 import math
 import random
 
@@ -9,7 +10,8 @@ from einops import rearrange
 import triton
 
 from flash_attn.layers.rotary import apply_rotary_emb, apply_rotary_emb_torch
-from flash_attn.layers.rotary import apply_rotary_emb_qkv_, apply_rotary_emb_kv_
+from flash_attn.layers.rotary import apply_rotary_emb_qkv_, apply_rotary_emb_kv_, RotaryEmbedding
+from flash_attn.layers.rotary import CosSinCache
 from flash_attn.bert_padding import pad_input, unpad_input
 
 is_sm8x = torch.cuda.get_device_capability("cuda") >= (8, 0)
@@ -319,3 +321,48 @@ def test_compilation_count():
         assert compilation_count == 2
     finally:
         JITFunction.cache_hook = old_cache_func
+
+
+@pytest.mark.parametrize("scaling_type", [None, "ntk", "yarn"])
+def test_rotary_cos_sin_cache(scaling_type):
+    dim, scaling_factor = 64, 4.0
+    kwargs = dict(scaling_type=scaling_type, scaling_factor=scaling_factor, original_max_seqlen=4096)
+    rotary = RotaryEmbedding(dim, **kwargs)
+    inv_freq_ref = RotaryEmbedding(dim).inv_freq
+    if scaling_type is not None:
+        # The highest frequency is kept, the lowest one is interpolated by scaling_factor
+        assert torch.allclose(rotary.inv_freq[0], inv_freq_ref[0])
+        assert torch.allclose(rotary.inv_freq[-1], inv_freq_ref[-1] / scaling_factor)
+    mscale = 0.1 * math.log(scaling_factor) + 1.0 if scaling_type == "yarn" else 1.0
+    cos, sin = rotary.cos_sin(100, dtype=torch.float32)
+    # The tables are shared between the modules with the same arguments
+    cos_long, sin_long = RotaryEmbedding(dim, **kwargs).cos_sin(300, dtype=torch.float32)
+    assert cos_long.shape[0] >= 300
+    assert torch.equal(cos_long[:100], cos[:100]) and torch.equal(sin_long[:100], sin[:100])
+    cos_again, _ = rotary.cos_sin(300, dtype=torch.float32)
+    assert cos_again.data_ptr() == cos_long.data_ptr()
+    freqs = torch.outer(torch.arange(cos_long.shape[0], dtype=torch.float32), rotary.inv_freq)
+    assert torch.allclose(cos_long, torch.cos(freqs) * mscale, atol=1e-5)
+    assert torch.allclose(sin_long, torch.sin(freqs) * mscale, atol=1e-5)
+    offsets = RotaryEmbedding.rotary_seqlens(7, 3)
+    assert offsets.dtype == torch.int32 and offsets.tolist() == [7, 7, 7]
+
+
+def test_rotary_cos_sin_cache_grow():
+    dim, base = 32, 12345.0
+    rotary = RotaryEmbedding(dim, base=base)
+    cos, _ = rotary.cos_sin(100, dtype=torch.float32)
+    cos_ref = cos.clone()
+    x = torch.randn(100, dim // 2, requires_grad=True)
+    out = x * cos[:100]  # cos is saved for backward
+    # Growing the tables allocates new ones, the tables that were handed out are left untouched
+    cos_long, _ = RotaryEmbedding(dim, base=base).cos_sin(1000, dtype=torch.float32)
+    assert cos_long.data_ptr() != cos.data_ptr() and torch.equal(cos, cos_ref)
+    out.sum().backward()
+    assert torch.equal(x.grad, cos_ref[:100])
+    # The cache is freed with the last module that uses it
+    is_cached = lambda: any(key[0][1] == base for key in list(CosSinCache._caches.keys()))
+    assert is_cached()
+    del rotary
+    gc.collect()
+    assert not is_cached()
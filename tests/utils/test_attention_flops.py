@@ -0,0 +1,48 @@
+import pytest
+import torch
+
+from flash_attn.utils.attention_flops import attended_pairs, attention_bytes, attention_flops
+
+
+def attended_pairs_ref(seqlen_q, seqlen_k, causal, window_size, attention_chunk):
+    row_idx = torch.arange(seqlen_q)[:, None] + seqlen_k - seqlen_q
+    col_idx = torch.arange(seqlen_k)
+    mask = torch.ones(seqlen_q, seqlen_k, dtype=torch.bool)
+    if window_size[0] >= 0:
+        mask &= col_idx >= row_idx - window_size[0]
+    if causal or window_size[1] >= 0:
+        mask &= col_idx <= row_idx + (0 if causal else window_size[1])
+    if attention_chunk > 0:
+        chunk_start = row_idx - row_idx % attention_chunk
+        mask &= (col_idx >= chunk_start) & (col_idx < chunk_start + attention_chunk)
+    return int(mask.sum())
+
+
+@pytest.mark.parametrize("attention_chunk", [0, 16])
+@pytest.mark.parametrize("window_size", [(-1, -1), (10, -1), (7, 3), (0, 0)])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 1), (37, 37), (64, 17), (17, 64), (1, 100)])
+def test_attended_pairs(seqlen_q, seqlen_k, causal, window_size, attention_chunk):
+    assert attended_pairs(
+        seqlen_q, seqlen_k, causal, window_size, attention_chunk
+    ) == attended_pairs_ref(seqlen_q, seqlen_k, causal, window_size, attention_chunk)
+
+
+def test_attention_flops_varlen():
+    nheads, headdim = 4, 64
+    cu_seqlens = torch.tensor([0, 100, 130, 230, 235], dtype=torch.int32)
+    flops = attention_flops(cu_seqlens, cu_seqlens, nheads, headdim, causal=True)
+    pairs = sum(s * (s + 1) // 2 for s in [100, 30, 100, 5])
+    assert flops == 2 * nheads * pairs * 2 * headdim
+    # Packing the 4 documents in one sequence would count 4x more pairs
+    flops_dense = attention_flops([0, 235], [0, 235], nheads, headdim, causal=True)
+    assert flops_dense > 3 * flops
+    assert attention_flops(cu_seqlens, cu_seqlens, nheads, headdim, mode="bwd") == 2.5 * (
+        attention_flops(cu_seqlens, cu_seqlens, nheads, headdim)
+    )
+    # GQA reads fewer bytes for K and V
+    nbytes = attention_bytes(cu_seqlens, cu_seqlens, nheads, 1, headdim)
+    assert nbytes == (235 * nheads * headdim * 2 + 235 * 2 * headdim) * 2
+    # The backward reads Q, K, V, dO and writes dQ, dK, dV
+    nbytes_bwd = attention_bytes(cu_seqlens, cu_seqlens, nheads, 1, headdim, mode="bwd")
+    assert nbytes_bwd == (235 * nheads * headdim * 3 + 235 * 2 * headdim * 2) * 2
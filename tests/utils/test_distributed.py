@@ -0,0 +1,56 @@
+import os
+import socket
+
+import pytest
+import torch
+import torch.distributed as dist
+import torch.multiprocessing as mp
+import torch.nn.functional as F
+
+from flash_attn.utils.distributed import all_gather_linear, linear_reduce_scatter
+
+
+def _chunked_linear(rank, world_size, port, num_chunks):
+    os.environ["MASTER_ADDR"] = "127.0.0.1"
+    os.environ["MASTER_PORT"] = str(port)
+    dist.init_process_group("gloo", rank=rank, world_size=world_size)
+    process_group = dist.group.WORLD
+    torch.manual_seed(0)
+    seqlen, in_features, hidden_features = 12 * world_size, 32, 16 * world_size
+    x_pt = torch.randn(seqlen, in_features, requires_grad=True)
+    w1_pt = torch.randn(hidden_features, in_features, requires_grad=True)
+    b1_pt = torch.randn(hidden_features, requires_grad=True)
+    w2_pt = torch.randn(in_features, hidden_features, requires_grad=True)
+    b2_pt = torch.randn(in_features, requires_grad=True)
+    g = torch.randn(seqlen, in_features)
+    out_pt = F.linear(F.gelu(F.linear(x_pt, w1_pt, b1_pt)), w2_pt, b2_pt)
+    out_pt.backward(g)
+
+    # Column parallel fc1 and row parallel fc2, with x and out sharded along the sequence
+    seq_local = slice(rank * seqlen // world_size, (rank + 1) * seqlen // world_size)
+    hidden_local = slice(rank * 16, (rank + 1) * 16)
+    x = x_pt[seq_local].detach().clone().requires_grad_()
+    w1 = w1_pt[hidden_local].detach().clone().requires_grad_()
+    b1 = b1_pt[hidden_local].detach().clone().requires_grad_()
+    w2 = w2_pt[:, hidden_local].detach().clone().requires_grad_()
+    b2 = b2_pt.detach().clone().requires_grad_() if rank == 0 else None
+    y = F.gelu(all_gather_linear(x, w1, b1, process_group, num_chunks))
+    out = linear_reduce_scatter(y, w2, b2, process_group, num_chunks)
+    out.backward(g[seq_local])
+    assert torch.allclose(out, out_pt[seq_local], rtol=1e-4, atol=1e-4)
+    assert torch.allclose(x.grad, x_pt.grad[seq_local], rtol=1e-4, atol=1e-4)
+    assert torch.allclose(w1.grad, w1_pt.grad[hidden_local], rtol=1e-4, atol=1e-4)
+    assert torch.allclose(b1.grad, b1_pt.grad[hidden_local], rtol=1e-4, atol=1e-4)
+    assert torch.allclose(w2.grad, w2_pt.grad[:, hidden_local], rtol=1e-4, atol=1e-4)
+    if rank == 0:
+        assert torch.allclose(b2.grad, b2_pt.grad, rtol=1e-4, atol=1e-4)
+    dist.destroy_process_group()
+
+
+@pytest.mark.parametrize("num_chunks", [1, 2, 5])
+@pytest.mark.parametrize("world_size", [1, 2, 4])
+def test_chunked_linear_gloo(world_size, num_chunks):
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        port = s.getsockname()[1]
+    mp.spawn(_chunked_linear, args=(world_size, port, num_chunks), nprocs=world_size)
@@ -0,0 +1,78 @@
+import pytest
+import torch
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+from flash_attn.utils.generation import build_speculative_tree, decode, decode_speculative
+
+
+def get_tiny_gpt2(n_layer=2, device="cpu", dtype=torch.float32):
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=n_layer, vocab_size=128, n_positions=128)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    return model
+
+
+def test_build_speculative_tree():
+    #       root
+    #      /    \
+    #     0      1
+    #    / \     |
+    #   2   3    4
+    tree_attn_mask = build_speculative_tree([-1, -1, 0, 0, 1])
+    assert tree_attn_mask.tolist() == [
+        [True, False, False, False, False],
+        [False, True, False, False, False],
+        [True, False, True, False, False],
+        [True, False, False, True, False],
+        [False, True, False, False, True],
+    ]
+
+
+def test_decode_stop_conditions():
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    batch_size, seqlen, max_length = 3, 5, 20
+    input_ids = torch.randint(0, 128, (batch_size, seqlen))
+    out_ref = decode(input_ids, model, max_length).sequences
+    # Each sequence has its own max length and stop tokens, and the first one samples greedily
+    # through its temperature rather than top_k
+    max_lengths = [12, 20, 16]
+    stop_token_ids = [[], [out_ref[1, seqlen + 3].item()], [out_ref[2, seqlen + 1].item(), 1000]]
+    out = decode(
+        input_ids,
+        model,
+        max_lengths,
+        top_k=torch.tensor([0, 1, 1]),
+        temperature=torch.tensor([0.0, 1.0, 1.0]),
+        stop_token_ids=stop_token_ids,
+        pad_token_id=0,
+    ).sequences
+    lengths = []
+    for i in range(batch_size):
+        generated = out_ref[i, seqlen : max_lengths[i]].tolist()
+        stops = [j for j, token in enumerate(generated) if token in stop_token_ids[i]]
+        if stops:
+            generated = generated[: stops[0] + 1]
+        expected = out_ref[i, :seqlen].tolist() + generated
+        assert out[i].tolist() == expected + [0] * (out.shape[1] - len(expected))
+        lengths.append(len(expected))
+    # Decoding ends once every sequence has stopped
+    assert out.shape[1] == max(lengths)
+
+
+@pytest.mark.parametrize("speculative_tree", [(1,), (2, 2), (3, 2, 1), (1, 1, 1, 1)])
+@pytest.mark.parametrize("same_draft", [False, True])
+def test_decode_speculative_tree(speculative_tree, same_draft):
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    model_draft = model if same_draft else get_tiny_gpt2(n_layer=1)
+    max_length = 40
+    input_ids = torch.randint(0, 128, (1, 5))
+    out_ref = decode(input_ids, model, max_length)
+    out = decode_speculative(
+        input_ids, model, model_draft, max_length, speculative_tree=speculative_tree
+    )
+    # Greedy speculative decoding generates exactly the tokens the model would generate
+    assert torch.equal(out.sequences, out_ref.sequences)
+    assert torch.allclose(out.scores[0], torch.stack(out_ref.scores, dim=1)[0], atol=1e-4)
@@ -0,0 +1,268 @@
+import json
+import math
+
+import pytest
+import torch
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+from flash_attn.utils.generation import decode
+from flash_attn.utils.kv_cache import (
+    QUANTIZED_KV_CACHE_DTYPES,
+    KVSwapSpace,
+    PagedKVCache,
+    PrefixCache,
+    allocate_paged_inference_cache,
+    kv_cache_read,
+    kv_cache_write,
+)
+from flash_attn.utils.scheduler import ContinuousBatchingScheduler
+
+
+def get_tiny_gpt2(device="cpu", dtype=torch.float32):
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    return model
+
+
+def test_paged_kv_cache_allocator():
+    kv_cache = allocate_paged_inference_cache(6, 4, 2, 16, 2, "cpu", dtype=torch.float32)
+    cache = PagedKVCache(kv_cache, max_batch_size=3, max_seqlen=16)
+    assert cache.page_table.shape == (3, 4) and cache.page_table.dtype == torch.int32
+    cache.reserve(0, 5)
+    cache.reserve(1, 1)
+    assert cache.page_table[0, :2].tolist() == [0, 1]
+    assert cache.page_table[1, :1].tolist() == [2]
+    cache.reserve(0, 8)  # Still fits in the 2 pages of sequence 0
+    assert cache.num_free_pages == 3
+    cache.reserve(0, 9)
+    assert cache.page_table[0, :3].tolist() == [0, 1, 3]
+    assert not cache.can_reserve(2, 12)
+    with pytest.raises(RuntimeError):
+        cache.reserve(2, 12)
+    cache.free(0)
+    assert cache.num_free_pages == 5
+    assert cache.page_table[0].tolist() == [0, 0, 0, 0]
+    cache.reserve(2, 12)
+    assert sorted(cache.page_table[2, :3].tolist()) == [0, 1, 3]
+    cache.reset()
+    assert cache.num_free_pages == 6
+
+
+@pytest.mark.parametrize("page_size", [1, 4, 16])
+def test_decode_paged_kv_cache(page_size):
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    batch_size, seqlen, max_length = 2, 7, 20
+    input_ids = torch.randint(0, 128, (batch_size, seqlen))
+    out_ref = decode(input_ids, model, max_length)
+    num_pages = batch_size * math.ceil(max_length / page_size)
+    paged_kv_cache = PagedKVCache.from_model(model, num_pages, page_size, batch_size, max_length)
+    out = decode(input_ids, model, max_length, paged_kv_cache=paged_kv_cache)
+    assert torch.equal(out.sequences, out_ref.sequences)
+    assert torch.allclose(torch.stack(out.scores), torch.stack(out_ref.scores), atol=1e-5)
+    # Every page is given back once decoding finishes
+    assert paged_kv_cache.num_free_pages == num_pages
+
+
+@pytest.mark.parametrize("dtype", QUANTIZED_KV_CACHE_DTYPES)
+def test_quantized_kv_cache_write(dtype):
+    torch.random.manual_seed(0)
+    num_pages, page_size, nheads, headdim = 4, 8, 2, 16
+    kv_cache = allocate_paged_inference_cache(
+        num_pages, page_size, nheads, headdim, 1, "cpu", dtype=dtype
+    )[0]
+    cache = PagedKVCache({0: kv_cache}, max_batch_size=1, max_seqlen=num_pages * page_size)
+    kv_scales = cache.kv_scales[0]
+    assert kv_scales.shape == (num_pages, 2, nheads)
+    cache.reserve(0, num_pages * page_size)
+    page_table = cache.page_table[0].long()
+    kv_ref = torch.randn(num_pages * page_size, 2, nheads, headdim)
+    # Later tokens are larger, so the scale of a page grows and its tokens get requantized
+    kv_ref *= torch.linspace(0.1, 10.0, num_pages * page_size)[:, None, None, None]
+    for start, end in [(0, 3), (3, 4), (4, 13), (13, 32)]:
+        positions = torch.arange(start, end)
+        page_idx, page_offset = page_table[positions // page_size], positions % page_size
+        kv_cache_write(kv_cache, page_idx, page_offset, kv_ref[start:end], kv_scales)
+    positions = torch.arange(num_pages * page_size)
+    page_idx, page_offset = page_table[positions // page_size], positions % page_size
+    kv = kv_cache_read(kv_cache, page_idx, page_offset, kv_scales, dtype=torch.float32)
+    # The error is relative to the largest value of the page, K / V and head
+    amax = kv_ref.abs().reshape(num_pages, page_size, 2, nheads, headdim).amax(dim=(1, 4))
+    err = (kv - kv_ref).abs().reshape(num_pages, page_size, 2, nheads, headdim).amax(dim=(1, 4))
+    assert (err <= amax * (0.02 if dtype == torch.int8 else 0.15)).all()
+
+
+@pytest.mark.parametrize("dtype", QUANTIZED_KV_CACHE_DTYPES)
+def test_decode_quantized_kv_cache(dtype):
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    batch_size, seqlen, max_length, page_size = 2, 7, 20, 4
+    input_ids = torch.randint(0, 128, (batch_size, seqlen))
+    teacher_outputs = torch.randint(0, 128, (batch_size, max_length))
+    out_ref = decode(input_ids, model, max_length, teacher_outputs=teacher_outputs)
+    num_pages = batch_size * math.ceil(max_length / page_size)
+    paged_kv_cache = PagedKVCache.from_model(
+        model, num_pages, page_size, batch_size, max_length, dtype=dtype
+    )
+    assert paged_kv_cache.kv_cache[0].element_size() == 1
+    out = decode(
+        input_ids,
+        model,
+        max_length,
+        teacher_outputs=teacher_outputs,
+        paged_kv_cache=paged_kv_cache,
+    )
+    scores, scores_ref = torch.stack(out.scores), torch.stack(out_ref.scores)
+    assert (scores - scores_ref).abs().max() <= 0.05 * scores_ref.abs().max()
+    assert paged_kv_cache.num_free_pages == num_pages
+
+
+@pytest.mark.parametrize("dtype", QUANTIZED_KV_CACHE_DTYPES)
+def test_quantized_kv_cache_flash(dtype):
+    """Quantized caches with use_flash_attn=True, both with decode() and with packed batches of
+    sequences of different lengths (the scheduler). They go through the reference attention.
+    """
+    if not torch.cuda.is_available():
+        pytest.skip("CUDA is not available")
+    torch.random.manual_seed(0)
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    config.use_flash_attn = True
+    model = GPTLMHeadModel(config, device="cuda", dtype=torch.float16)
+    model.eval()
+    batch_size, seqlen, max_length, page_size = 2, 7, 20, 4
+    input_ids = torch.randint(0, 128, (batch_size, seqlen), device="cuda")
+    teacher_outputs = torch.randint(0, 128, (batch_size, max_length), device="cuda")
+    out_ref = decode(input_ids, model, max_length, teacher_outputs=teacher_outputs)
+    scores_ref = torch.stack(out_ref.scores)
+    num_pages = batch_size * math.ceil(max_length / page_size)
+    paged_kv_cache = PagedKVCache.from_model(
+        model, num_pages, page_size, batch_size, max_length, dtype=dtype
+    )
+    out = decode(
+        input_ids,
+        model,
+        max_length,
+        teacher_outputs=teacher_outputs,
+        paged_kv_cache=paged_kv_cache,
+    )
+    scores = torch.stack(out.scores)
+    assert (scores - scores_ref).abs().max() <= 0.05 * scores_ref.abs().max()
+    prompts = [input_ids[0, :3].tolist(), input_ids[1].tolist()]
+    scheduler = ContinuousBatchingScheduler(
+        model, batch_size, max_length, prefill_chunk_size=2, paged_kv_cache=paged_kv_cache
+    )
+    out = scheduler.generate(prompts, 12)
+    out_ref = [
+        decode(torch.tensor([prompt_ids], device="cuda"), model, 12).sequences[0].tolist()
+        for prompt_ids in prompts
+    ]
+    # Quantization could flip near ties, so only compare the first generated token
+    assert [seq[len(p)] for seq, p in zip(out, prompts)] == [
+        seq[len(p)] for seq, p in zip(out_ref, prompts)
+    ]
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, *QUANTIZED_KV_CACHE_DTYPES])
+@pytest.mark.parametrize("use_file", [False, True])
+def test_kv_swap_space(use_file, dtype, tmp_path):
+    torch.random.manual_seed(0)
+    num_pages, page_size, nheads, headdim, num_layers = 6, 4, 2, 16, 2
+    kv_cache = allocate_paged_inference_cache(
+        num_pages, page_size, nheads, headdim, num_layers, "cpu", dtype=dtype
+    )
+    cache = PagedKVCache(kv_cache, max_batch_size=2, max_seqlen=num_pages * page_size)
+    path = str(tmp_path / "kv_swap") if use_file else None
+    swap_space = KVSwapSpace(cache, num_host_pages=4, path=path)
+    num_tokens = 10
+    cache.reserve(0, num_tokens)
+    positions = torch.arange(num_tokens)
+    page_idx = cache.page_table[0].long()[positions // page_size]
+    kv_ref = torch.randn(num_tokens, 2, nheads, headdim)
+    for layer in range(num_layers):
+        kv_scales = cache.kv_scales[layer] if cache.kv_scales is not None else None
+        kv_cache_write(kv_cache[layer], page_idx, positions % page_size, kv_ref, kv_scales)
+
+    def read(layer, batch_idx):
+        return kv_cache_read(
+            kv_cache[layer],
+            cache.page_table[batch_idx].long()[positions // page_size],
+            positions % page_size,
+            cache.kv_scales[layer] if cache.kv_scales is not None else None,
+            dtype=torch.float32,
+        )
+
+    kv_before = [read(layer, 0) for layer in range(num_layers)]
+    assert swap_space.can_swap_out(num_tokens) and not swap_space.can_swap_out(17)
+    swap_space.swap_out("req", 0, num_tokens)
+    assert swap_space.num_free_pages == 1
+    # The device pages can be reused right away
+    cache.free(0)
+    for layer in range(num_layers):
+        kv_cache[layer].zero_()
+    swap_space.synchronize()
+    assert swap_space.num_tokens("req") == num_tokens
+    if use_file:
+        with open(path + ".json") as f:
+            manifest = json.load(f)
+        assert manifest["req"]["num_tokens"] == num_tokens and manifest["req"]["complete"]
+    cache.reserve(0, 4)  # Sequence 1 gets different pages
+    cache.reserve(1, num_tokens)
+    assert swap_space.swap_in("req", 1) == num_tokens
+    assert swap_space.num_tokens("req") == 0
+    assert swap_space.num_free_pages == 4
+    for layer in range(num_layers):
+        assert torch.equal(read(layer, 1), kv_before[layer])
+    if use_file:
+        with open(path + ".json") as f:
+            assert json.load(f) == {}
+    swap_space.close()
+
+
+def test_prefix_cache():
+    kv_cache = allocate_paged_inference_cache(6, 2, 2, 16, 1, "cpu", dtype=torch.float32)
+    cache = PagedKVCache(kv_cache, max_batch_size=2, max_seqlen=8)
+    prefix_cache = PrefixCache(cache)
+    cache.reserve(0, 6)
+    assert cache.pages(0) == [0, 1, 2]
+    prefix_cache.insert([1, 2, 3, 4, 5, 6], cache.pages(0))
+    cache.free(0)
+    # The pages are still held by the prefix cache
+    assert prefix_cache.num_pages == 3 and cache.num_free_pages == 3
+    assert prefix_cache.match([1, 2, 3, 4, 9, 9]) == [0, 1]
+    assert prefix_cache.match([1, 2, 3, 4, 5, 6], max_num_tokens=5) == [0, 1]
+    assert prefix_cache.match([2, 2, 3, 4, 5, 6]) == []
+    cache.share(1, [0, 1])
+    cache.reserve(1, 8)
+    assert cache.pages(1) == [0, 1, 3, 4]
+    # Only the page that no sequence uses can be evicted, which isn't enough
+    with pytest.raises(RuntimeError):
+        cache.reserve(0, 6)
+    assert prefix_cache.num_pages == 2
+    assert prefix_cache.match([1, 2, 3, 4, 5, 6]) == [0, 1]
+    cache.free(1)
+    cache.reserve(0, 6)
+    assert prefix_cache.match([1, 2, 3, 4]) == [0, 1]
+    cache.free(0)
+    prefix_cache.reset()
+    assert prefix_cache.num_pages == 0 and cache.num_free_pages == 6
+
+
+def test_decode_prefix_cache():
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    page_size, max_length = 4, 24
+    shared = torch.randint(0, 128, (1, 12))
+    input_ids_a = torch.cat([shared, torch.randint(0, 128, (1, 3))], dim=1)
+    input_ids_b = torch.cat([shared, torch.randint(0, 128, (1, 3))], dim=1)
+    out_ref = decode(input_ids_b, model, max_length)
+    paged_kv_cache = PagedKVCache.from_model(model, 12, page_size, 1, max_length)
+    prefix_cache = PrefixCache(paged_kv_cache)
+    decode(input_ids_a, model, max_length, prefix_cache=prefix_cache)
+    # The 3 full pages of the shared prefix are cached
+    assert len(prefix_cache.match(input_ids_b[0].tolist())) == 3
+    out = decode(input_ids_b, model, max_length, prefix_cache=prefix_cache)
+    assert torch.equal(out.sequences, out_ref.sequences)
+    assert torch.allclose(torch.stack(out.scores), torch.stack(out_ref.scores), atol=1e-5)
+    assert paged_kv_cache.num_free_pages + prefix_cache.num_pages == 12
@@ -0,0 +1,71 @@
+import pytest
+import torch
+import torch.nn.functional as F
+from einops import rearrange
+from safetensors.torch import save_file as safe_save_file
+from transformers import GPT2Config
+from transformers.models.gpt2.modeling_gpt2 import GPT2Model
+
+from flash_attn.models.gpt import GPTLMHeadModel, remap_state_dict_hf_gpt2
+from flash_attn.utils.lazy_load import LazyTensor, lazy_load_file, materialize
+from flash_attn.utils.pretrained import state_dict_from_pretrained
+
+
+def test_lazy_tensor_ops():
+    x, y = torch.randn(6, 4), torch.randn(6, 4)
+    num_reads = 0
+
+    def read(tensor):
+        nonlocal num_reads
+        num_reads += 1
+        return tensor
+
+    x_lazy = LazyTensor(torch.empty_like(x, device="meta"), lambda: read(x))
+    y_lazy = LazyTensor(torch.empty_like(y, device="meta"), lambda: read(y))
+    ops = [
+        lambda x, y: x.t(),
+        lambda x, y: F.pad(x, (0, 0, 0, 2)),
+        lambda x, y: torch.cat([x, y], dim=0),
+        lambda x, y: rearrange(x, "(two s) d -> s (d two)", two=2),
+        lambda x, y: x.to(dtype=torch.float16),
+        lambda x, y: x[1:3] * 2 + y[:2],
+        lambda x, y: x.chunk(3, dim=0)[1],
+    ]
+    for op in ops:
+        out_lazy = op(x_lazy, y_lazy)
+        assert isinstance(out_lazy, LazyTensor) and num_reads == 0
+        out = op(x, y)
+        assert out_lazy.shape == out.shape and out_lazy.dtype == out.dtype
+        assert torch.equal(materialize(out_lazy), out)
+        num_reads = 0
+    # Mixing with real tensors runs eagerly
+    z = torch.zeros(6, 4)
+    z.copy_(x_lazy)
+    assert torch.equal(z, x)
+    with pytest.raises(NotImplementedError):
+        x_lazy.mul_(2)
+
+
+@pytest.mark.parametrize("safe", [False, True])
+def test_lazy_load_gpt2(tmp_path, safe):
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    torch.manual_seed(0)
+    state_dict = {k: v.clone() for k, v in GPT2Model(config).state_dict().items()}
+    if safe:
+        safe_save_file(state_dict, tmp_path / "model.safetensors")
+    else:
+        torch.save(state_dict, tmp_path / "pytorch_model.bin")
+    filename = tmp_path / ("model.safetensors" if safe else "pytorch_model.bin")
+    lazy_state_dict = lazy_load_file(filename)
+    assert lazy_state_dict.keys() == state_dict.keys()
+    assert all(isinstance(v, LazyTensor) and v.is_meta for v in lazy_state_dict.values())
+
+    model_ref = GPTLMHeadModel(config)
+    model_ref.load_state_dict(remap_state_dict_hf_gpt2(state_dict, config))
+    # The remapping runs on the LazyTensors, the data is read by load_state_dict
+    model = GPTLMHeadModel(config, dtype=torch.float16)
+    lazy_state_dict = state_dict_from_pretrained(str(tmp_path), dtype=torch.float16, lazy=True)
+    model.load_state_dict(remap_state_dict_hf_gpt2(lazy_state_dict, config))
+    for (name, p), p_ref in zip(model.named_parameters(), model_ref.parameters()):
+        assert p.dtype == torch.float16
+        assert torch.equal(p, p_ref.half()), name
@@ -0,0 +1,141 @@
+import math
+
+import pytest
+import torch
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+from flash_attn.utils.generation import decode
+from flash_attn.utils.kv_cache import KVSwapSpace, PagedKVCache
+from flash_attn.utils.scheduler import ContinuousBatchingScheduler
+
+
+def get_tiny_gpt2(device="cpu", dtype=torch.float32):
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    return model
+
+
+def get_prompts(num_prompts, max_prompt_len):
+    lengths = torch.randint(1, max_prompt_len + 1, (num_prompts,)).tolist()
+    return [torch.randint(0, 128, (l,)).tolist() for l in lengths]
+
+
+# "small_pool" only has enough pages for a couple of sequences, which forces preemption.
+# "small_pool_swap" swaps the preempted sequences out instead of recomputing them.
+@pytest.mark.parametrize("kv_cache_type", ["dense", "paged", "small_pool", "small_pool_swap"])
+@pytest.mark.parametrize("prefill_chunk_size", [None, 3])
+@pytest.mark.parametrize("max_tokens_per_step", [8, 64])
+def test_continuous_batching_scheduler(kv_cache_type, max_tokens_per_step, prefill_chunk_size):
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    num_prompts, max_batch_size, max_length = 7, 3, 24
+    prompts = get_prompts(num_prompts, 10)
+    out_ref = [
+        decode(torch.tensor([prompt_ids]), model, max_length).sequences[0].tolist()
+        for prompt_ids in prompts
+    ]
+    paged_kv_cache = None
+    if kv_cache_type != "dense":
+        page_size = 4
+        num_pages = (
+            max_batch_size * math.ceil(max_length / page_size)
+            if kv_cache_type == "paged"
+            else math.ceil(max_length / page_size) + 2
+        )
+        paged_kv_cache = PagedKVCache.from_model(
+            model, num_pages, page_size, max_batch_size, max_length
+        )
+    swap_space = None
+    if kv_cache_type == "small_pool_swap":
+        swap_space = KVSwapSpace(paged_kv_cache, num_host_pages=num_pages * 2)
+    scheduler = ContinuousBatchingScheduler(
+        model,
+        max_batch_size,
+        max_length,
+        max_tokens_per_step=max_tokens_per_step,
+        prefill_chunk_size=prefill_chunk_size,
+        paged_kv_cache=paged_kv_cache,
+        swap_space=swap_space,
+    )
+    requests = [scheduler.add_request(prompt_ids, max_length) for prompt_ids in prompts]
+    max_running = 0
+    while scheduler.has_unfinished():
+        scheduler.step()
+        max_running = max(max_running, len(scheduler.running))
+        # Every step processes at most max_tokens_per_step tokens
+        assert scheduler.inference_params.cu_seqlens_q[-1].item() <= max_tokens_per_step
+        if prefill_chunk_size is not None:
+            assert scheduler.inference_params.max_seqlen_q <= prefill_chunk_size
+    assert [request.token_ids for request in requests] == out_ref
+    assert all(request.finished for request in requests)
+    assert max_running <= max_batch_size
+    if kv_cache_type.startswith("small_pool"):
+        assert any(request.num_preemptions > 0 for request in requests)
+    if swap_space is not None:
+        assert any(request.num_swaps > 0 for request in requests)
+        assert swap_space.num_free_pages == swap_space.num_host_pages
+        swap_space.close()
+    if paged_kv_cache is not None:
+        assert paged_kv_cache.num_free_pages == paged_kv_cache.num_pages
+
+
+def test_continuous_batching_scheduler_eos():
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    max_length = 20
+    prompts = get_prompts(5, 8)
+    out_ref = [
+        decode(torch.tensor([prompt_ids]), model, max_length).sequences[0].tolist()
+        for prompt_ids in prompts
+    ]
+    # Stop at a token that the first sequence generates
+    eos_token_id = out_ref[0][len(prompts[0]) + 2]
+    scheduler = ContinuousBatchingScheduler(model, 2, max_length, eos_token_id=eos_token_id)
+    out = scheduler.generate(prompts, max_length)
+    for prompt_ids, seq, seq_ref in zip(prompts, out, out_ref):
+        generated_ref = seq_ref[len(prompt_ids) :]
+        if eos_token_id in generated_ref:
+            generated_ref = generated_ref[: generated_ref.index(eos_token_id) + 1]
+        assert seq == prompt_ids + generated_ref
+    assert len(out[0]) <= len(prompts[0]) + 3
+
+
+def test_continuous_batching_scheduler_per_request_sampling():
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    max_length = 20
+    prompts = get_prompts(6, 8)
+    out_ref = [
+        decode(torch.tensor([prompt_ids]), model, max_length).sequences[0].tolist()
+        for prompt_ids in prompts
+    ]
+    # The scheduler samples by default, and the even requests are greedy, some with stop tokens
+    scheduler = ContinuousBatchingScheduler(model, 4, max_length, top_k=0, temperature=1.0)
+    requests = [
+        scheduler.add_request(
+            prompt_ids,
+            max_length,
+            top_k=1 if i % 2 == 0 else None,
+            stop_token_ids=[out_ref[i][len(prompt_ids) + 1]] if i % 4 == 0 else None,
+        )
+        for i, prompt_ids in enumerate(prompts)
+    ]
+    while scheduler.has_unfinished():
+        scheduler.step()
+    for i in range(0, len(prompts), 2):
+        generated_ref = out_ref[i][len(prompts[i]) :]
+        if i % 4 == 0:
+            generated_ref = generated_ref[: generated_ref.index(generated_ref[1]) + 1]
+        assert requests[i].token_ids == prompts[i] + generated_ref
+    assert all(len(request.token_ids) <= max_length for request in requests)
+
+
+def test_continuous_batching_scheduler_budget():
+    model = get_tiny_gpt2()
+    # The decoding tokens alone could exceed the budget
+    with pytest.raises(AssertionError):
+        ContinuousBatchingScheduler(model, 4, 24, max_tokens_per_step=3)
+    scheduler = ContinuousBatchingScheduler(model, 4, 3)
+    assert scheduler.max_tokens_per_step == 4
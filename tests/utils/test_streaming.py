@@ -0,0 +1,75 @@
+import pytest
+import torch
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+from flash_attn.utils.generation import decode
+from flash_attn.utils.streaming import TokenStreamer, decode_stream
+
+
+def get_tiny_gpt2(device="cpu", dtype=torch.float32):
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    model = GPTLMHeadModel(config, device=device, dtype=dtype)
+    model.eval()
+    return model
+
+
+class ByteTokenizer:
+    """Each token is a byte, so a non-ASCII character spans several tokens."""
+
+    def decode(self, token_ids):
+        return bytes(token_ids).decode("utf-8", errors="replace")
+
+
+@pytest.mark.parametrize("use_stop_tokens", [False, True])
+def test_decode_stream(use_stop_tokens):
+    torch.random.manual_seed(0)
+    model = get_tiny_gpt2()
+    batch_size, seqlen, max_length = 2, 5, 20
+    input_ids = torch.randint(0, 128, (batch_size, seqlen))
+    stop_token_ids = None
+    if use_stop_tokens:
+        out_ref = decode(input_ids, model, max_length).sequences
+        stop_token_ids = [[out_ref[0, seqlen + 2].item()], []]
+    out_ref = decode(input_ids, model, max_length, stop_token_ids=stop_token_ids).sequences
+    generated = [[] for _ in range(batch_size)]
+    num_steps = 0
+    for outputs in decode_stream(
+        input_ids, model, max_length, max_queue_size=2, stop_token_ids=stop_token_ids
+    ):
+        num_steps += 1
+        for i, token_ids in enumerate(outputs):
+            generated[i].extend(token_ids)
+    assert num_steps == out_ref.shape[1] - seqlen
+    for i in range(batch_size):
+        # Tokens after a sequence stopped (i.e. the padding) aren't streamed
+        assert generated[i] == out_ref[i, seqlen : seqlen + len(generated[i])].tolist()
+    if use_stop_tokens:
+        assert generated[0][-1] == stop_token_ids[0][0]
+        assert len(generated[0]) <= 3
+    assert len(generated[1]) == max_length - seqlen
+
+
+@pytest.mark.parametrize("use_callback", [False, True])
+def test_token_streamer_detokenize(use_callback):
+    text = "héllo wörld ✓"
+    token_ids = list(text.encode("utf-8"))
+    outputs = []
+    streamer = TokenStreamer(
+        ByteTokenizer(), callback=outputs.append if use_callback else None, max_queue_size=1
+    )
+    if not use_callback:
+        # Consume the stream while tokens are being put, as decode_stream does
+        iterator = iter(streamer)
+    for token_id in token_ids:
+        streamer.put(torch.tensor([[token_id], [ord("a")]]))
+        if not use_callback:
+            outputs.append(next(iterator))
+    streamer.end()
+    if not use_callback:
+        assert list(iterator) == []
+    assert len(outputs) == len(token_ids)
+    # Incomplete characters are held back until their last byte arrives
+    assert all("\ufffd" not in step[0] for step in outputs)
+    assert "".join(step[0] for step in outputs) == text
+    assert "".join(step[1] for step in outputs) == "a" * len(token_ids)
@@ -1,42 +1,201 @@
 # Adapted from https://pytorch-lightning.readthedocs.io/en/latest/_modules/pytorch_lightning/callbacks/gpu_stats_monitor.html#GPUStatsMonitor
 # We only need the speed monitoring, not the GPU monitoring
 import time
-from typing import Any
+from collections import deque
+from typing import Any, Optional
+
+import numpy as np
+
+import torch
 
 from pytorch_lightning import Callback, Trainer
 from pytorch_lightning.utilities import rank_zero_only
 from pytorch_lightning.utilities.parsing import AttributeDict
 from pytorch_lightning.utilities.types import STEP_OUTPUT
 
+from src.utils.flops import gpt_flops, peak_tflops
+
+
+PHASES = ['data', 'forward', 'backward', 'communication', 'optimizer']
+# The phase that ends at each mark of a step
+MARK_PHASES = {'start': 'data', 'before_backward': 'forward', 'last_grad': 'backward',
+               'after_backward': 'communication', 'before_optimizer_step': 'optimizer',
+               'end': 'optimizer'}
+
+
+class _Timer:
+    """Timestamps on the current CUDA stream (CUDA events), or on the CPU."""
+
+    def __init__(self, use_cuda):
+        self.use_cuda = use_cuda
+
+    def mark(self, event=None):
+        if not self.use_cuda:
+            return time.perf_counter()
+        if event is None:
+            event = torch.cuda.Event(enable_timing=True)
+        event.record()
+        return event
+
+    def elapsed_ms(self, start, end):
+        if not self.use_cuda:
+            return (end - start) * 1000
+        end.synchronize()
+        return start.elapsed_time(end)
+
 
 class SpeedMonitor(Callback):
     """Monitor the speed of each step and each epoch.
+
+    If phase_time, each training step is also broken down into phases, from timestamps taken
+    in the hooks (CUDA events on the GPU, so nothing is synchronized, the events of a step are
+    read at the end of the next step):
+        data: from the end of the previous step to the start of this one (waiting for the
+            dataloader, and anything else between the steps).
+        forward: forward and loss, up to on_before_backward.
+        backward: up to the time the last gradient is accumulated.
+        communication: the rest of the backward, i.e. the gradient all-reduce of DDP that isn't
+            overlapped with the backward. Collectives of the optimizer (e.g. ZeRO's all-gather)
+            are counted in optimizer.
+        optimizer: gradient clipping, optimizer step, zero_grad.
+    The p50/p95/p99 of the time of each phase and of the whole step over the last window steps
+    are logged as time/{phase}_p50 (ms) etc., along with the MFU: the model FLOPs of these
+    steps divided by their time and the peak FLOPs of the device. The FLOPs of a step are
+    flops_per_token times its number of tokens, or else computed from pl_module.model.config
+    with gpt_flops, which only counts the attention within each document of packed batches
+    (with cu_seqlens).
+    The peak is peak_tflops (per device), or else looked up from the GPU name.
     """
     def __init__(self, intra_step_time: bool = True, inter_step_time: bool = True,
-                 epoch_time: bool = True, verbose=False):
+                 epoch_time: bool = True, phase_time: bool = False, window: int = 100,
+                 flops_per_token: Optional[float] = None, peak_tflops: Optional[float] = None,
+                 verbose=False):
         super().__init__()
         self._log_stats = AttributeDict(
             {
                 'intra_step_time': intra_step_time,
                 'inter_step_time': inter_step_time,
                 'epoch_time': epoch_time,
+                'phase_time': phase_time,
             }
         )
+        self.window = window
+        self.flops_per_token = flops_per_token
+        self.peak_tflops = peak_tflops
         self.verbose = verbose
 
     def on_train_start(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule") -> None:
         self._snap_epoch_time = None
+        if self._log_stats.phase_time:
+            self._setup_phase_time(pl_module)
+
+    @rank_zero_only
+    def _setup_phase_time(self, pl_module):
+        use_cuda = pl_module.device.type == 'cuda'
+        self._timer = _Timer(use_cuda)
+        self._marks, self._pending, self._prev_end = {}, None, None
+        self._phase_times = {phase: deque(maxlen=self.window) for phase in PHASES + ['step']}
+        self._step_flops = deque(maxlen=self.window)
+        self._peak_tflops = self.peak_tflops
+        if self._peak_tflops is None and use_cuda:
+            self._peak_tflops = peak_tflops(torch.cuda.get_device_name(pl_module.device))
+
+        def on_grad(param):
+            if 'before_backward' in self._marks:
+                self._marks['last_grad'] = self._timer.mark(self._marks.get('last_grad'))
+
+        for p in pl_module.parameters():
+            if p.requires_grad:
+                p.register_post_accumulate_grad_hook(on_grad)
+
+    def _mark(self, name):
+        if self._log_stats.phase_time:
+            self._marks[name] = self._timer.mark()
+
+    def _resolve_pending(self):
+        """Add the phase times of the previous step to the window."""
+        if self._pending is None:
+            return
+        (prev_end, marks, step_flops), self._pending = self._pending, None
+        times = dict.fromkeys(PHASES, 0.0)
+        prev = prev_end
+        for name, phase in MARK_PHASES.items():
+            if name in marks:
+                if prev is not None:
+                    times[phase] += self._timer.elapsed_ms(prev, marks[name])
+                prev = marks[name]
+        for phase, t in times.items():
+            self._phase_times[phase].append(t)
+        self._phase_times['step'].append(sum(times.values()))
+        self._step_flops.append(step_flops())
+
+    def _step_flops_fn(self, pl_module, batch):
+        """Return a function that computes the FLOPs of the step once it's resolved (so that
+        the cu_seqlens of the batch are copied to the host without synchronizing).
+        """
+        input_ids = batch['input_ids'] if isinstance(batch, dict) else batch[0]
+        num_tokens, seqlen = input_ids.numel(), input_ids.shape[-1]
+        config = getattr(pl_module.model, 'config', None)
+        if self.flops_per_token is not None:
+            return lambda: self.flops_per_token * num_tokens
+        if not hasattr(config, 'n_layer'):
+            return lambda: None
+        if isinstance(batch, dict) and 'cu_seqlens' in batch:
+            # The padding segments of VarlenCollator aren't useful work
+            cu_seqlens = batch.get('doc_cu_seqlens', batch['cu_seqlens'])
+            if cu_seqlens.is_cuda:
+                cu_seqlens = torch.empty(cu_seqlens.shape, dtype=cu_seqlens.dtype,
+                                         pin_memory=True).copy_(cu_seqlens, non_blocking=True)
+            return lambda: gpt_flops(config, cu_seqlens)
+        return lambda: gpt_flops(config, list(range(0, num_tokens + 1, seqlen)))
+
+    def _phase_logs(self):
+        logs = {}
+        if not self._phase_times['step']:
+            return logs
+        for phase, times in self._phase_times.items():
+            p50, p95, p99 = np.percentile(np.array(times), [50, 95, 99])
+            logs.update({f'time/{phase}_p50 (ms)': p50, f'time/{phase}_p95 (ms)': p95,
+                         f'time/{phase}_p99 (ms)': p99})
+        if self._peak_tflops is not None and all(f is not None for f in self._step_flops):
+            flops = sum(self._step_flops)
+            seconds = sum(self._phase_times['step']) / 1000
+            logs['perf/mfu'] = flops / seconds / (self._peak_tflops * 1e12)
+        return logs
 
     def on_train_epoch_start(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule") -> None:
         self._snap_intra_step_time = None
         self._snap_inter_step_time = None
         self._snap_epoch_time = time.time()
+        self._reset_prev_end()
 
     def on_validation_epoch_start(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule") -> None:
         self._snap_inter_step_time = None
+        self._reset_prev_end()
 
     def on_test_epoch_start(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule") -> None:
         self._snap_inter_step_time = None
+        self._reset_prev_end()
+
+    @rank_zero_only
+    def _reset_prev_end(self):
+        # The time since the last training step isn't spent waiting for data
+        if self._log_stats.phase_time:
+            self._prev_end = None
+
+    @rank_zero_only
+    def on_before_backward(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule",
+                           loss: torch.Tensor) -> None:
+        self._mark('before_backward')
+
+    @rank_zero_only
+    def on_after_backward(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule") -> None:
+        self._mark('after_backward')
+
+    @rank_zero_only
+    def on_before_optimizer_step(self, trainer: "pl.Trainer", pl_module: "pl.LightningModule",
+                                 optimizer, *args) -> None:
+        self._mark('before_optimizer_step')
 
     @rank_zero_only
     def on_train_batch_start(
@@ -48,6 +207,9 @@ class SpeedMonitor(Callback):
     ) -> None:
         if self._log_stats.intra_step_time:
             self._snap_intra_step_time = time.time()
+        if self._log_stats.phase_time:
+            self._marks = {}
+            self._mark('start')
 
         if not trainer._logger_connector.should_update_logs:
             return
@@ -71,6 +233,12 @@ class SpeedMonitor(Callback):
     ) -> None:
         if self._log_stats.inter_step_time:
             self._snap_inter_step_time = time.time()
+        if self._log_stats.phase_time:
+            step_flops = self._step_flops_fn(pl_module, batch)
+            self._mark('end')
+            self._resolve_pending()
+            self._pending = (self._prev_end, self._marks, step_flops)
+            self._prev_end = self._marks['end']
 
         if self.verbose and self._log_stats.intra_step_time and self._snap_intra_step_time:
             pl_module.print(f"time/intra_step (ms): {(time.time() - self._snap_intra_step_time) * 1000}")
@@ -81,6 +249,8 @@ class SpeedMonitor(Callback):
         logs = {}
         if self._log_stats.intra_step_time and self._snap_intra_step_time:
             logs["time/intra_step (ms)"] = (time.time() - self._snap_intra_step_time) * 1000
+        if self._log_stats.phase_time:
+            logs.update(self._phase_logs())
 
         if trainer.logger is not None:
             trainer.logger.log_metrics(logs, step=trainer.global_step)
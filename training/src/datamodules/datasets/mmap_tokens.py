@@ -0,0 +1,148 @@
+import json
+import os
+from pathlib import Path
+from typing import Optional
+
+import numpy as np
+
+
+SHARD_NAME = 'shard_{:05d}.bin'
+
+
+class MMapTokens:
+    """Concatenated token ids stored in flat uint16 / uint32 shards that are memory-mapped.
+
+    A directory holds:
+        index.json: {'dtype', 'shard_sizes', 'num_docs'}, and optionally 'shard_names'
+        shard_00000.bin, shard_00001.bin, ... (or shard_names): the token ids, in order
+        doc_offsets.bin: int64 (num_docs + 1,), where each document starts in the concatenation
+
+    Opening only reads index.json, so it takes the same time whatever the size of the corpus,
+    and a shard is only mapped the first time it's read. A slice that doesn't cross a shard
+    boundary is a view of the memory map, not a copy. Pickling only keeps the path, so each
+    DataLoader worker maps the same files and they share the OS page cache.
+
+    This can be used wherever a 1D array of tokens is expected, e.g. by LMDataset.
+    """
+
+    def __init__(self, path):
+        self.path = Path(path)
+        with open(self.path / 'index.json') as f:
+            index = json.load(f)
+        self.dtype = np.dtype(index['dtype'])
+        self.shard_sizes = index['shard_sizes']
+        self.shard_names = index.get('shard_names',
+                                     [SHARD_NAME.format(i) for i in range(len(self.shard_sizes))])
+        self.num_docs = index['num_docs']
+        self.shard_offsets = np.cumsum([0] + self.shard_sizes)
+        self._shards = {}
+        self._doc_offsets = None
+
+    def __len__(self):
+        return int(self.shard_offsets[-1])
+
+    @property
+    def doc_offsets(self):
+        if self._doc_offsets is None:
+            self._doc_offsets = np.memmap(self.path / 'doc_offsets.bin', dtype=np.int64,
+                                          mode='r', shape=(self.num_docs + 1,))
+        return self._doc_offsets
+
+    def document(self, idx):
+        return self[int(self.doc_offsets[idx]):int(self.doc_offsets[idx + 1])]
+
+    def _shard(self, i):
+        if i not in self._shards:
+            self._shards[i] = np.memmap(self.path / self.shard_names[i], dtype=self.dtype,
+                                        mode='r', shape=(self.shard_sizes[i],))
+        return self._shards[i]
+
+    def _shard_idx(self, pos):
+        # Shards are never empty, so the offsets are strictly increasing
+        return int(np.searchsorted(self.shard_offsets, pos, side='right')) - 1
+
+    def __getitem__(self, idx):
+        if not isinstance(idx, slice):
+            idx = int(idx)
+            if idx < 0:
+                idx += len(self)
+            if not 0 <= idx < len(self):
+                raise IndexError(f'index {idx} is out of bounds for {len(self)} tokens')
+            shard_idx = self._shard_idx(idx)
+            return self._shard(shard_idx)[idx - self.shard_offsets[shard_idx]]
+        start, stop, step = idx.indices(len(self))
+        assert step == 1, 'Only contiguous slices are supported'
+        if start >= stop:
+            return np.empty(0, dtype=self.dtype)
+        pieces = []
+        for shard_idx in range(self._shard_idx(start), self._shard_idx(stop - 1) + 1):
+            shard_start = self.shard_offsets[shard_idx]
+            lo = max(start, shard_start) - shard_start
+            hi = min(stop, self.shard_offsets[shard_idx + 1]) - shard_start
+            pieces.append(self._shard(shard_idx)[lo:hi])
+        return pieces[0] if len(pieces) == 1 else np.concatenate(pieces)
+
+    def __getstate__(self):
+        state = self.__dict__.copy()
+        state['_shards'] = {}
+        state['_doc_offsets'] = None
+        return state
+
+
+class MMapTokensWriter:
+    """Append documents to a new MMapTokens directory.
+    index.json is only written by close(), so a directory without it is incomplete.
+    """
+
+    def __init__(self, path, dtype, shard_size: int = 1 << 30):
+        self.path = Path(path)
+        self.path.mkdir(parents=True, exist_ok=True)
+        self.dtype = np.dtype(dtype)
+        assert self.dtype in [np.uint16, np.uint32]
+        self.shard_size = shard_size
+        self.shard_sizes = []
+        self.num_docs = 0
+        self.num_tokens = 0
+        self._shard_file = None
+        self._doc_offsets_file = open(self.path / 'doc_offsets.bin', 'wb')
+        self._doc_offsets_file.write(np.zeros(1, dtype=np.int64).tobytes())
+
+    def write(self, token_ids, doc_lens: Optional[np.ndarray] = None):
+        """Append the concatenated token ids of one or more documents.
+        doc_lens: lengths of the documents, defaults to a single document.
+        """
+        token_ids = np.asarray(token_ids)
+        if doc_lens is None:
+            doc_lens = np.array([len(token_ids)])
+        assert np.sum(doc_lens) == len(token_ids)
+        if len(token_ids) > 0:
+            assert token_ids.min() >= 0 and token_ids.max() <= np.iinfo(self.dtype).max
+        token_ids = token_ids.astype(self.dtype, copy=False)
+        while len(token_ids) > 0:
+            if self._shard_file is None or self.shard_sizes[-1] == self.shard_size:
+                self._next_shard()
+            num_tokens = min(len(token_ids), self.shard_size - self.shard_sizes[-1])
+            self._shard_file.write(token_ids[:num_tokens].tobytes())
+            self.shard_sizes[-1] += num_tokens
+            token_ids = token_ids[num_tokens:]
+        doc_offsets = self.num_tokens + np.cumsum(doc_lens, dtype=np.int64)
+        self._doc_offsets_file.write(doc_offsets.tobytes())
+        self.num_docs += len(doc_lens)
+        self.num_tokens = int(doc_offsets[-1]) if len(doc_offsets) > 0 else self.num_tokens
+
+    def _next_shard(self):
+        if self._shard_file is not None:
+            self._shard_file.close()
+        self._shard_file = open(self.path / SHARD_NAME.format(len(self.shard_sizes)), 'wb')
+        self.shard_sizes.append(0)
+
+    def close(self):
+        if self._shard_file is not None:
+            self._shard_file.close()
+        self._doc_offsets_file.close()
+        index = {'dtype': self.dtype.name, 'shard_sizes': self.shard_sizes,
+                 'num_docs': self.num_docs}
+        tmp_path = self.path / 'index.json.tmp'
+        with open(tmp_path, 'w') as f:
+            json.dump(index, f)
+        os.replace(tmp_path, self.path / 'index.json')
@@ -0,0 +1,185 @@
+from typing import List, Sequence
+
+import numpy as np
+
+import torch
+import torch.distributed as dist
+
+from src.datamodules.fault_tolerant_sampler import FeistelPermutation
+
+
+def first_fit_decreasing(lengths: Sequence[int], capacity: int) -> List[List[int]]:
+    """Pack items of the given lengths (each <= capacity) into bins of the given capacity.
+    Items are placed from the longest to the shortest, each in the first bin that still has room.
+    Return:
+        bins: the indices of the items in each bin.
+    """
+    bins, bin_free = [], []
+    for idx in sorted(range(len(lengths)), key=lambda i: lengths[i], reverse=True):
+        length = lengths[idx]
+        assert length <= capacity
+        for b, free in enumerate(bin_free):
+            if free >= length:
+                bins[b].append(idx)
+                bin_free[b] -= length
+                break
+        else:
+            bins.append([idx])
+            bin_free.append(capacity - length)
+    return bins
+
+
+class PackedDocumentDataset(torch.utils.data.IterableDataset):
+
+    def __init__(self, tokens, seq_len, lookahead=1024, shuffle=False, seed=0):
+        """Pack whole documents into sequences of seq_len tokens, instead of cutting the
+        concatenated tokens every seq_len tokens (as LMDataset does).
+
+        tokens: MMapTokens, or anything with num_docs and document(i).
+        Documents are read in order (or shuffled with seed and the epoch, see set_epoch), and
+        every lookahead documents are bin-packed with first-fit-decreasing into sequences of
+        seq_len (input, target) pairs. The least full sequence isn't emitted, its documents are
+        packed again with the next lookahead documents. Documents longer than seq_len + 1 tokens
+        are split into pieces of seq_len + 1 tokens, that overlap by one token so no target is
+        lost.
+
+        Each item is the list of the documents (np arrays) in a sequence, to be batched with
+        VarlenCollator. Every DDP rank and dataloader worker packs all the documents, which only
+        needs their lengths, and takes every (world_size * num_workers)-th sequence. The last
+        sequences, that don't go around all of them, are dropped: every rank then gets the same
+        number of batches, which DDP needs to not hang at the end of the epoch.
+        """
+        super().__init__()
+        self.tokens = tokens
+        self.seq_len = seq_len
+        self.lookahead = lookahead
+        self.shuffle = shuffle
+        self.seed = seed
+        self.epoch = 0
+
+    def set_epoch(self, epoch):
+        """Called by SequenceModel.on_train_epoch_start, before the dataloader workers are
+        started, so that each epoch is shuffled differently.
+        """
+        self.epoch = epoch
+
+    def _doc_indices(self):
+        num_docs = self.tokens.num_docs
+        indices = (FeistelPermutation(num_docs, self.seed + self.epoch) if self.shuffle
+                   else range(num_docs))
+        for i in range(num_docs):
+            yield indices[i]
+
+    def _doc_len(self, idx):
+        doc_offsets = getattr(self.tokens, 'doc_offsets', None)
+        if doc_offsets is not None:  # Don't read the tokens of the documents we don't keep
+            return int(doc_offsets[idx + 1] - doc_offsets[idx])
+        return len(self.tokens.document(idx))
+
+    def _pieces(self):
+        """(document index, start, end) of each piece of at most seq_len + 1 tokens."""
+        for idx in self._doc_indices():
+            doc_len = self._doc_len(idx)
+            # A document of n tokens has n - 1 (input, target) pairs
+            for start in range(0, doc_len - 1, self.seq_len):
+                yield idx, start, min(start + self.seq_len + 1, doc_len)
+
+    def _pack(self, buffer, final=False):
+        """Pack the buffer, return the sequences to emit and the pieces to keep for later."""
+        bins = first_fit_decreasing([end - start - 1 for _, start, end in buffer], self.seq_len)
+        if not final and len(bins) > 1:
+            fill = [sum(buffer[i][2] - buffer[i][1] - 1 for i in b) for b in bins]
+            leftover = bins.pop(int(np.argmin(fill)))
+        else:
+            leftover = []
+        return [[buffer[i] for i in b] for b in bins], [buffer[i] for i in leftover]
+
+    def _sequences(self):
+        """The pieces of every packed sequence of the epoch, the same on every rank and worker."""
+        buffer = []
+        for piece in self._pieces():
+            buffer.append(piece)
+            if len(buffer) >= self.lookahead:
+                sequences, buffer = self._pack(buffer)
+                yield from sequences
+        if buffer:
+            sequences, _ = self._pack(buffer, final=True)
+            yield from sequences
+
+    def _shard(self):
+        """Index of this rank and dataloader worker, and the number of them."""
+        rank, world_size = 0, 1
+        if dist.is_available() and dist.is_initialized():
+            rank, world_size = dist.get_rank(), dist.get_world_size()
+        worker_info = torch.utils.data.get_worker_info()
+        worker_id, num_workers = (0, 1) if worker_info is None else (worker_info.id,
+                                                                     worker_info.num_workers)
+        return rank * num_workers + worker_id, world_size * num_workers
+
+    def __iter__(self):
+        shard, num_shards = self._shard()
+        group = []
+        for sequence in self._sequences():
+            group.append(sequence)
+            if len(group) == num_shards:
+                yield [self.tokens.document(idx)[start:end] for idx, start, end in group[shard]]
+                group = []
+
+
+class VarlenCollator:
+
+    def __init__(self, seq_len, pad_token_id=0, ignore_index=-100):
+        """Batch the sequences of PackedDocumentDataset, in the format of
+        GPTLMHeadModel.forward(input_ids, position_ids=..., cu_seqlens=..., max_seqlen=...), so
+        that attention doesn't cross from one document to another, e.g. with
+        flash_attn_varlen_func.
+
+        Returns a dict with:
+            input_ids, labels, position_ids: (batch, seq_len) int64. position_ids restart at 0 at
+                the start of each document. Padding at the end of a row has labels ignore_index.
+            cu_seqlens: (num_segments + 1,) int32, where each segment starts in
+                input_ids.flatten(). A segment is a document, or the padding at the end of a row:
+                the padding gets its own segment, so that it doesn't attend to the last document
+                of the row (its labels are ignore_index anyway). The attention kernels need every
+                token to be in a segment.
+            max_seqlen: int, the length of the longest segment.
+            doc_cu_seqlens: (num_documents + 1,) int32, like cu_seqlens but without the padding
+                segments, for counting the useful work (e.g. FLOPs). Not an input of the model.
+        """
+        self.seq_len = seq_len
+        self.pad_token_id = pad_token_id
+        self.ignore_index = ignore_index
+
+    def __call__(self, sequences):
+        batch_size = len(sequences)
+        input_ids = np.full((batch_size, self.seq_len), self.pad_token_id, dtype=np.int64)
+        labels = np.full((batch_size, self.seq_len), self.ignore_index, dtype=np.int64)
+        position_ids = np.zeros((batch_size, self.seq_len), dtype=np.int64)
+        seqlens, is_padding = [], []
+        for row, docs in enumerate(sequences):
+            start = 0
+            for doc in docs:
+                n = len(doc) - 1
+                assert start + n <= self.seq_len
+                input_ids[row, start:start + n] = doc[:-1]
+                labels[row, start:start + n] = doc[1:]
+                position_ids[row, start:start + n] = np.arange(n)
+                seqlens.append(n)
+                is_padding.append(False)
+                start += n
+            if start < self.seq_len:
+                position_ids[row, start:] = np.arange(self.seq_len - start)
+                seqlens.append(self.seq_len - start)
+                is_padding.append(True)
+        seqlens = np.array(seqlens, dtype=np.int64)
+        cu_seqlens = np.concatenate([[0], np.cumsum(seqlens)]).astype(np.int32)
+        doc_seqlens = seqlens[~np.array(is_padding, dtype=bool)]
+        doc_cu_seqlens = np.concatenate([[0], np.cumsum(doc_seqlens)]).astype(np.int32)
+        return {
+            'input_ids': torch.from_numpy(input_ids),
+            'labels': torch.from_numpy(labels),
+            'position_ids': torch.from_numpy(position_ids),
+            'cu_seqlens': torch.from_numpy(cu_seqlens),
+            'max_seqlen': int(seqlens.max()),
+            'doc_cu_seqlens': torch.from_numpy(doc_cu_seqlens),
+        }
@@ -0,0 +1,182 @@
+import hashlib
+import json
+import multiprocessing
+import os
+from concurrent.futures import ProcessPoolExecutor
+from itertools import chain
+from pathlib import Path
+from typing import Callable, Dict, List, Optional
+
+import numpy as np
+
+from src.datamodules.datasets.mmap_tokens import MMapTokens
+from src.utils.utils import get_logger
+logger = get_logger()
+
+
+PART_NAME = 'part_{:05d}'
+
+# Set in each worker process by _init_worker
+_worker_args = None
+
+
+def _init_worker(*args):
+    global _worker_args
+    _worker_args = args
+
+
+def _sha256(filename, chunk_size=1 << 24):
+    h = hashlib.sha256()
+    with open(filename, 'rb') as f:
+        for chunk in iter(lambda: f.read(chunk_size), b''):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def _write_json(filename, obj):
+    tmp_filename = f'{filename}.tmp'
+    with open(tmp_filename, 'w') as f:
+        json.dump(obj, f)
+    os.replace(tmp_filename, filename)
+
+
+def _part_is_complete(part_path, start, end, fingerprint):
+    """Whether the part was fully written, with the same fingerprint, and its files match their
+    checksums.
+    """
+    manifest_path = part_path.with_suffix('.json')
+    if not manifest_path.is_file():
+        return False
+    with open(manifest_path) as f:
+        manifest = json.load(f)
+    if (manifest['start'], manifest['end']) != (start, end):
+        return False
+    if manifest.get('fingerprint') != fingerprint:
+        return False
+    for suffix in ['.bin', '.lens']:
+        filename = part_path.with_suffix(suffix)
+        if not filename.is_file() or _sha256(filename) != manifest['sha256'][suffix]:
+            return False
+    return True
+
+
+def _tokenize_part(name, part_idx, start, end):
+    """Tokenize examples [start, end) of split @name into part @part_idx, streaming the token ids
+    to part_XXXXX.bin and the document lengths to part_XXXXX.lens.
+    The manifest part_XXXXX.json, with the checksums, is written last.
+    """
+    datasets, tokenize_fn, path, dtype, batch_size, fingerprint = _worker_args
+    dataset = datasets[name]
+    part_path = path / name / PART_NAME.format(part_idx)
+    hashes = {'.bin': hashlib.sha256(), '.lens': hashlib.sha256()}
+    num_tokens, num_docs = 0, 0
+    with open(f'{part_path}.bin.tmp', 'wb') as f_tokens, \
+            open(f'{part_path}.lens.tmp', 'wb') as f_lens:
+        for batch_start in range(start, end, batch_size):
+            doc_ids = tokenize_fn(dataset[batch_start:min(batch_start + batch_size, end)])
+            doc_lens = np.array([len(ids) for ids in doc_ids], dtype=np.int64)
+            token_ids = np.fromiter(chain.from_iterable(doc_ids), dtype=dtype,
+                                    count=int(doc_lens.sum()))
+            for f, suffix, array in [(f_tokens, '.bin', token_ids), (f_lens, '.lens', doc_lens)]:
+                data = array.tobytes()
+                f.write(data)
+                hashes[suffix].update(data)
+            num_tokens += len(token_ids)
+            num_docs += len(doc_lens)
+    for suffix in hashes:
+        os.replace(f'{part_path}{suffix}.tmp', part_path.with_suffix(suffix))
+    _write_json(part_path.with_suffix('.json'), {
+        'start': start, 'end': end, 'num_tokens': num_tokens, 'num_docs': num_docs,
+        'sha256': {suffix: h.hexdigest() for suffix, h in hashes.items()},
+        'fingerprint': fingerprint,
+    })
+    return name, part_idx
+
+
+def _write_index(split_path, num_parts, dtype, chunk_size=1 << 20):
+    """Use the parts as the shards of a MMapTokens directory. Only the document lengths are
+    read, a chunk at a time, to write the document offsets.
+    """
+    shard_names, shard_sizes, num_docs, offset = [], [], 0, 0
+    with open(split_path / 'doc_offsets.bin.tmp', 'wb') as f:
+        f.write(np.zeros(1, dtype=np.int64).tobytes())
+        for part_idx in range(num_parts):
+            part_path = split_path / PART_NAME.format(part_idx)
+            with open(part_path.with_suffix('.json')) as f_manifest:
+                manifest = json.load(f_manifest)
+            if manifest['num_docs'] > 0:
+                doc_lens = np.memmap(part_path.with_suffix('.lens'), dtype=np.int64, mode='r')
+                for chunk_start in range(0, len(doc_lens), chunk_size):
+                    chunk = doc_lens[chunk_start:chunk_start + chunk_size]
+                    doc_offsets = offset + np.cumsum(chunk, dtype=np.int64)
+                    f.write(doc_offsets.tobytes())
+                    offset = int(doc_offsets[-1])
+                num_docs += manifest['num_docs']
+            # Shards can't be empty
+            if manifest['num_tokens'] > 0:
+                shard_names.append(part_path.with_suffix('.bin').name)
+                shard_sizes.append(manifest['num_tokens'])
+    os.replace(split_path / 'doc_offsets.bin.tmp', split_path / 'doc_offsets.bin')
+    _write_json(split_path / 'index.json', {
+        'dtype': np.dtype(dtype).name, 'shard_sizes': shard_sizes, 'shard_names': shard_names,
+        'num_docs': num_docs,
+    })
+
+
+def tokenize_to_mmap_tokens(datasets: Dict, tokenize_fn: Callable[[Dict], List[List[int]]],
+                            path, dtype, num_parts: int = 256, num_proc: int = 1,
+                            batch_size: int = 1000,
+                            fingerprint: Optional[str] = None) -> Dict[str, MMapTokens]:
+    """Tokenize each split of @datasets in parallel, into path / split in the MMapTokens format.
+
+    Each split is cut into num_parts contiguous ranges of examples, that num_proc worker processes
+    tokenize independently. A part streams its token ids to part_XXXXX.bin and its document
+    lengths to part_XXXXX.lens, and once they're complete, writes their SHA-256 checksums to
+    part_XXXXX.json. When rerun after an interruption (with the same num_parts and fingerprint),
+    the parts whose files match their checksums are skipped, so only the parts that were in
+    flight are redone.
+    The parts are then used as is as the shards of the split: making the index only streams over
+    the document lengths, and the tokens are never concatenated or held in memory.
+
+    Arguments:
+        datasets: split name -> dataset, that supports len() and slicing into a dict of columns
+            (e.g. a HF Dataset).
+        tokenize_fn: maps such a dict of columns to the list of token ids of each example.
+        dtype: np.uint16 or np.uint32.
+        fingerprint (optional): str identifying the datasets and tokenizer, e.g. a hash of their
+            settings. Parts written with another fingerprint are tokenized again.
+    Return:
+        split name -> MMapTokens
+    """
+    path = Path(path)
+    assert np.dtype(dtype) in [np.uint16, np.uint32]
+    tasks, num_skipped = [], 0
+    for name, dataset in datasets.items():
+        (path / name).mkdir(parents=True, exist_ok=True)
+        bounds = np.linspace(0, len(dataset), num_parts + 1).astype(np.int64).tolist()
+        for part_idx in range(num_parts):
+            part_path = path / name / PART_NAME.format(part_idx)
+            start, end = bounds[part_idx], bounds[part_idx + 1]
+            if _part_is_complete(part_path, start, end, fingerprint):
+                num_skipped += 1
+            else:
+                tasks.append((name, part_idx, start, end))
+    logger.info(f'Tokenizing {len(tasks)} parts, {num_skipped} parts were already done')
+    worker_args = (datasets, tokenize_fn, path, dtype, batch_size, fingerprint)
+    if num_proc <= 1:
+        _init_worker(*worker_args)
+        for task in tasks:
+            _tokenize_part(*task)
+    else:
+        # Fork, so that the datasets and tokenize_fn (often a lambda) don't need to be pickled.
+        # The thread pool of HF fast tokenizers doesn't survive a fork and can deadlock the
+        # workers, so they tokenize single-threaded (we already have num_proc processes).
+        os.environ['TOKENIZERS_PARALLELISM'] = 'false'
+        with ProcessPoolExecutor(max_workers=num_proc,
+                                 mp_context=multiprocessing.get_context('fork'),
+                                 initializer=_init_worker, initargs=worker_args) as executor:
+            for future in [executor.submit(_tokenize_part, *task) for task in tasks]:
+                future.result()
+    for name in datasets:
+        _write_index(path / name, num_parts, dtype)
+    return {name: MMapTokens(path / name) for name in datasets}
@@ -1,11 +1,59 @@
 # Adapted from https://github.com/Lightning-AI/lightning/blob/2845e7565dbe6b765ae32870e7d2bc456529c30a/tests/tests_pytorch/utilities/test_auto_restart.py#L1397
 from typing import Iterator
-import math
 
 import torch
 from torch.utils.data import RandomSampler, DistributedSampler
 
 
+_MASK64 = (1 << 64) - 1
+
+
+def _mix64(x):
+    """SplitMix64 finalizer: a bijective, well-mixed hash of 64-bit integers."""
+    x = (x + 0x9E3779B97F4A7C15) & _MASK64
+    x = ((x ^ (x >> 30)) * 0xBF58476D1CE4E5B9) & _MASK64
+    x = ((x ^ (x >> 27)) * 0x94D049BB133111EB) & _MASK64
+    return x ^ (x >> 31)
+
+
+class FeistelPermutation:
+    """Pseudo-random permutation of range(n), where perm[i] is computed on the fly instead of
+    materializing torch.randperm(n). It takes O(1) memory, and starting from the i-th element
+    (e.g. when resuming) costs nothing.
+
+    i is encrypted with a balanced Feistel network over 2 * half_bits bits, the smallest with
+    2 ** (2 * half_bits) >= n. This is a bijection whatever the round function, and values >= n
+    are encrypted again (cycle walking) until they fall in range(n), which keeps it a bijection of
+    range(n). Since 2 ** (2 * half_bits) < 4 * n, that's fewer than 4 encryptions on average.
+    """
+
+    def __init__(self, n, seed, num_rounds=6):
+        self.n = n
+        self.half_bits = max(((n - 1).bit_length() + 1) // 2, 1)
+        self.mask = (1 << self.half_bits) - 1
+        self.keys = [_mix64((seed & _MASK64) ^ _mix64(r)) for r in range(num_rounds)]
+
+    def __len__(self):
+        return self.n
+
+    def _encrypt(self, x):
+        left, right = x >> self.half_bits, x & self.mask
+        for key in self.keys:
+            left, right = right, left ^ (_mix64(right ^ key) & self.mask)
+        return (left << self.half_bits) | right
+
+    def __getitem__(self, i):
+        if not 0 <= i < self.n:
+            raise IndexError(f'index {i} is out of range for a permutation of {self.n}')
+        x = self._encrypt(i)
+        while x >= self.n:
+            x = self._encrypt(x)
+        return x
+
+    def __iter__(self) -> Iterator[int]:
+        return (self[i] for i in range(self.n))
+
+
 class RandomFaultTolerantSampler(RandomSampler):
 
     def __init__(self, *args, generator=None, **kwargs):
@@ -44,18 +92,20 @@ class RandomFaultTolerantSampler(RandomSampler):
         n = len(self.data_source)
 
         self.state = self.generator.get_state()
-        indices = torch.randperm(n, generator=self.generator).tolist()
+        # The permutation is computed on the fly from a seed (see FeistelPermutation), so that
+        # big datasets don't need a randperm in each worker, and resuming doesn't skip through it.
+        seed = int(torch.randint(1 << 62, (), generator=self.generator).item())
+        indices = FeistelPermutation(n, seed)
 
         if not self.restarting:
             self.counter = 0
         else:
-            indices = indices[self.counter:]
             self.restarting = False
         # self.start_counter = self.counter
 
-        for index in indices:
+        for i in range(self.counter, n):
             self.counter += 1
-            yield index
+            yield indices[i]
 
         self.counter = 0
         # self.start_counter = self.counter
@@ -84,40 +134,27 @@ class FaultTolerantDistributedSampler(DistributedSampler):
         # return self.num_samples - self.start_counter
 
     def __iter__(self):
+        n = len(self.dataset)  # type: ignore[arg-type]
         if self.shuffle:
-            # deterministically shuffle based on epoch and seed
-            g = torch.Generator()
-            g.manual_seed(self.seed + self.epoch)
-            indices = torch.randperm(len(self.dataset), generator=g).tolist()  # type: ignore[arg-type]
-        else:
-            indices = list(range(len(self.dataset)))  # type: ignore[arg-type]
-
-        if not self.drop_last:
-            # add extra samples to make it evenly divisible
-            padding_size = self.total_size - len(indices)
-            if padding_size <= len(indices):
-                indices += indices[:padding_size]
-            else:
-                indices += (indices * math.ceil(padding_size / len(indices)))[:padding_size]
+            # deterministically shuffle based on epoch and seed, computing each index on the fly
+            # (see FeistelPermutation) instead of materializing a randperm
+            indices = FeistelPermutation(n, self.seed + self.epoch)
         else:
-            # remove tail of data to make it evenly divisible.
-            indices = indices[:self.total_size]
-        assert len(indices) == self.total_size
+            indices = range(n)
 
-        # subsample
-        indices = indices[self.rank:self.total_size:self.num_replicas]
-        assert len(indices) == self.num_samples
+        # Position i of the padded (if not drop_last, by repeating the first indices) or truncated
+        # (if drop_last) list of indices is indices[i % n]. Each rank takes every num_replicas-th.
 
         if not self.restarting:
             self.counter = 0
         else:
-            indices = indices[self.counter:]
             self.restarting = False
         # self.start_counter = self.counter
 
-        for index in indices:
+        for i in range(self.rank + self.counter * self.num_replicas, self.total_size,
+                       self.num_replicas):
             self.counter += 1
-            yield index
+            yield indices[i % n]
 
         self.counter = 0
         # self.start_counter = self.counter
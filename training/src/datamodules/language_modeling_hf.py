@@ -1,6 +1,9 @@
 # Adapted from https://github.com/huggingface/transformers/blob/master/examples/pytorch/language-modeling/run_clm.py
 from itertools import chain
 from pathlib import Path
+import hashlib
+import json
+import os
 import pickle
 from typing import Any, List, Union
 import subprocess
@@ -18,6 +21,9 @@ from datasets import load_dataset
 from pytorch_lightning import LightningDataModule
 
 from src.datamodules.datasets.lm_dataset import LMDataset
+from src.datamodules.datasets.mmap_tokens import MMapTokens
+from src.datamodules.datasets.packing import PackedDocumentDataset, VarlenCollator
+from src.datamodules.datasets.parallel_tokenize import tokenize_to_mmap_tokens
 from src.datamodules.fault_tolerant_sampler import RandomFaultTolerantSampler
 from src.datamodules.fault_tolerant_sampler import FaultTolerantDistributedSampler
 from src.datamodules.datasets.detokenizer import DATASET_TOKENIZATION_REGISTRY
@@ -44,7 +50,8 @@ class LMDataModule(LightningDataModule):
                  detokenize=False, val_only=False, batch_size=32, batch_size_eval=None, num_workers=1,
                  shuffle=False, pin_memory=False, drop_last=False, fault_tolerant=False, ddp=False,
                  fast_forward_epochs=None, fast_forward_batches=None,
-                 use_shmem=True):
+                 use_shmem=True, mmap_shards=False, num_tokenize_parts=256,
+                 pack_documents=False, packing_lookahead=1024):
         super().__init__()
         self.dataset_name = dataset_name
         self.dataset_config_name = dataset_config_name
@@ -76,6 +83,22 @@ class LMDataModule(LightningDataModule):
         self.use_shmem = use_shmem
         if self.use_shmem:
             assert cache_dir is not None
+        # Tokenize with num_workers processes into memory-mapped shards in cache_dir (see
+        # tokenize_to_mmap_tokens and MMapTokens), instead of through shared memory / np.save.
+        # Tokenization resumes where it stopped if interrupted, loading is then independent of
+        # the size of the corpus, and dataloader workers read from the page cache, zero-copy.
+        self.mmap_shards = mmap_shards
+        self.num_tokenize_parts = num_tokenize_parts
+        if self.mmap_shards:
+            assert cache_dir is not None
+        # Pack whole documents into each sequence (see PackedDocumentDataset), with batches in the
+        # varlen format (see VarlenCollator) so attention doesn't cross documents.
+        # This needs the document boundaries of mmap_shards.
+        self.pack_documents = pack_documents
+        self.packing_lookahead = packing_lookahead
+        if self.pack_documents:
+            assert self.mmap_shards
+            assert not self.fault_tolerant, 'Packing does not support fault-tolerant sampling'
 
     def prepare_data(self):
         if self.cache_dir is None:  # Just download the dataset
@@ -89,6 +112,14 @@ class LMDataModule(LightningDataModule):
         concat_ids, self.tokenizer = self.process_dataset()
         self.vocab_size = len(self.tokenizer)
         # Create all splits
+        if self.pack_documents:
+            self.dataset_train, self.dataset_val, self.dataset_test = [
+                PackedDocumentDataset(concat_ids[split], seq_len=self.max_length,
+                                      lookahead=self.packing_lookahead,
+                                      shuffle=self.shuffle and split == 'train')
+                for split in ['train', 'validation', 'test']
+            ]
+            return
         self.dataset_train, self.dataset_val, self.dataset_test = [
             LMDataset(concat_ids[split], seq_len=self.max_length)
             for split in ['train', 'validation', 'test']
@@ -127,6 +158,8 @@ class LMDataModule(LightningDataModule):
                     desc='Running detokenizer on dataset'
                 )
 
+        # datasets.map and tokenize_to_mmap_tokens fork, see tokenize_to_mmap_tokens
+        os.environ['TOKENIZERS_PARALLELISM'] = 'false'
         tokenizer = AutoTokenizer.from_pretrained(self.tokenizer_name, use_fast=True)
         # Preprocessing the datasets.
         # First we tokenize all the texts.
@@ -151,6 +184,22 @@ class LMDataModule(LightningDataModule):
         #     remove_columns=column_names,
         #     desc="Running tokenizer on dataset",
         # )
+        if self.mmap_shards:
+            # Write to a temporary directory that is renamed once complete, since a cache
+            # directory that exists is assumed to be complete. The parts that are already in the
+            # temporary directory are reused.
+            tmp_dir = cache_dir.parent / f'{cache_dir.name}.tmp'
+            tokenize_to_mmap_tokens(
+                dict(raw_datasets), lambda examples: tokenize(examples)['input_ids'], tmp_dir,
+                dtype=np.uint16 if tokenizer.vocab_size < 64 * 1024 else np.uint32,
+                num_parts=self.num_tokenize_parts, num_proc=max(self.num_workers, 1),
+                fingerprint=self._fingerprint
+            )
+            with open(tmp_dir / 'tokenizer.pkl', 'wb') as f:
+                pickle.dump(tokenizer, f)
+            tmp_dir.rename(cache_dir)
+            return self._load_from_cache(cache_dir)
+
         dtype = np.uint16 if tokenizer.vocab_size < 64 * 1024 else np.int32
         def tokenize_concat(examples):
             # We just need 'input_ids', not 'attention_mask' (since it's all 1)
@@ -240,19 +289,37 @@ class LMDataModule(LightningDataModule):
     def _load_from_cache(self, cache_dir):
         assert cache_dir.is_dir()
         logger.info(f'Load from cache at {str(cache_dir)}')
-        concat_ids = {split: np.load(cache_dir / f'{split}.npy', mmap_mode='r')
+        concat_ids = {split: (MMapTokens(cache_dir / split)
+                              if (cache_dir / split / 'index.json').is_file()
+                              else np.load(cache_dir / f'{split}.npy', mmap_mode='r'))
                       for split in ['train', 'validation', 'test']}
         with open(cache_dir / 'tokenizer.pkl', 'rb') as f:
             tokenizer = pickle.load(f)
         return concat_ids, tokenizer
 
+    @property
+    def _fingerprint(self):
+        """Stable hash of all the settings that the tokenized dataset depends on. Unlike hash(),
+        it's the same across processes and runs, so the cache is found again.
+        """
+        settings = {
+            'dataset_name': self.dataset_name, 'dataset_config_name': self.dataset_config_name,
+            'tokenizer_name': self.tokenizer_name, 'val_ratio': self.val_ratio,
+            'val_split_seed': self.val_split_seed, 'val_only': self.val_only,
+            'add_eos': self.add_eos, 'detokenize': self.detokenize,
+        }
+        return hashlib.sha256(json.dumps(settings, sort_keys=True).encode()).hexdigest()[:16]
+
     @property
     def _cache_dir_name(self):
-        return f'tokenizer_name-{self.tokenizer_name}-val_ratio-{self.val_ratio}-val_split_seed-{self.val_split_seed}-add_eos-{self.add_eos}-detokenize-{self.detokenize}'
+        return f'tokenizer_name-{self.tokenizer_name}-val_ratio-{self.val_ratio}-val_split_seed-{self.val_split_seed}-add_eos-{self.add_eos}-detokenize-{self.detokenize}-{self._fingerprint}'
 
     def train_dataloader(self, *args: Any, **kwargs: Any) -> DataLoader:
         """ The train dataloader """
-        if self.shuffle and self.fault_tolerant:
+        if self.pack_documents:  # PackedDocumentDataset shuffles the documents itself
+            shuffle = False
+            sampler = None
+        elif self.shuffle and self.fault_tolerant:
             shuffle = False
             sampler = (FaultTolerantDistributedSampler(self.dataset_train) if self.ddp
                        else RandomFaultTolerantSampler(self.dataset_train))
@@ -287,6 +354,7 @@ class LMDataModule(LightningDataModule):
             sampler=sampler,
             drop_last=self.drop_last,
             pin_memory=self.pin_memory,
+            collate_fn=VarlenCollator(self.max_length) if self.pack_documents else None,
             # persistent_workers=True
         )
 
@@ -72,7 +72,9 @@ def evaluate(config: DictConfig) -> None:
                                                                  _recursive_=False)
         if 'ckpt' in config.eval:
             load_return = trained_model.model.load_state_dict(
-                load_checkpoint(config.eval.ckpt, device=trained_model.device), strict=False
+                load_checkpoint(config.eval.ckpt, device=trained_model.device,
+                                lazy=config.eval.get('lazy_load', False)),
+                strict=False
             )
             log.info(load_return)
         if 'model_pretrained' in config:
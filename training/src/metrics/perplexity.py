@@ -56,7 +56,8 @@ class Perplexity(Metric):
             target:
                 Ground truth values with a shape [batch_size, seq_len].
         """
-        count = target.numel()
+        # The loss is averaged over the targets that aren't ignored (e.g. padding of packed batches)
+        count = (target != self.loss_fn.ignore_index).sum()
         if loss is None:
             loss = self.loss_fn(preds, target)
         self.total_log_probs += loss.double() * count
@@ -14,6 +14,11 @@ from src.utils.utils import get_logger
 from src.optim.param_grouping import group_parameters_for_optimizer
 from src.utils.checkpoint import load_checkpoint
 
+try:
+    from flash_attn.losses.cross_entropy import FusedLinearCrossEntropyLoss
+except ImportError:
+    FusedLinearCrossEntropyLoss = None
+
 logger = get_logger(__name__)
 
 
@@ -123,6 +128,14 @@ class SequenceModel(LightningModule):
     def test_step(self, batch: Any, batch_idx: int):
         return self.shared_step(batch, batch_idx, phase='test')
 
+    def on_train_epoch_start(self):
+        # Datasets that shuffle themselves (e.g. PackedDocumentDataset, an IterableDataset) have
+        # no sampler for Lightning to call set_epoch on. This runs before the dataloader workers
+        # are started, which then get a copy of the dataset with the new epoch.
+        dataset = getattr(self._datamodule, 'dataset_train', None)
+        if callable(getattr(dataset, 'set_epoch', None)):
+            dataset.set_epoch(self.current_epoch)
+
     def configure_optimizers(self):
         if 'optimizer_param_grouping' in self.cfg.train:  # Set zero weight decay for some params
             parameters = group_parameters_for_optimizer(self.model, self.cfg.train.optimizer,
@@ -169,11 +182,27 @@ class SequenceModel(LightningModule):
 class SequenceLMModel(SequenceModel):
 
     def step(self, batch: Any, is_train=True):
-        x, y = batch
-        output = self.forward(x).logits
+        loss_fn = self.loss_fn if is_train else self.loss_fn_val
+        # With loss_fn FusedLinearCrossEntropyLoss, the model computes the loss together with its
+        # LM head (GPTLMHeadModel only) and never materializes the logits, so the output is None
+        # and only metrics that use the loss (perplexity, num-tokens) can be computed.
+        # The labels from the datamodules are already shifted, as the model expects.
+        fused_loss = (FusedLinearCrossEntropyLoss is not None
+                      and isinstance(loss_fn, FusedLinearCrossEntropyLoss))
+        kwargs = {}
+        if isinstance(batch, dict):  # Packed documents, from VarlenCollator
+            x, y = batch['input_ids'], batch['labels']
+            kwargs = dict(position_ids=batch['position_ids'], cu_seqlens=batch['cu_seqlens'],
+                          max_seqlen=batch['max_seqlen'])
+        else:
+            x, y = batch
+        if fused_loss:
+            loss = self.forward(x, labels=y, loss_fn=loss_fn, **kwargs).loss
+            return loss, None, rearrange(y, '... -> (...)')
+        output = self.forward(x, **kwargs).logits
         output = rearrange(output, '... C -> (...) C')
         y = rearrange(y, '... -> (...)')
-        loss = self.loss_fn(output, y) if is_train else self.loss_fn_val(output, y)
+        loss = loss_fn(output, y)
         return loss, output, y
 
     def shared_step(self, batch: Any, batch_idx: int, phase='train'):
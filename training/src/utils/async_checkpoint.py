@@ -0,0 +1,231 @@
+import io
+import json
+import os
+import pickle
+import struct
+import time
+from concurrent.futures import Future, ThreadPoolExecutor
+from pathlib import Path
+from typing import Any, Dict, List, Optional
+
+import numpy as np
+
+import torch
+import torch.distributed as dist
+
+
+MANIFEST_NAME = 'manifest.json'
+RANK_MANIFEST_NAME = 'rank_{:03d}.json'
+# Where each tensor starts in the data section of a file
+ALIGNMENT = 64
+
+
+def _align(n):
+    return (n + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+
+class _TensorPickler(pickle.Pickler):
+    """Pickle everything but the tensors, which are replaced by their index in self.tensors."""
+
+    def __init__(self, file):
+        super().__init__(file, protocol=pickle.HIGHEST_PROTOCOL)
+        self.tensors = []
+
+    def persistent_id(self, obj):
+        if isinstance(obj, torch.Tensor):
+            self.tensors.append(obj.detach())
+            return len(self.tensors) - 1
+        return None
+
+
+class _TensorUnpickler(pickle.Unpickler):
+
+    def __init__(self, file, tensors):
+        super().__init__(file)
+        self.tensors = tensors
+
+    def persistent_load(self, pid):
+        return self.tensors[pid]
+
+
+def _write_file(filename, header, data):
+    """Write [header length][header][padding][data] to filename, atomically."""
+    tmp_filename = f'{filename}.tmp'
+    with open(tmp_filename, 'wb') as f:
+        f.write(struct.pack('<Q', len(header)))
+        f.write(header)
+        f.write(b'\0' * (_align(8 + len(header)) - 8 - len(header)))
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+    os.replace(tmp_filename, filename)
+    return os.path.getsize(filename)
+
+
+def _write_json(filename, obj):
+    tmp_filename = f'{filename}.tmp'
+    with open(tmp_filename, 'w') as f:
+        json.dump(obj, f)
+        f.flush()
+        os.fsync(f.fileno())
+    os.replace(tmp_filename, filename)
+
+
+def _read_file(filename, map_location=None):
+    with open(filename, 'rb') as f:
+        header_len, = struct.unpack('<Q', f.read(8))
+        header = pickle.loads(f.read(header_len))
+        f.seek(_align(8 + header_len))
+        data = torch.from_numpy(np.fromfile(f, dtype=np.uint8))
+    tensors = []
+    for offset, dtype, shape in header['tensors']:
+        numel = int(np.prod(shape))
+        nbytes = numel * torch.empty((), dtype=dtype).element_size()
+        tensor = data[offset:offset + nbytes].view(dtype).view(shape)
+        tensors.append(tensor if map_location is None else tensor.to(map_location))
+    return _TensorUnpickler(io.BytesIO(header['pickle']), tensors).load()
+
+
+class AsyncShardedCheckpointer:
+    """Save the checkpoint shard of each rank without stalling training on the file writes.
+
+    save() snapshots the objects of this rank: their tensors are copied (asynchronously, if on
+    GPU) into a pinned host staging buffer that is reused from one save to the next, and the rest
+    is pickled. The files are then written from a background thread, while training continues:
+    each object goes to its own file, [header][tensor bytes], written to a temporary file and
+    renamed. Once all of its files are on disk, a rank writes rank_XXX.json, and rank 0 commits
+    the checkpoint by writing manifest.json once every rank has. A directory without
+    manifest.json is an incomplete checkpoint. Every rank has to call save() (it broadcasts a
+    token that tells this save's rank_XXX.json apart from those of earlier saves to the same
+    directory).
+
+    The next save() waits for the previous one to be written, since they share the staging
+    buffer. wait() waits for the current one, and raises if it failed.
+
+    The directory has to be on a file system that all ranks share.
+    """
+
+    def __init__(self, rank: int, world_size: int, commit_timeout: float = 3600.0):
+        self.rank = rank
+        self.world_size = world_size
+        self.commit_timeout = commit_timeout
+        self._buffer = None
+        self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix='checkpoint')
+        self._future: Optional[Future] = None
+
+    def _staging_buffer(self, nbytes):
+        if self._buffer is None or self._buffer.numel() < nbytes:
+            self._buffer = None  # Free the old buffer first
+            self._buffer = torch.empty(nbytes, dtype=torch.uint8,
+                                       pin_memory=torch.cuda.is_available())
+        return self._buffer
+
+    def _snapshot(self, objects: Dict[str, Any]):
+        pickled = {}
+        for name, obj in objects.items():
+            f = io.BytesIO()
+            pickler = _TensorPickler(f)
+            pickler.dump(obj)
+            pickled[name] = (f.getvalue(), pickler.tensors)
+        nbytes = sum(_align(t.numel() * t.element_size()) for _, tensors in pickled.values()
+                     for t in tensors)
+        buffer = self._staging_buffer(nbytes)
+        snapshot, start, is_cuda = {}, 0, False
+        for name, (pickle_bytes, tensors) in pickled.items():
+            metas, offset = [], 0
+            for t in tensors:
+                size = t.numel() * t.element_size()
+                staged = buffer[start + offset:start + offset + size].view(t.dtype).view(t.shape)
+                # Ordered before any later kernel that modifies t on the current stream
+                staged.copy_(t, non_blocking=True)
+                is_cuda = is_cuda or t.is_cuda
+                metas.append((offset, t.dtype, tuple(t.shape)))
+                offset += _align(size)
+            header = pickle.dumps({'pickle': pickle_bytes, 'tensors': metas})
+            snapshot[name] = (header, buffer[start:start + offset])
+            start += offset
+        event = None
+        if is_cuda:
+            event = torch.cuda.Event()
+            event.record()
+        return snapshot, event
+
+    def save(self, path, objects: Dict[str, Any]) -> Future:
+        """Save objects (file name -> object) of this rank to the directory path, in the
+        background. The objects can be modified as soon as this returns.
+        """
+        self.wait()
+        path = Path(path)
+        path.mkdir(parents=True, exist_ok=True)
+        token = [os.urandom(8).hex() if self.rank == 0 else None]
+        if self.world_size > 1:
+            dist.broadcast_object_list(token, src=0)
+        if self.rank == 0:  # The directory no longer holds a complete checkpoint
+            (path / MANIFEST_NAME).unlink(missing_ok=True)
+        snapshot, event = self._snapshot(objects)
+        self._future = self._executor.submit(self._write, path, snapshot, event, token[0])
+        return self._future
+
+    def _write(self, path, snapshot, event, token):
+        if event is not None:
+            event.synchronize()
+        sizes = {name: _write_file(path / name, header, data.numpy())
+                 for name, (header, data) in snapshot.items()}
+        _write_json(path / RANK_MANIFEST_NAME.format(self.rank), {'token': token, 'files': sizes})
+        if self.rank == 0:
+            self._commit(path, token)
+
+    def _commit(self, path, token):
+        files, deadline = {}, time.monotonic() + self.commit_timeout
+        for r in range(self.world_size):
+            while True:
+                try:
+                    with open(path / RANK_MANIFEST_NAME.format(r)) as f:
+                        rank_manifest = json.load(f)
+                    if rank_manifest['token'] == token:
+                        break
+                except FileNotFoundError:
+                    pass
+                if time.monotonic() > deadline:
+                    raise TimeoutError(f'Rank {r} did not finish writing its shard of {path}')
+                time.sleep(0.1)
+            files.update(rank_manifest['files'])
+        _write_json(path / MANIFEST_NAME, {'world_size': self.world_size, 'files': files})
+
+    def wait(self):
+        if self._future is not None:
+            future, self._future = self._future, None
+            future.result()
+
+    def close(self):
+        self.wait()
+        self._executor.shutdown()
+
+
+def is_sharded_checkpoint(path) -> bool:
+    return (Path(path) / MANIFEST_NAME).is_file()
+
+
+def load_sharded_checkpoint(path, names: List[str], map_location=None,
+                            num_threads: int = 4) -> Dict[str, Any]:
+    """Load the files names of the checkpoint that AsyncShardedCheckpointer committed to path,
+    in parallel. Each rank only reads the files it needs (e.g. its own shard).
+    map_location: where to put the tensors, for all the files or as a dict file name -> device.
+    """
+    path = Path(path)
+    if not is_sharded_checkpoint(path):
+        raise ValueError(f'{path} is not a complete checkpoint, {MANIFEST_NAME} is missing')
+    with open(path / MANIFEST_NAME) as f:
+        manifest = json.load(f)
+    for name in names:
+        if name not in manifest['files']:
+            raise ValueError(f'{name} is not in the checkpoint at {path}, which was saved with '
+                             f'world size {manifest["world_size"]}')
+        if os.path.getsize(path / name) != manifest['files'][name]:
+            raise ValueError(f'{path / name} does not have the size in the manifest')
+    if not isinstance(map_location, dict):
+        map_location = {name: map_location for name in names}
+    with ThreadPoolExecutor(max_workers=num_threads) as executor:
+        objects = executor.map(lambda name: _read_file(path / name, map_location.get(name)),
+                               names)
+        return dict(zip(names, objects))
@@ -5,7 +5,14 @@ import torch
 import math
 from einops import rearrange
 
-def load_checkpoint(path, device='cpu'):
+from flash_attn.utils.lazy_load import lazy_load_file
+
+
+def load_checkpoint(path, device='cpu', lazy=False):
+    """If lazy, the checkpoint is memory-mapped and its tensors are LazyTensors, read only when
+    they're copied into the parameters by model.load_state_dict (device is then ignored, the data
+    is copied straight to the device of the parameters).
+    """
     path = Path(path).expanduser()
     is_deepspeed = False
     if path.is_dir():  # DeepSpeed checkpoint
@@ -17,7 +24,10 @@ def load_checkpoint(path, device='cpu'):
         else:
             raise ValueError(f"Unable to find 'latest' file at {latest_path}")
         path /= f'{tag}/mp_rank_00_model_states.pt'
-    state_dict = torch.load(path, map_location=device, weights_only=True)
+    if lazy:
+        state_dict = lazy_load_file(path)
+    else:
+        state_dict = torch.load(path, map_location=device, weights_only=True)
     if is_deepspeed:
         state_dict = state_dict['module']
 
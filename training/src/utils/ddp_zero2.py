@@ -22,6 +22,9 @@ except ImportError:  # pytorch_lightning >= 1.8
     except ImportError:  # pytorch_lightning >= 1.9
         from lightning_fabric.utilities.types import _PATH
 
+from src.utils.async_checkpoint import AsyncShardedCheckpointer
+from src.utils.async_checkpoint import is_sharded_checkpoint, load_sharded_checkpoint
+
 
 class DistAdamNativeMixedPrecisionPlugin(NativeMixedPrecisionPlugin):
 
@@ -111,31 +114,54 @@ class DDPStrategyZero2(DDPStrategy):
         else:
             return optimizer.state_dict()
 
+    @property
+    def async_checkpointer(self) -> AsyncShardedCheckpointer:
+        if getattr(self, '_async_checkpointer', None) is None:
+            self._async_checkpointer = AsyncShardedCheckpointer(self.global_rank, self.world_size)
+        return self._async_checkpointer
+
     def save_checkpoint(
         self, checkpoint: Dict[str, Any], filepath: _PATH, storage_options: Optional[Any] = None
     ) -> None:
-        """Save model/training states as a checkpoint file through state-dump and file-write.
+        """Save model/training states as a checkpoint directory, asynchronously: each rank
+        snapshots its states to pinned host memory, and the files are written in the background
+        (see AsyncShardedCheckpointer). Training resumes as soon as the snapshot is taken.
         Args:
             checkpoint: dict containing model and trainer state
-            filepath: write-target file's path
-            storage_options: parameter for how to save to storage, passed to ``CheckpointIO`` plugin
+            filepath: write-target directory's path
+            storage_options: not supported
         """
-        filepath = Path(filepath)
-        filepath.mkdir(parents=True, exist_ok=True)
         local_optimizer_states = checkpoint.pop('optimizer_states')
+        states = {f'{self.global_rank:03d}_optim_states': local_optimizer_states}
         if self.is_global_zero:
-            self.checkpoint_io.save_checkpoint(checkpoint, filepath / 'model_states.pt',
-                                               storage_options=storage_options)
-        self.checkpoint_io.save_checkpoint(local_optimizer_states,
-                                           filepath / f'{self.global_rank:03d}_optim_states.pt',
-                                           storage_options=storage_options)
+            states['model_states'] = checkpoint
+        self.async_checkpointer.save(filepath, states)
+
+    def remove_checkpoint(self, filepath: _PATH) -> None:
+        # The checkpoint could still be being written
+        self.async_checkpointer.wait()
+        super().remove_checkpoint(filepath)
+
+    def teardown(self) -> None:
+        if getattr(self, '_async_checkpointer', None) is not None:
+            self._async_checkpointer.close()
+            self._async_checkpointer = None
+        super().teardown()
 
     def load_checkpoint(self, checkpoint_path: _PATH) -> Dict[str, Any]:
         torch.cuda.empty_cache()
         checkpoint_path = Path(checkpoint_path)
         if checkpoint_path.is_file():
             return super().load_checkpoint(self, str(checkpoint_path))
-        else:
+        elif is_sharded_checkpoint(checkpoint_path):
+            # Each rank reads the model states and its own optimizer shard, in parallel
+            optimizer_name = f'{self.global_rank:03d}_optim_states'
+            states = load_sharded_checkpoint(checkpoint_path, ['model_states', optimizer_name],
+                                             map_location={optimizer_name: 'cuda'})
+            global_states = states['model_states']
+            global_states['optimizer_states'] = states[optimizer_name]
+            return global_states
+        else:  # Saved synchronously, with checkpoint_io
             assert checkpoint_path.is_dir()
             global_states = self.checkpoint_io.load_checkpoint(checkpoint_path / 'model_states.pt')
             local_optimizer_states = self.checkpoint_io.load_checkpoint(
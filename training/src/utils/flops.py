@@ -1,6 +1,10 @@
 # Adapted from https://github.com/rwightman/pytorch-image-models/blob/master/benchmark.py
+import math
+
 import torch
 
+from flash_attn.utils.attention_flops import attention_flops, seqlens_from_cu_seqlens
+
 try:
     from deepspeed.profiling.flops_profiler import get_model_profile
     has_deepspeed_profiling = True
@@ -43,3 +47,60 @@ def profile_fvcore(model, input_size=(3, 224, 224), input_dtype=torch.float32, m
     if detailed:
         print(flop_count_table(fca, max_depth=max_depth))
     return fca, fca.total(), aca, aca.total()
+
+
+# Dense (no sparsity) bf16/fp16 tensor core peak, in TFLOPs/s per GPU
+PEAK_TFLOPS = {'H100': 989.0, 'H800': 989.0, 'A100': 312.0, 'A800': 312.0, 'A10': 125.0,
+               'V100': 125.0, 'L4': 121.0, 'A6000': 154.8}
+
+
+def peak_tflops(device_name):
+    """Look up the peak TFLOPs/s of a GPU from its name, e.g. torch.cuda.get_device_name()."""
+    for name, tflops in PEAK_TFLOPS.items():
+        if name in device_name:
+            return tflops
+    return None
+
+
+def gpt_linear_flops_per_token(config):
+    """Forward FLOPs per token of the matmuls of a flash_attn GPTLMHeadModel with config
+    (GPT2Config), other than the attention itself: QKV, out_proj, the MLP (fc1 is twice as wide
+    if gated) and the lm_head.
+    """
+    d = config.hidden_size
+    n_head = config.num_attention_heads
+    n_head_kv = getattr(config, 'n_head_kv', None) or n_head
+    head_dim = d // n_head
+    if config.activation_function in ['glu', 'swiglu', 'geglu']:
+        inner = config.n_inner if config.n_inner is not None else int(8 * d / 3)
+        multiple_of = getattr(config, 'mlp_multiple_of', 128)
+        inner = (inner + multiple_of - 1) // multiple_of * multiple_of
+        mlp = 2 * d * 2 * inner + 2 * inner * d
+    else:
+        inner = config.n_inner if config.n_inner is not None else 4 * d
+        mlp = 2 * d * inner + 2 * inner * d
+    qkv = 2 * d * (n_head + 2 * n_head_kv) * head_dim
+    out_proj = 2 * n_head * head_dim * d
+    pad_vocab_size_multiple = getattr(config, 'pad_vocab_size_multiple', 1)
+    vocab_size = math.ceil(config.vocab_size / pad_vocab_size_multiple) * pad_vocab_size_multiple
+    return config.num_hidden_layers * (qkv + out_proj + mlp) + 2 * d * vocab_size
+
+
+def gpt_flops(config, cu_seqlens):
+    """FLOPs to train (forward + backward) a flash_attn GPTLMHeadModel with config on a batch of
+    sequences with the given cu_seqlens, e.g. the documents of a packed batch, or
+    [0, s, 2s, ..., b * s] for b sequences of s tokens. The causal attention only counts the
+    (query, key) pairs within each sequence and within config.window_size, see attention_flops.
+    The backward does twice the matmuls of the forward. Recomputation (e.g. checkpointing)
+    isn't counted, as it's not useful work.
+    """
+    num_tokens = int(seqlens_from_cu_seqlens(cu_seqlens).sum())
+    attn = attention_flops(cu_seqlens, cu_seqlens, config.num_attention_heads,
+                           config.hidden_size // config.num_attention_heads, causal=True,
+                           window_size=getattr(config, 'window_size', (-1, -1)))
+    return 3 * (num_tokens * gpt_linear_flops_per_token(config) + config.num_hidden_layers * attn)
+
+
+def gpt_flops_per_token(config, seqlen):
+    """FLOPs to train on one token of a batch of sequences of seqlen tokens, see gpt_flops."""
+    return gpt_flops(config, [0, seqlen]) / seqlen
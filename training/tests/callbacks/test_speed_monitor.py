@@ -0,0 +1,89 @@
+import time
+from types import SimpleNamespace
+
+import pytest
+
+import torch
+
+from src.callbacks.speed_monitor import SpeedMonitor
+
+
+class FakeLogger:
+
+    def __init__(self):
+        self.logs = []
+
+    def log_metrics(self, metrics, step=None):
+        self.logs.append(metrics)
+
+
+class FakeModule(torch.nn.Module):
+
+    def __init__(self):
+        super().__init__()
+        self.model = torch.nn.Linear(8, 8)
+
+    @property
+    def device(self):
+        return self.model.weight.device
+
+
+def test_speed_monitor_phase_time():
+    """Drive the hooks in the order of a training step, with known sleeps in each phase."""
+    sleep_ms = {'data': 10, 'forward': 30, 'backward': 20, 'communication': 10, 'optimizer': 10}
+    flops_per_token, batch_size, seqlen = 1e9, 2, 16
+    monitor = SpeedMonitor(phase_time=True, flops_per_token=flops_per_token, peak_tflops=1.0)
+    trainer = SimpleNamespace(logger=FakeLogger(), global_step=0,
+                              _logger_connector=SimpleNamespace(should_update_logs=True))
+    pl_module = FakeModule()
+    sleep = lambda phase: time.sleep(sleep_ms[phase] / 1000)
+    monitor.on_train_start(trainer, pl_module)
+    monitor.on_train_epoch_start(trainer, pl_module)
+    x = torch.randn(batch_size, seqlen, 8)
+    for step in range(5):
+        if step > 0:
+            sleep('data')
+        monitor.on_train_batch_start(trainer, pl_module, (x, None), step)
+        loss = pl_module.model(x).square().sum()
+        sleep('forward')
+        monitor.on_before_backward(trainer, pl_module, loss)
+        sleep('backward')
+        loss.backward()  # The last gradient ends the backward phase
+        sleep('communication')
+        monitor.on_after_backward(trainer, pl_module)
+        monitor.on_before_optimizer_step(trainer, pl_module, None)
+        sleep('optimizer')
+        pl_module.model.zero_grad()
+        monitor.on_train_batch_end(trainer, pl_module, None, (x, None), step)
+        trainer.global_step += 1
+    logs = trainer.logger.logs[-1]
+    # The times of a step are logged at the end of the next one, and the first step has no data
+    # phase, so the median is over steps that all have the 5 phases
+    for phase, ms in sleep_ms.items():
+        assert logs[f'time/{phase}_p50 (ms)'] == pytest.approx(ms, abs=8)
+        assert logs[f'time/{phase}_p50 (ms)'] <= logs[f'time/{phase}_p99 (ms)']
+    step_ms = logs['time/step_p50 (ms)']
+    assert step_ms == pytest.approx(sum(sleep_ms.values()), abs=20)
+    # MFU is the model FLOPs over the time of the steps in the window, and the peak FLOPs
+    mfu = flops_per_token * batch_size * seqlen / (step_ms / 1000) / 1e12
+    assert logs['perf/mfu'] == pytest.approx(mfu, rel=0.2)
+
+
+def test_speed_monitor_gpt_flops():
+    """Without flops_per_token, the FLOPs of a packed batch come from the model config and only
+    count the documents, not the padding segments.
+    """
+    from transformers import GPT2Config
+
+    from src.utils.flops import gpt_flops
+
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    pl_module = SimpleNamespace(model=SimpleNamespace(config=config))
+    batch = {'input_ids': torch.zeros(2, 32, dtype=torch.long),
+             'cu_seqlens': torch.tensor([0, 10, 32, 50, 64], dtype=torch.int32),
+             'doc_cu_seqlens': torch.tensor([0, 10, 32, 50], dtype=torch.int32)}
+    monitor = SpeedMonitor(phase_time=True)
+    assert monitor._step_flops_fn(pl_module, batch)() == gpt_flops(config, [0, 10, 32, 50])
+    x = torch.zeros(2, 32, dtype=torch.long)
+    assert (monitor._step_flops_fn(pl_module, (x, x))()
+            == gpt_flops(config, [0, 32, 64]))
@@ -0,0 +1,77 @@
+import itertools
+
+import pytest
+
+import torch
+
+from src.datamodules.fault_tolerant_sampler import FeistelPermutation
+from src.datamodules.fault_tolerant_sampler import RandomFaultTolerantSampler
+from src.datamodules.fault_tolerant_sampler import FaultTolerantDistributedSampler
+
+
+@pytest.mark.parametrize('n', [1, 2, 7, 64, 1000, (1 << 12) + 3])
+def test_feistel_permutation(n):
+    perm = FeistelPermutation(n, seed=0)
+    indices = list(perm)
+    assert sorted(indices) == list(range(n))
+    # Random access gives the same as iterating
+    for i in [0, n // 3, n - 1]:
+        assert perm[i] == indices[i]
+    with pytest.raises(IndexError):
+        perm[n]
+    if n >= 64:
+        assert indices != list(range(n))
+        assert list(FeistelPermutation(n, seed=1)) != indices
+        assert list(FeistelPermutation(n, seed=0)) == indices
+
+
+def test_random_fault_tolerant_sampler_resume():
+    dataset = list(range(100))
+    indices = list(RandomFaultTolerantSampler(dataset,
+                                              generator=torch.Generator().manual_seed(0)))
+    assert sorted(indices) == dataset
+    sampler = RandomFaultTolerantSampler(dataset, generator=torch.Generator().manual_seed(0))
+    iterator = iter(sampler)
+    first = list(itertools.islice(iterator, 30))
+    assert first == indices[:30]
+    state_dict = sampler.state_dict()
+    assert state_dict['counter'] == 30
+    sampler_resumed = RandomFaultTolerantSampler(dataset,
+                                                 generator=torch.Generator().manual_seed(1))
+    sampler_resumed.load_state_dict(state_dict)
+    assert list(sampler_resumed) == indices[30:]
+    # The next epoch is a different permutation
+    assert list(sampler_resumed) != indices
+
+
+@pytest.mark.parametrize('drop_last', [False, True])
+@pytest.mark.parametrize('shuffle', [False, True])
+def test_fault_tolerant_distributed_sampler(shuffle, drop_last):
+    dataset, num_replicas = list(range(103)), 4
+    samplers = [FaultTolerantDistributedSampler(dataset, num_replicas=num_replicas, rank=rank,
+                                                shuffle=shuffle, drop_last=drop_last)
+                for rank in range(num_replicas)]
+    indices = [list(sampler) for sampler in samplers]
+    assert all(len(idx) == samplers[0].num_samples for idx in indices)
+    all_indices = [i for idx in indices for i in idx]
+    if drop_last:
+        assert len(set(all_indices)) == len(all_indices) == samplers[0].total_size
+    else:
+        assert set(all_indices) == set(dataset)
+    if not shuffle:
+        for rank in range(num_replicas):
+            assert indices[rank] == [i % len(dataset) for i in
+                                     range(rank, samplers[0].total_size, num_replicas)]
+    else:
+        assert indices[0] != sorted(indices[0])
+    # Resume in the middle of the epoch
+    sampler = samplers[1]
+    iterator = iter(sampler)
+    assert list(itertools.islice(iterator, 5)) == indices[1][:5]
+    sampler_resumed = FaultTolerantDistributedSampler(dataset, num_replicas=num_replicas, rank=1,
+                                                      shuffle=shuffle, drop_last=drop_last)
+    sampler_resumed.load_state_dict(sampler.state_dict())
+    assert list(sampler_resumed) == indices[1][5:]
+    if shuffle:
+        sampler_resumed.set_epoch(1)
+        assert list(sampler_resumed) != indices[1]
@@ -0,0 +1,40 @@
+import pickle
+
+import pytest
+
+import numpy as np
+
+from src.datamodules.datasets.mmap_tokens import MMapTokens, MMapTokensWriter
+
+
+@pytest.mark.parametrize('dtype', [np.uint16, np.uint32])
+@pytest.mark.parametrize('shard_size', [7, 100, 1 << 20])
+def test_mmap_tokens(tmp_path, shard_size, dtype):
+    rng = np.random.default_rng(0)
+    docs = [rng.integers(0, np.iinfo(dtype).max, size=rng.integers(0, 20)) for _ in range(30)]
+    writer = MMapTokensWriter(tmp_path / 'train', dtype, shard_size=shard_size)
+    # Some documents are written one by one, the others concatenated in batches
+    writer.write(docs[0])
+    for i in range(1, len(docs), 3):
+        batch = docs[i:i + 3]
+        writer.write(np.concatenate(batch), doc_lens=np.array([len(doc) for doc in batch]))
+    # Not readable until it's closed
+    assert not (tmp_path / 'train' / 'index.json').exists()
+    writer.close()
+    tokens_ref = np.concatenate(docs)
+    tokens = MMapTokens(tmp_path / 'train')
+    assert len(tokens) == len(tokens_ref)
+    assert tokens.num_docs == len(docs)
+    assert all(size <= shard_size for size in tokens.shard_sizes)
+    for start, stop in [(0, len(tokens_ref)), (3, 9), (5, 5), (len(tokens_ref) - 4, None)]:
+        assert np.array_equal(tokens[start:stop], tokens_ref[start:stop])
+    assert tokens[len(tokens_ref) - 1] == tokens_ref[-1]
+    for i, doc in enumerate(docs):
+        assert np.array_equal(tokens.document(i), doc)
+    # A slice within a shard is a view of the memory map
+    if shard_size > len(tokens_ref):
+        assert np.shares_memory(tokens[2:6], tokens._shard(0))
+    # Pickling (e.g. for dataloader workers) doesn't copy the tokens
+    tokens_unpickled = pickle.loads(pickle.dumps(tokens))
+    assert not tokens_unpickled._shards
+    assert np.array_equal(tokens_unpickled[0:len(tokens_ref)], tokens_ref)
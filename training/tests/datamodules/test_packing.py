@@ -0,0 +1,107 @@
+import pytest
+
+import numpy as np
+
+import src.datamodules.datasets.packing as packing
+from src.datamodules.datasets.mmap_tokens import MMapTokens, MMapTokensWriter
+from src.datamodules.datasets.packing import PackedDocumentDataset, VarlenCollator
+from src.datamodules.datasets.packing import first_fit_decreasing
+
+
+def test_first_fit_decreasing():
+    lengths = [5, 9, 3, 2, 7, 1, 4, 6]
+    bins = first_fit_decreasing(lengths, capacity=10)
+    assert sorted(i for b in bins for i in b) == list(range(len(lengths)))
+    assert all(sum(lengths[i] for i in b) <= 10 for b in bins)
+    # 37 tokens can't fit in fewer than 4 bins of 10
+    assert len(bins) == 4
+
+
+@pytest.mark.parametrize('shuffle', [False, True])
+@pytest.mark.parametrize('lookahead', [1, 8, 1000])
+def test_packed_document_dataset(tmp_path, lookahead, shuffle):
+    seq_len = 16
+    rng = np.random.default_rng(0)
+    docs = [rng.integers(1, 1000, size=rng.integers(1, 40)) for _ in range(50)]
+    writer = MMapTokensWriter(tmp_path / 'train', np.uint16)
+    for doc in docs:
+        writer.write(doc)
+    writer.close()
+    dataset = PackedDocumentDataset(MMapTokens(tmp_path / 'train'), seq_len,
+                                    lookahead=lookahead, shuffle=shuffle)
+    sequences = list(dataset)
+    assert all(sum(len(doc) - 1 for doc in seq) <= seq_len for seq in sequences)
+    # Every (input, target) pair of every document is in exactly one sequence
+    pairs_ref = sorted((int(a), int(b)) for doc in docs for a, b in zip(doc[:-1], doc[1:]))
+    pairs = sorted((int(a), int(b)) for seq in sequences for doc in seq
+                   for a, b in zip(doc[:-1], doc[1:]))
+    assert pairs == pairs_ref
+    num_tokens = sum(len(doc) - 1 for doc in docs)
+    if lookahead > 1:
+        # Packing leaves little padding compared to one document per sequence
+        assert len(sequences) < sum(-(-(len(doc) - 1) // seq_len) for doc in docs)
+    if lookahead >= len(docs):
+        assert len(sequences) <= -(-num_tokens // seq_len) + 1
+
+    collator = VarlenCollator(seq_len)
+    batch = collator(sequences[:4])
+    input_ids, labels = batch['input_ids'].numpy(), batch['labels'].numpy()
+    position_ids, cu_seqlens = batch['position_ids'].numpy(), batch['cu_seqlens'].numpy()
+    assert input_ids.shape == labels.shape == position_ids.shape == (4, seq_len)
+    assert cu_seqlens.dtype == np.int32 and cu_seqlens[-1] == 4 * seq_len
+    assert batch['max_seqlen'] == np.diff(cu_seqlens).max()
+    # Sequences never cross rows, and each one is a document (or the padding of a row)
+    docs_in_batch = [doc for seq in sequences[:4] for doc in seq]
+    input_ids, labels, position_ids = input_ids.flatten(), labels.flatten(), position_ids.flatten()
+    num_docs = 0
+    for start, end in zip(cu_seqlens[:-1], cu_seqlens[1:]):
+        assert start // seq_len == (end - 1) // seq_len
+        assert np.array_equal(position_ids[start:end], np.arange(end - start))
+        if labels[start] == -100:  # Padding
+            assert np.all(labels[start:end] == -100) and end % seq_len == 0
+        else:
+            doc = docs_in_batch[num_docs]
+            assert np.array_equal(input_ids[start:end], doc[:-1])
+            assert np.array_equal(labels[start:end], doc[1:])
+            num_docs += 1
+    assert num_docs == len(docs_in_batch)
+    # The padding segments are left out of doc_cu_seqlens
+    doc_cu_seqlens = batch['doc_cu_seqlens'].numpy()
+    assert np.array_equal(np.diff(doc_cu_seqlens), [len(doc) - 1 for doc in docs_in_batch])
+
+
+def write_docs(path, num_docs):
+    rng = np.random.default_rng(0)
+    docs = [rng.integers(1, 1000, size=rng.integers(1, 40)) for _ in range(num_docs)]
+    writer = MMapTokensWriter(path, np.uint16)
+    for doc in docs:
+        writer.write(doc)
+    writer.close()
+    return MMapTokens(path)
+
+
+@pytest.mark.parametrize('world_size', [2, 3])
+def test_packed_document_dataset_ddp(tmp_path, monkeypatch, world_size):
+    tokens = write_docs(tmp_path / 'train', 50)
+    dataset = PackedDocumentDataset(tokens, 16, lookahead=8, shuffle=True)
+    sequences_ref = [[doc.tolist() for doc in seq] for seq in dataset]
+    monkeypatch.setattr(packing.dist, 'is_initialized', lambda: True)
+    monkeypatch.setattr(packing.dist, 'get_world_size', lambda: world_size)
+    sequences = []
+    for rank in range(world_size):
+        monkeypatch.setattr(packing.dist, 'get_rank', lambda: rank)
+        sequences.append([[doc.tolist() for doc in seq] for seq in dataset])
+    # Every rank gets the same number of sequences, so DDP doesn't hang, and only the last
+    # sequences (fewer than world_size) are dropped
+    num_sequences = len(sequences_ref) // world_size
+    assert all(len(seqs) == num_sequences for seqs in sequences)
+    for rank, seqs in enumerate(sequences):
+        assert seqs == sequences_ref[rank:num_sequences * world_size:world_size]
+
+
+def test_packed_document_dataset_set_epoch(tmp_path):
+    dataset = PackedDocumentDataset(write_docs(tmp_path / 'train', 50), 16, shuffle=True)
+    sequences = [[doc.tolist() for doc in seq] for seq in dataset]
+    assert [[doc.tolist() for doc in seq] for seq in dataset] == sequences
+    dataset.set_epoch(1)
+    assert [[doc.tolist() for doc in seq] for seq in dataset] != sequences
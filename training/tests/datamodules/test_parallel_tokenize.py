@@ -0,0 +1,89 @@
+import pytest
+
+import numpy as np
+
+from src.datamodules.datasets.parallel_tokenize import PART_NAME, tokenize_to_mmap_tokens
+
+
+class ColumnsDataset:
+    """Minimal stand-in for a HF Dataset: slicing returns a dict of columns."""
+
+    def __init__(self, **columns):
+        self.columns = columns
+
+    def __len__(self):
+        return len(next(iter(self.columns.values())))
+
+    def __getitem__(self, idx):
+        return {name: column[idx] for name, column in self.columns.items()}
+
+
+def get_datasets():
+    rng = np.random.default_rng(0)
+    texts = {split: [''.join(chr(c) for c in rng.integers(97, 123, size=rng.integers(0, 30)))
+                     for _ in range(num_examples)]
+             for split, num_examples in [('train', 103), ('validation', 5)]}
+    return {split: ColumnsDataset(text=split_texts) for split, split_texts in texts.items()}
+
+
+def tokenize_fn(examples):
+    return [[ord(c) for c in text] for text in examples['text']]
+
+
+@pytest.mark.parametrize('num_proc', [1, 3])
+def test_tokenize_to_mmap_tokens(tmp_path, num_proc):
+    datasets = get_datasets()
+    tokens = tokenize_to_mmap_tokens(datasets, tokenize_fn, tmp_path, np.uint16, num_parts=8,
+                                     num_proc=num_proc, batch_size=4)
+    for split, dataset in datasets.items():
+        docs = tokenize_fn(dataset[0:len(dataset)])
+        tokens_ref = np.array(sum(docs, []), dtype=np.uint16)
+        assert np.array_equal(tokens[split][0:len(tokens[split])], tokens_ref)
+        assert tokens[split].num_docs == len(docs)
+        for i in [0, len(docs) // 2, len(docs) - 1]:
+            assert tokens[split].document(i).tolist() == docs[i]
+
+
+def test_tokenize_to_mmap_tokens_resume(tmp_path):
+    datasets = get_datasets()
+    tokens_ref = tokenize_to_mmap_tokens(datasets, tokenize_fn, tmp_path, np.uint16, num_parts=8)
+    tokens_ref = {split: t[0:len(t)].copy() for split, t in tokens_ref.items()}
+    # Interrupted while writing a part, and a part that got corrupted
+    (tmp_path / 'train' / f'{PART_NAME.format(2)}.json').unlink()
+    with open(tmp_path / 'train' / f'{PART_NAME.format(5)}.bin', 'r+b') as f:
+        f.write(b'\xff\xff')
+    num_tokenized = []
+
+    def tokenize_fn_counted(examples):
+        num_tokenized.append(len(examples['text']))
+        return tokenize_fn(examples)
+
+    tokens = tokenize_to_mmap_tokens(datasets, tokenize_fn_counted, tmp_path, np.uint16,
+                                     num_parts=8)
+    # Only these 2 parts are tokenized again
+    bounds = np.linspace(0, len(datasets['train']), 9).astype(np.int64)
+    assert sum(num_tokenized) == (bounds[3] - bounds[2]) + (bounds[6] - bounds[5])
+    for split in datasets:
+        assert np.array_equal(tokens[split][0:len(tokens[split])], tokens_ref[split])
+
+
+def test_tokenize_to_mmap_tokens_fingerprint(tmp_path):
+    datasets = get_datasets()
+    tokenize_to_mmap_tokens(datasets, tokenize_fn, tmp_path, np.uint16, num_parts=8,
+                            fingerprint='a')
+    num_tokenized = []
+
+    def tokenize_fn_upper(examples):
+        num_tokenized.append(len(examples['text']))
+        return [[ord(c.upper()) for c in text] for text in examples['text']]
+
+    # Same fingerprint: nothing to do. Another fingerprint (e.g. another tokenizer): all the
+    # parts are tokenized again, none of the stale ones are reused.
+    tokenize_to_mmap_tokens(datasets, tokenize_fn_upper, tmp_path, np.uint16, num_parts=8,
+                            fingerprint='a')
+    assert sum(num_tokenized) == 0
+    tokens = tokenize_to_mmap_tokens(datasets, tokenize_fn_upper, tmp_path, np.uint16,
+                                     num_parts=8, fingerprint='b')
+    assert sum(num_tokenized) == sum(len(dataset) for dataset in datasets.values())
+    docs = tokenize_fn_upper(datasets['train'][0:len(datasets['train'])])
+    assert tokens['train'][0:len(tokens['train'])].tolist() == sum(docs, [])
@@ -0,0 +1,106 @@
+import copy
+import os
+import socket
+
+import pytest
+
+import torch
+import torch.distributed as dist
+import torch.multiprocessing as mp
+from torch.distributed.optim import ZeroRedundancyOptimizer
+
+from src.utils.async_checkpoint import AsyncShardedCheckpointer
+from src.utils.async_checkpoint import is_sharded_checkpoint, load_sharded_checkpoint
+
+
+def assert_equal(a, b):
+    if isinstance(a, torch.Tensor):
+        assert isinstance(b, torch.Tensor) and a.dtype == b.dtype and torch.equal(a, b)
+    elif isinstance(a, dict):
+        assert a.keys() == b.keys()
+        for k in a:
+            assert_equal(a[k], b[k])
+    elif isinstance(a, (list, tuple)):
+        assert type(a) == type(b) and len(a) == len(b)
+        for x, y in zip(a, b):
+            assert_equal(x, y)
+    else:
+        assert a == b
+
+
+def test_async_checkpoint_single_rank(tmp_path):
+    objects = {
+        'model_states': {'state_dict': {'w': torch.randn(3, 5), 'b': torch.arange(7),
+                                        'mask': torch.rand(4) > 0.5, 'empty': torch.empty(0, 2),
+                                        'half': torch.randn(2, 3, dtype=torch.bfloat16),
+                                        'strided': torch.randn(4, 6)[:, ::2]},
+                         'epoch': 3, 'hparams': {'lr': 1e-3, 'name': 'gpt2'}},
+    }
+    expected = copy.deepcopy(objects)
+    checkpointer = AsyncShardedCheckpointer(rank=0, world_size=1)
+    checkpointer.save(tmp_path, objects)
+    # The snapshot was taken, modifying the objects doesn't change what is saved
+    objects['model_states']['state_dict']['w'].zero_()
+    checkpointer.wait()
+    assert is_sharded_checkpoint(tmp_path)
+    assert_equal(load_sharded_checkpoint(tmp_path, ['model_states']), expected)
+    # Saving again to the same directory reuses the staging buffer
+    buffer = checkpointer._buffer
+    checkpointer.save(tmp_path, objects)
+    checkpointer.close()
+    assert checkpointer._buffer is buffer
+    assert torch.equal(load_sharded_checkpoint(tmp_path, ['model_states'])
+                       ['model_states']['state_dict']['w'], torch.zeros(3, 5))
+    # Without the manifest, the checkpoint is incomplete
+    (tmp_path / 'manifest.json').unlink()
+    with pytest.raises(ValueError):
+        load_sharded_checkpoint(tmp_path, ['model_states'])
+
+
+def _save_and_load(rank, world_size, path, port):
+    os.environ['MASTER_ADDR'] = '127.0.0.1'
+    os.environ['MASTER_PORT'] = str(port)
+    dist.init_process_group('gloo', rank=rank, world_size=world_size)
+    torch.manual_seed(0)
+    model = torch.nn.Sequential(torch.nn.Linear(16, 32), torch.nn.ReLU(), torch.nn.Linear(32, 4))
+    optimizer = ZeroRedundancyOptimizer(model.parameters(), optimizer_class=torch.optim.AdamW,
+                                        lr=1e-2)
+
+    def step():
+        optimizer.zero_grad()
+        model(torch.randn(8, 16)).sum().backward()
+        optimizer.step()
+
+    checkpointer = AsyncShardedCheckpointer(rank, world_size)
+    for num_saves in range(2):  # The second save overwrites the first one
+        step()
+        objects = {f'{rank:03d}_optim_states': optimizer.optim.state_dict()}
+        if rank == 0:
+            objects['model_states'] = {'state_dict': model.state_dict(), 'step': num_saves}
+        expected = copy.deepcopy(objects)
+        checkpointer.save(path, objects)
+        # Training goes on while the checkpoint is written
+        step()
+        checkpointer.wait()
+        dist.barrier()
+        assert is_sharded_checkpoint(path)
+        # Each rank only reads its own shard
+        loaded = load_sharded_checkpoint(path, list(expected.keys()))
+        assert_equal(loaded, expected)
+    # The shard restores the state of the local optimizer
+    optimizer.optim.load_state_dict(loaded[f'{rank:03d}_optim_states'])
+    assert_equal(optimizer.optim.state_dict(), expected[f'{rank:03d}_optim_states'])
+    checkpointer.close()
+    dist.destroy_process_group()
+
+
+def test_async_checkpoint_gloo(tmp_path):
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        port = s.getsockname()[1]
+    world_size = 2
+    mp.spawn(_save_and_load, args=(world_size, tmp_path, port), nprocs=world_size)
+    assert sorted(p.name for p in tmp_path.iterdir()) == [
+        '000_optim_states', '001_optim_states', 'manifest.json', 'model_states',
+        'rank_000.json', 'rank_001.json'
+    ]
@@ -0,0 +1,44 @@
+import pytest
+
+import torch
+from transformers import GPT2Config
+
+from flash_attn.models.gpt import GPTLMHeadModel
+
+from src.utils.flops import gpt_flops, gpt_flops_per_token, peak_tflops
+
+
+@pytest.mark.parametrize('activation', ['gelu_new', 'swiglu'])
+@pytest.mark.parametrize('n_head_kv', [4, 1])
+def test_gpt_flops_per_token(n_head_kv, activation):
+    seqlen = 32
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=100, n_positions=128,
+                        activation_function=activation, pad_vocab_size_multiple=8)
+    config.n_head_kv = n_head_kv
+    model = GPTLMHeadModel(config, device='meta')
+    # Each weight of a linear layer is one multiply-add per token in the forward
+    linear_params = sum(m.weight.numel() for m in model.modules()
+                        if isinstance(m, torch.nn.Linear))
+    attn = 2 * 2 * config.n_embd * (seqlen + 1) / 2 * config.n_layer
+    assert gpt_flops_per_token(config, seqlen) == 3 * (2 * linear_params + attn)
+
+
+def test_gpt_flops_packed():
+    config = GPT2Config(n_embd=64, n_head=4, n_layer=2, vocab_size=128, n_positions=128)
+    # The documents of a packed batch don't attend to each other
+    packed = gpt_flops(config, [0, 10, 32, 64])
+    separate = sum(gpt_flops(config, [0, n]) for n in [10, 22, 32])
+    assert packed == separate < gpt_flops(config, [0, 32, 64])
+    # With a sliding window, each query attends to at most 8 keys
+    flops_full = gpt_flops(config, [0, 64])
+    config.window_size = (7, 0)
+    flops_window = gpt_flops(config, [0, 64])
+    pairs_full, pairs_window = 64 * 65 // 2, sum(min(i + 1, 8) for i in range(64))
+    flops_per_pair = 3 * config.n_layer * 2 * 2 * config.n_embd
+    assert flops_full - flops_window == flops_per_pair * (pairs_full - pairs_window)
+
+
+def test_peak_tflops():
+    assert peak_tflops('NVIDIA A100-SXM4-80GB') == 312.0
+    assert peak_tflops('NVIDIA H100 80GB HBM3') == 989.0
+    assert peak_tflops('Some CPU') is None